@@ -0,0 +1,307 @@
+#pragma once
+
+/*****************************************************************
+ *
+ * A logger that formats on a background thread.
+ *
+ *   AsyncLogger<PosixFile> log{ PosixFile(fd) };
+ *
+ *   log.log("request ", id, " took ", usec, " us\n");
+ *
+ * The calling thread only stores the arguments, in binary, into a
+ * slot of a lock-free queue, together with a pointer to the function
+ * that prints this list of argument types (the "format id").  The
+ * background thread renders them with Stream::print into a
+ * BufferedWriter, which it flushes whenever the queue runs empty: a
+ * record is written out at the latest once the burst it came in has
+ * been rendered, and records logged faster than that are written
+ * out in batches.
+ *
+ * Arguments are stored by value, so they must be trivially copyable.
+ * A `const char*` is stored as the pointer: pass string literals or
+ * other strings that outlive the logger.
+ *
+ *****************************************************************/
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+
+#include "StreamDefs.h"
+#include "Print.h"
+#include "BufferedWriter.h"
+
+namespace Stream {
+
+    template <class Writer, size_t ArgBytes = 48>
+    class AsyncLogger {
+    public:
+        typedef BufferedWriter<Writer> Output;
+
+        AsyncLogger() {}
+
+        // `capacity` is the number of queue slots, rounded up to a
+        // power of two.
+        explicit
+        AsyncLogger(Writer&& file, size_t capacity = 4096, size_t buffer_size = 65536)
+            : body(new Body(Output(std::move(file), buffer_size, buffer_size / 4), capacity))
+        {
+            start();
+        }
+
+        AsyncLogger(AsyncLogger&& that) {
+            body = std::move(that.body);
+        }
+
+        AsyncLogger& operator= (AsyncLogger&& that) {
+            body = std::move(that.body);
+            return *this;
+        }
+
+        ~AsyncLogger() {
+            if (body == nullptr) { return; }
+
+            {
+                std::lock_guard<std::mutex> lock(body->mtx);
+                body->is_running = false;
+                body->cnd_work.notify_all();
+            }
+            body->logger_thread.join();
+        }
+
+        AsyncLogger(const AsyncLogger&) = delete;
+        AsyncLogger& operator= (const AsyncLogger&) = delete;
+
+        // Queues one log record; waits while the queue is full.
+        template <class... Types>
+        void log(const Types&... args) {
+            while (!body->template push<typename std::decay<const Types>::type...>(args...)) {
+                std::this_thread::yield();
+            }
+        }
+
+        // Queues one log record; drops it if the queue is full.
+        template <class... Types>
+        bool try_log(const Types&... args) {
+            if (body->template push<typename std::decay<const Types>::type...>(args...)) {
+                return true;
+            }
+            body->dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        // Waits until the records queued before the call are written.
+        void flush() {
+            body->flush();
+        }
+
+        // Records dropped by try_log.
+        size_t dropped() const {
+            return body->dropped.load(std::memory_order_relaxed);
+        }
+
+        Output& output() {
+            return body->output;
+        }
+
+    private:
+        typedef void (*RenderFunc)(Output&, void*);
+
+        // With the default ArgBytes, a slot fills a cache line.
+        struct Slot {
+            std::atomic<size_t> seq;
+            RenderFunc render;
+            alignas(alignof(std::max_align_t)) char args[ArgBytes];
+        };
+
+        template <class Tuple, size_t I = 0,
+                  bool End = (I == std::tuple_size<Tuple>::value)>
+        struct PrintTuple {
+            static void apply(Output& out, const Tuple& t) {
+                print(out, std::get<I>(t));
+                PrintTuple<Tuple, I+1>::apply(out, t);
+            }
+        };
+
+        template <class Tuple, size_t I>
+        struct PrintTuple<Tuple, I, true> {
+            static void apply(Output&, const Tuple&) {}
+        };
+
+        // A tuple is not trivially copyable, whatever it holds: its
+        // element types are checked one by one.
+        template <class... Types>
+        struct TriviallyCopyable : std::true_type {};
+
+        template <class Type, class... Types>
+        struct TriviallyCopyable<Type, Types...>
+            : std::integral_constant<bool, std::is_trivially_copyable<Type>::value &&
+                                           TriviallyCopyable<Types...>::value> {};
+
+        template <class... Types>
+        struct Render {
+            typedef std::tuple<Types...> Args;
+
+            static void apply(Output& out, void* args) {
+                Args* t = reinterpret_cast<Args*>(args);
+                PrintTuple<Args>::apply(out, *t);
+                t->~Args();
+            }
+        };
+
+        // A bounded multi-producer queue of slots (D. Vyukov): the
+        // sequence number of a slot tells whether it is free for the
+        // producer of a position, or filled for its consumer.
+        struct Body {
+            Output output;
+
+            std::unique_ptr<Slot[]> slots;
+            size_t mask;
+
+            // Producers and the consumer keep off each other's line.
+            std::atomic<size_t> enqueue_pos;
+            char pad[64];
+            size_t dequeue_pos;
+            std::atomic<size_t> dropped;
+
+            std::thread logger_thread;
+
+            std::mutex mtx;
+            std::condition_variable cnd_work;
+            std::condition_variable cnd_done;
+            size_t flush_target;
+            size_t flushed;
+            bool is_running;
+
+            Body(Output&& out, size_t capacity) : output(std::move(out)) {
+                size_t n = 2;
+                while (n < capacity) { n <<= 1; }
+                slots = std::unique_ptr<Slot[]>(new Slot[n]);
+                for (size_t i = 0; i < n; ++i) {
+                    slots[i].seq.store(i, std::memory_order_relaxed);
+                }
+                mask = n - 1;
+                enqueue_pos = 0;
+                dequeue_pos = 0;
+                dropped = 0;
+                flush_target = 0;
+                flushed = 0;
+                is_running = true;
+            }
+
+            template <class... Types>
+            bool push(const Types&... args) {
+                typedef std::tuple<Types...> Args;
+                static_assert(sizeof(Args) <= ArgBytes,
+                              "AsyncLogger: arguments do not fit in a slot");
+                static_assert(alignof(Args) <= alignof(std::max_align_t),
+                              "AsyncLogger: over-aligned argument");
+                static_assert(TriviallyCopyable<Types...>::value,
+                              "AsyncLogger: arguments must be trivially copyable");
+
+                Slot* slot;
+                size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+                for ( ; ; ) {
+                    slot = &slots[pos & mask];
+                    size_t seq = slot->seq.load(std::memory_order_acquire);
+                    intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+                    if (dif == 0) {
+                        if (enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                                              std::memory_order_relaxed)) {
+                            break;
+                        }
+                    } else if (dif < 0) {
+                        return false;
+                    } else {
+                        pos = enqueue_pos.load(std::memory_order_relaxed);
+                    }
+                }
+
+                new (slot->args) Args(args...);
+                slot->render = &Render<Types...>::apply;
+                slot->seq.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+
+            bool pop() {
+                Slot* slot = &slots[dequeue_pos & mask];
+                if (slot->seq.load(std::memory_order_acquire) != dequeue_pos + 1) {
+                    return false;
+                }
+
+                slot->render(output, slot->args);
+                slot->seq.store(dequeue_pos + mask + 1, std::memory_order_release);
+                dequeue_pos += 1;
+                return true;
+            }
+
+            void keep_logging() {
+                const auto MAX_IDLE = std::chrono::milliseconds(1);
+                auto idle = std::chrono::microseconds(1);
+                bool unflushed = false;
+
+                for ( ; ; ) {
+                    if (pop()) {
+                        idle = std::chrono::microseconds(1);
+                        unflushed = true;
+                        continue;
+                    }
+
+                    // The queue is empty: write out what was rendered,
+                    // answer flushers, then back off.
+                    if (unflushed) {
+                        output.flush();
+                        unflushed = false;
+                        continue;
+                    }
+                    std::unique_lock<std::mutex> lock(mtx);
+                    if (flush_target > flushed) {
+                        size_t target = flush_target;
+                        if (dequeue_pos >= target) {
+                            lock.unlock();
+                            output.flush();
+                            lock.lock();
+                            flushed = target;
+                            cnd_done.notify_all();
+                        }
+                        continue;
+                    }
+                    if (!is_running) { break; }
+
+                    cnd_work.wait_for(lock, idle);
+                    if (idle < MAX_IDLE) { idle *= 2; }
+                }
+
+                while (pop()) {}
+                output.flush();
+            }
+
+            void flush() {
+                std::unique_lock<std::mutex> lock(mtx);
+                size_t target = enqueue_pos.load();
+                if (flush_target < target) { flush_target = target; }
+                cnd_work.notify_all();
+                while (flushed < target && is_running) {
+                    cnd_done.wait(lock);
+                }
+            }
+        };
+
+        std::unique_ptr<Body> body;
+
+        void start() {
+            Body* pbody = body.get();
+            body->logger_thread = std::thread(
+                [ pbody ] { pbody->keep_logging(); }
+            );
+        }
+    };
+
+}
@@ -0,0 +1,556 @@
+#pragma once
+
+/*****************************************************************
+ *
+ * Coroutine streams over non-blocking file descriptors.  C++20.
+ *
+ *   Task<> echo(EventLoop& loop, PosixFile sock) {
+ *       AsyncReader rd(loop, PosixFile(::dup(sock.get())));
+ *       AsyncWriter wr(loop, std::move(sock));
+ *       char line[1024];
+ *       while (size_t n = co_await rd.async_readline(line, sizeof line)) {
+ *           co_await wr.async_write(line, n);
+ *           co_await wr.async_flush();
+ *       }
+ *   }
+ *
+ *   EventLoop loop;
+ *   loop.spawn(echo(loop, std::move(sock)));
+ *   loop.run();
+ *
+ * Instead of a thread blocked in read() per stream (as with
+ * BufferedReader / BufferedWriter), a coroutine that would block is
+ * suspended until epoll reports its descriptor ready, so one thread
+ * runs any number of sessions.  Everything belonging to one EventLoop
+ * must be used from the thread that runs it.
+ *
+ * A task keeps its arguments, but not the lambda it was made from:
+ * spawn a capturing lambda only if the lambda outlives the task.
+ *
+ *****************************************************************/
+
+#if !defined(__cpp_impl_coroutine)
+#error "AsyncStream.h requires C++20 coroutines"
+#endif
+
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <coroutine>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "StreamDefs.h"
+#include "PosixFileDesc.h"
+
+namespace Stream {
+
+    template <class T = void>
+    class Task;
+
+    template <class T>
+    struct _TaskPromiseBase {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+
+            template <class Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+                std::coroutine_handle<> c = h.promise().continuation;
+                return c ? c : std::noop_coroutine();
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void unhandled_exception() {
+            error = std::current_exception();
+        }
+    };
+
+    template <class T>
+    struct _TaskPromise : _TaskPromiseBase<T> {
+        std::optional<T> value;
+
+        Task<T> get_return_object();
+
+        void return_value(T v) {
+            value.emplace(std::move(v));
+        }
+
+        T result() {
+            if (this->error) { std::rethrow_exception(this->error); }
+            return std::move(*value);
+        }
+    };
+
+    template <>
+    struct _TaskPromise<void> : _TaskPromiseBase<void> {
+        Task<void> get_return_object();
+
+        void return_void() {}
+
+        void result() {
+            if (this->error) { std::rethrow_exception(this->error); }
+        }
+    };
+
+    // A coroutine that starts when it is awaited, and resumes its
+    // awaiter when it is done.
+    template <class T>
+    class Task {
+    public:
+        typedef _TaskPromise<T> promise_type;
+        typedef std::coroutine_handle<promise_type> handle_type;
+
+        Task() {}
+        explicit Task(handle_type h) : coro(h) {}
+
+        Task(Task&& that) : coro(std::exchange(that.coro, nullptr)) {}
+
+        Task& operator= (Task&& that) {
+            if (coro) { coro.destroy(); }
+            coro = std::exchange(that.coro, nullptr);
+            return *this;
+        }
+
+        Task(const Task&) = delete;
+        Task& operator= (const Task&) = delete;
+
+        ~Task() {
+            if (coro) { coro.destroy(); }
+        }
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+            coro.promise().continuation = awaiter;
+            return coro;
+        }
+
+        T await_resume() {
+            return coro.promise().result();
+        }
+
+    private:
+        handle_type coro;
+    };
+
+    template <class T>
+    Task<T> _TaskPromise<T>::get_return_object() {
+        return Task<T>(Task<T>::handle_type::from_promise(*this));
+    }
+
+    inline Task<void> _TaskPromise<void>::get_return_object() {
+        return Task<void>(Task<void>::handle_type::from_promise(*this));
+    }
+
+    /*****************************************************************
+     * EventLoop
+     *****************************************************************/
+
+    class EventLoop {
+    public:
+        // Readiness of one descriptor, and the coroutines waiting on it.
+        struct Watch {
+            int fd = -1;
+            bool readable = false;
+            bool writable = false;
+            bool removed = false;
+            std::coroutine_handle<> reader;
+            std::coroutine_handle<> writer;
+        };
+
+        EventLoop() : epfd(::epoll_create1(EPOLL_CLOEXEC)), alive(0), dispatching(false) {
+            if (epfd < 0) {
+                throw StreamException("EventLoop: epoll_create1 failed");
+            }
+        }
+
+        ~EventLoop() {
+            free_removed();
+            ::close(epfd);
+        }
+
+        EventLoop(const EventLoop&) = delete;
+        EventLoop& operator= (const EventLoop&) = delete;
+
+        // Runs `task` on this loop; it starts right away, up to its
+        // first suspension.
+        void spawn(Task<> task) {
+            alive += 1;
+            detach(this, std::move(task));
+        }
+
+        // Runs until every spawned task has finished.  An exception
+        // escaping a spawned task is rethrown from here.
+        void run() {
+            epoll_event events[64];
+            while (alive > 0) {
+                rethrow();
+                int n = ::epoll_wait(epfd, events, 64, -1);
+                if (n < 0) {
+                    if (errno == EINTR) { continue; }
+                    throw StreamException("EventLoop: epoll_wait failed");
+                }
+                // A coroutine resumed for one event may end its session,
+                // and remove watches that later events of the batch
+                // point to: they are freed after the batch.
+                dispatching = true;
+                for (int i = 0; i < n; ++i) {
+                    Watch* w = (Watch*)events[i].data.ptr;
+                    if (!w->removed) { dispatch(w, events[i].events); }
+                }
+                dispatching = false;
+                free_removed();
+            }
+            rethrow();
+        }
+
+        // Edge-triggered, so the descriptor is registered only once.
+        // The watch belongs to the loop; give it back with remove().
+        Watch* add(int fd) {
+            std::unique_ptr<Watch> w(new Watch());
+            w->fd = fd;
+            epoll_event ev = {};
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.ptr = w.get();
+            if (::epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+                throw StreamException("EventLoop: epoll_ctl failed");
+            }
+            return w.release();
+        }
+
+        void remove(Watch* w) {
+            if (w->fd >= 0) {
+                ::epoll_ctl(epfd, EPOLL_CTL_DEL, w->fd, nullptr);
+                w->fd = -1;
+            }
+            w->removed = true;
+            if (dispatching) { removed.push_back(w); }
+            else             { delete w; }
+        }
+
+        struct ReadyAwaiter {
+            Watch& w;
+            bool write;
+
+            bool await_ready() noexcept {
+                bool& ready = write ? w.writable : w.readable;
+                if (ready) {
+                    ready = false;
+                    return true;
+                }
+                return false;
+            }
+
+            void await_suspend(std::coroutine_handle<> h) noexcept {
+                (write ? w.writer : w.reader) = h;
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        // Waits for the descriptor to become ready after an EAGAIN.
+        ReadyAwaiter readable(Watch& w) { return ReadyAwaiter{ w, false }; }
+        ReadyAwaiter writable(Watch& w) { return ReadyAwaiter{ w, true }; }
+
+    private:
+        int epfd;
+        size_t alive;
+        std::exception_ptr error;
+
+        bool dispatching;
+        std::vector<Watch*> removed;    // during a batch
+
+        void free_removed() {
+            for (Watch* w : removed) { delete w; }
+            removed.clear();
+        }
+
+        struct Detached {
+            struct promise_type {
+                Detached get_return_object() { return {}; }
+                std::suspend_never initial_suspend() noexcept { return {}; }
+                std::suspend_never final_suspend() noexcept { return {}; }
+                void return_void() {}
+                void unhandled_exception() {}
+            };
+        };
+
+        static Detached detach(EventLoop* loop, Task<> task) {
+            try {
+                co_await task;
+            } catch (...) {
+                if (!loop->error) { loop->error = std::current_exception(); }
+            }
+            loop->alive -= 1;
+        }
+
+        void rethrow() {
+            if (error) {
+                std::exception_ptr e = std::exchange(error, nullptr);
+                std::rethrow_exception(e);
+            }
+        }
+
+        // A resumed coroutine may destroy `w`: take both handles first.
+        static void dispatch(Watch* w, uint32_t events) {
+            std::coroutine_handle<> r, wr;
+            if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                if (w->reader) { r = std::exchange(w->reader, nullptr); }
+                else           { w->readable = true; }
+            }
+            if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+                if (w->writer) { wr = std::exchange(w->writer, nullptr); }
+                else           { w->writable = true; }
+            }
+            if (r)  { r.resume(); }
+            if (wr) { wr.resume(); }
+        }
+    };
+
+    inline void _set_nonblock(int fd) {
+        int flags = ::fcntl(fd, F_GETFL);
+        if (flags < 0 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+            throw StreamException("cannot make descriptor non-blocking");
+        }
+    }
+
+    /*****************************************************************
+     * AsyncReader
+     *****************************************************************/
+
+    class AsyncReader {
+    public:
+        // A buffer_size of zero is 4096 bytes, and ADVISED_SIZE lets the
+        // file choose (see Advise).
+        AsyncReader(EventLoop& l, PosixFile&& f, size_t buffer_size = 0)
+            : loop(l), file(std::move(f)), head(0), tail(0), at_end(false)
+        {
+            size = _ring_size(file, buffer_size, false);
+            buffer.reset(new char[size]);
+            _set_nonblock(file.get());
+            watch = loop.add(file.get());
+        }
+
+        ~AsyncReader() {
+            loop.remove(watch);
+        }
+
+        AsyncReader(const AsyncReader&) = delete;
+        AsyncReader& operator= (const AsyncReader&) = delete;
+
+        // Reads `length` bytes, or fewer at the end of stream.
+        Task<size_t> async_read(void* data, size_t length) {
+            char* out = (char*)data;
+            size_t done = 0;
+            while (done < length) {
+                if (head == tail) {
+                    bool more = co_await fill();
+                    if (!more) { break; }
+                }
+                size_t n = std::min(length - done, tail - head);
+                std::memcpy(out + done, buffer.get() + head, n);
+                head += n;
+                done += n;
+            }
+            co_return done;
+        }
+
+        // As BufferedReader::readline: reads up to and including `eol`,
+        // at most `length` bytes.  Returns 0 at the end of stream.
+        Task<size_t> async_readline(char* out, size_t length, const char* eol = "\n") {
+            const size_t eol_len = std::strlen(eol);
+            size_t done = 0;
+
+            while (done < length) {
+                char* begin = buffer.get() + head;
+                char* end   = buffer.get() + tail;
+                char* found = std::search(begin, end, eol, eol + eol_len);
+
+                if (found != end) {
+                    size_t n = std::min<size_t>(length - done, found + eol_len - begin);
+                    std::memcpy(out + done, begin, n);
+                    head += n;
+                    done += n;
+                    break;
+                }
+
+                // Keep what could be the start of `eol` in the buffer.
+                size_t keep = std::min<size_t>(eol_len - 1, end - begin);
+                size_t n = std::min<size_t>(length - done, end - begin - keep);
+                std::memcpy(out + done, begin, n);
+                head += n;
+                done += n;
+                if (done == length) { break; }
+
+                bool more = co_await fill();
+                if (!more) {
+                    n = std::min(length - done, tail - head);
+                    std::memcpy(out + done, buffer.get() + head, n);
+                    head += n;
+                    done += n;
+                    break;
+                }
+            }
+            co_return done;
+        }
+
+    private:
+        EventLoop& loop;
+        PosixFile file;
+        EventLoop::Watch* watch;
+
+        std::unique_ptr<char[]> buffer;
+        size_t size;
+        size_t head;
+        size_t tail;
+        bool at_end;
+
+        // Reads more into the buffer.  False at the end of stream.
+        Task<bool> fill() {
+            if (head != 0) {
+                std::memmove(buffer.get(), buffer.get() + head, tail - head);
+                tail -= head;
+                head = 0;
+            }
+            while (!at_end && tail < size) {
+                ssize_t n = ::read(file.get(), buffer.get() + tail, size - tail);
+                if (n > 0) {
+                    tail += n;
+                    co_return true;
+                }
+                if (n < 0 && errno == EINTR) { continue; }
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    co_await loop.readable(*watch);
+                    continue;
+                }
+                at_end = true;
+            }
+            co_return false;
+        }
+    };
+
+    /*****************************************************************
+     * AsyncWriter
+     *****************************************************************/
+
+    class AsyncWriter {
+    public:
+        // A buffer_size of zero is 4096 bytes, and ADVISED_SIZE lets the
+        // file choose (see Advise); a batch_size of zero is a quarter of
+        // it.  buffer_size is the high-water mark: a producer that gets
+        // further ahead of the file than that is suspended.
+        AsyncWriter(EventLoop& l, PosixFile&& f, size_t buffer_size = 0, size_t batch_size = 0)
+            : loop(l), file(std::move(f)), head(0), failed(false)
+        {
+            buffer_size = _ring_size(file, buffer_size, true);
+            high_water = buffer_size;
+            batch = batch_size != 0 ? batch_size : buffer_size / 4;
+            buffer.reserve(buffer_size);
+            _set_nonblock(file.get());
+            watch = loop.add(file.get());
+        }
+
+        ~AsyncWriter() {
+            loop.remove(watch);
+        }
+
+        AsyncWriter(const AsyncWriter&) = delete;
+        AsyncWriter& operator= (const AsyncWriter&) = delete;
+
+        // Only buffers the bytes, so that Stream::print can format into
+        // the writer; send them with async_flush(), or let async_room()
+        // hold the producer back.
+        size_t write(const void* data, size_t length) {
+            buffer.insert(buffer.end(), (const char*)data, (const char*)data + length);
+            return length;
+        }
+
+        // Buffers the bytes.  Once a batch is pending, writes out what
+        // the file takes without waiting, and suspends while more than
+        // the high-water mark is still pending.
+        Task<size_t> async_write(const void* data, size_t length) {
+            write(data, length);
+            bool ok = co_await async_room();
+            co_return ok ? length : 0;
+        }
+
+        // Suspends while more than the high-water mark is pending, e.g.
+        // after print() through write().  False on error.
+        Task<bool> async_room() {
+            if (pending() > batch) {
+                bool ok = co_await drain(high_water);
+                if (!ok) { co_return false; }
+            }
+            co_return !failed;
+        }
+
+        // Writes out everything buffered.  False on error.
+        Task<bool> async_flush() {
+            bool ok = co_await drain(0);
+            co_return ok;
+        }
+
+        // Bytes buffered, not yet written.
+        size_t pending() const {
+            return buffer.size() - head;
+        }
+
+    private:
+        EventLoop& loop;
+        PosixFile file;
+        EventLoop::Watch* watch;
+
+        std::vector<char> buffer;
+        size_t head;
+        size_t batch;
+        size_t high_water;
+        bool failed;
+
+        // Writes until at most `keep` bytes are pending, and as much
+        // more as the file takes without waiting.
+        Task<bool> drain(size_t keep) {
+            while (!failed && head < buffer.size()) {
+                ssize_t n = ::write(file.get(), buffer.data() + head, buffer.size() - head);
+                if (n > 0) {
+                    head += n;
+                    continue;
+                }
+                if (n < 0 && errno == EINTR) { continue; }
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    if (pending() <= keep) { break; }
+                    co_await loop.writable(*watch);
+                    continue;
+                }
+                failed = true;
+            }
+            if (head == buffer.size()) {
+                buffer.clear();
+                head = 0;
+            } else if (head >= high_water) {
+                // What was written is not kept around.
+                buffer.erase(buffer.begin(), buffer.begin() + head);
+                head = 0;
+            }
+            co_return !failed;
+        }
+    };
+
+}
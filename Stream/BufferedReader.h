@@ -9,36 +9,49 @@
 #pragma once
 
 #include "StreamDefs.h"
+#include "RingMemory.h"
+#include "StreamStats.h"
+#include "Cancellation.h"
+#include "ThreadPlacement.h"
+#include <chrono>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <memory>
 #include <string>
 #include <cstring>
+#include <exception>
 
 namespace Stream {
 
-    template <class Reader, class ReadFunc = Read<Reader> >
+    // A buffer_size of zero is 4096 bytes, and ADVISED_SIZE lets the
+    // Reader choose (see Advise).  The
+    // thread reading the file is placed as `placement` says.
+    template <class Reader, class ReadFunc = Read<Reader>, class Stats = NoStats >
     class BufferedReader {
     public:
         BufferedReader() {}
         
         explicit
-        BufferedReader(Reader&& file, size_t buffer_size = 4096) {
+        BufferedReader(Reader&& file, size_t buffer_size = 0,
+                       const ThreadPlacement& placement = ThreadPlacement()) {
             Body* pbody = new Body(std::move(file));
             body = std::unique_ptr<Body>(pbody);
-            body->buffer = new char[buffer_size];
+            buffer_size = _ring_size(body->file, buffer_size, false);
+            body->buffer = RingMemory::allocate(buffer_size);
             body->buffer_size = buffer_size;
-            initialize();
+            initialize(placement);
         }
 
         explicit
-        BufferedReader(const Reader& file, size_t buffer_size = 4096) {
+        BufferedReader(const Reader& file, size_t buffer_size = 0,
+                       const ThreadPlacement& placement = ThreadPlacement()) {
             Body* pbody = new Body(file);
             body = std::unique_ptr<Body>(pbody);
-            body->buffer = new char[buffer_size];
+            buffer_size = _ring_size(body->file, buffer_size, false);
+            body->buffer = RingMemory::allocate(buffer_size);
             body->buffer_size = buffer_size;
-            initialize();
+            initialize(placement);
         }
         
         BufferedReader(BufferedReader&& that) {
@@ -50,9 +63,13 @@ namespace Stream {
             return *this;
         }
         
+        // The thread is woken from a blocking wait if the Reader
+        // supports ReadWait; otherwise the destructor waits for the read
+        // to return.
         ~BufferedReader() {
             if (body == nullptr) { return; }
             
+            body->cancel.cancel();
             body->mtx_rw.lock();
             body->is_running = false;
             body->cnd_r.notify_all();
@@ -62,16 +79,70 @@ namespace Stream {
             
             body->reader_thread.join();
 
-            delete[] body->buffer;
+            RingMemory::deallocate(body->buffer, body->buffer_size, body->resident);
         }
 
         BufferedReader(const BufferedReader&) = delete;
         BufferedReader& operator= (const BufferedReader&) = delete;
         
+        // An exception thrown by readfunc ends the stream: it is
+        // rethrown from here once what was read before has been read.
         size_t read(void* buffer, size_t length) {
             return body->read(buffer, length);
         }
 
+        // As read(), but returns what it has got once `deadline` has
+        // passed.
+        size_t read_until(void* buffer, size_t length, StatsClock::time_point deadline) {
+            return body->read(buffer, length, &deadline);
+        }
+
+        template <class Rep, class Period>
+        size_t read_for(void* buffer, size_t length,
+                        const std::chrono::duration<Rep, Period>& timeout) {
+            return read_until(buffer, length, StatsClock::now() + timeout);
+        }
+
+        // Whether the stream has ended (or was cancelled) and everything
+        // read from it has been consumed.
+        bool at_end() {
+            std::lock_guard<std::mutex> lock(body->mtx_rw);
+            return body->q_empty && !body->is_running;
+        }
+
+        // Stops reading from the file, without closing it.  What is in
+        // the ring can still be read; then reads return 0.  The thread
+        // is woken from a blocking wait if the Reader supports ReadWait.
+        void cancel() {
+            body->cancel.cancel();
+            std::lock_guard<std::mutex> lock(body->mtx_rw);
+            body->cnd_r.notify_all();
+        }
+
+        // The token cancel() sets, for use from other threads.
+        CancellationToken cancellation() const {
+            return body->cancel;
+        }
+
+        // Reads one character, -1 at the end of stream.
+        int peek() {
+            return body->peek();
+        }
+
+        // Points `data` at the unread bytes in the ring, without
+        // copying, and returns how many there are.  Waits for `want`
+        // of them, unless the ring wraps or the stream ends before.
+        // They stay valid until consume().  Returns 0 at the end of
+        // stream.
+        size_t peek_span(const char*& data, size_t want) {
+            return body->peek_span(data, want);
+        }
+
+        // Drops `size` bytes of those seen through peek_span().
+        void consume(size_t size) {
+            body->consume(size);
+        }
+
         size_t readline(char* buffer, size_t length, const char* eol = "\n") {
             return body->readline(buffer, length, eol);
         }
@@ -89,21 +160,42 @@ namespace Stream {
             
             return std::string(&buf[0], &buf[size]);
         }
+
+        // The ring is given back to the kernel once it is empty and no
+        // data has come for `timeout`, while the thread waits for more
+        // if the Reader supports ReadWait, or else once a read has
+        // waited longer than that.  A negative timeout keeps the ring
+        // resident.
+        void set_idle_release(RingMemory::duration timeout) {
+            std::lock_guard<std::mutex> lock(body->mtx_rw);
+            body->idle_timeout = timeout;
+        }
+
+        const Stats& stats() const {
+            return body->stats;
+        }
         
     private:
         struct Body {
             Reader file;
             ReadFunc readfunc;
+            Stats stats;
             
             char* buffer;
             size_t q_head;
             size_t q_tail;
             bool q_empty;
             size_t buffer_size;
+            size_t resident;
+            
+            RingMemory::duration idle_timeout;
+            bool was_idle;
             
             std::thread reader_thread;
             
             bool is_running;
+            CancellationToken cancel;
+            std::exception_ptr error;       // thrown by readfunc
             
             std::mutex mtx_rw;
             std::condition_variable_any cnd_r;
@@ -113,11 +205,26 @@ namespace Stream {
             Body(Reader&& f) : file(std::move(f)) {}
             
             void keep_reading() {
+                const bool watched = cancel.is_watched();
+
                 while (true) {
-                    size_t n_size;
+                    size_t n_size = 0;
                     
                     mtx_rw.lock();
-                    while (is_running) {
+                    if (was_idle && !watched) {
+                        // The stream has gone quiet.  Give the consumer a
+                        // chance to drain the ring, so that it is released
+                        // before blocking in the next read.
+                        cnd_r.wait_for(mtx_rw, idle_timeout,
+                                       [this] { return q_empty || !is_running; });
+                    }
+                    if (q_empty) {
+                        q_head = q_tail = 0;
+                        if (want_release()) {
+                            RingMemory::release(buffer, resident);
+                        }
+                    }
+                    while (is_running && !cancel.is_cancelled()) {
                         n_size = (q_tail>q_head || q_empty)
                                     ? buffer_size-q_tail
                                     : q_head-q_tail ;
@@ -127,59 +234,123 @@ namespace Stream {
                     }
                     
                     char* ptr_tail = buffer+q_tail;
+                    RingMemory::duration timeout = idle_timeout;
+                    bool may_release = resident != 0 && timeout.count() >= 0;
                     mtx_rw.unlock();
                     
                     if (!is_running) { break; }
+
+                    if (watched) {
+                        // While the ring is resident, the wait gives up
+                        // after the idle timeout, to release it (above)
+                        // once the consumer has drained it.
+                        int timeout_ms = may_release ? (int)timeout.count() : -1;
+                        if (!Stream::read_wait<Reader>(file, cancel.fd(), timeout_ms)) {
+                            if (cancel.is_cancelled()) { break; }
+                            std::lock_guard<std::mutex> lock(mtx_rw);
+                            was_idle = true;
+                            continue;
+                        }
+                    }
+                    if (cancel.is_cancelled()) { break; }
+                    
+                    ssize_t n_read;
+                    try {
+                        if ((!watched && timeout.count() >= 0) || Stats::enabled) {
+                            auto start = std::chrono::steady_clock::now();
+                            n_read = readfunc(file, ptr_tail, n_size);
+                            auto end = std::chrono::steady_clock::now();
+                            // A file that cannot be waited on is found
+                            // idle only once the read has returned.
+                            if (!watched && timeout.count() >= 0) { was_idle = end - start >= timeout; }
+                            if (Stats::enabled) { stats.on_syscall(end - start); }
+                        } else {
+                            n_read = readfunc(file, ptr_tail, n_size);
+                        }
+                    } catch (...) {
+                        // Nobody could catch it on this thread.
+                        std::lock_guard<std::mutex> lock(mtx_rw);
+                        error = std::current_exception();
+                        break;
+                    }
                     
-                    ssize_t n_read = readfunc(file, ptr_tail, n_size);
+                    stats.on_io(n_read > 0 ? n_read : 0);
                     
                     if (n_read <= 0) { break; }
                     
                     mtx_rw.lock();
                     {
+                        if (watched) { was_idle = false; }
                         q_tail += n_read;
+                        RingMemory::touch(resident, q_tail);
                         q_empty = false;
                         if (q_tail == buffer_size) { q_tail = 0; }
+                        if (Stats::enabled) { stats.on_fill(fill_level()); }
                     }
                     mtx_rw.unlock();
                     cnd_w.notify_one();
                 }
+                mtx_rw.lock();
                 is_running = false;
+                mtx_rw.unlock();
                 cnd_w.notify_all();
             }
 
-            size_t read(void* o_buf, size_t i_len) {
+            size_t fill_level() const {
+                if (q_empty) { return 0; }
+                return q_head < q_tail ? q_tail - q_head
+                                       : buffer_size - q_head + q_tail;
+            }
+
+            // Waits for the reader thread, until `deadline` if there is
+            // one.  mtx_rw must be held.  Returns false on timeout.
+            bool wait_fill(const StatsClock::time_point* deadline) {
+                if (deadline == nullptr) {
+                    cnd_w.wait(mtx_rw);
+                    return true;
+                }
+                return cnd_w.wait_until(mtx_rw, *deadline) == std::cv_status::no_timeout;
+            }
+
+            // Waits until the ring holds data, the stream ends, or the
+            // deadline passes.  mtx_rw must be held.  Returns false if
+            // the ring is still empty.  Once the stream has ended on an
+            // exception of readfunc, unlocks mtx_rw and rethrows it.
+            bool wait_data(const StatsClock::time_point* deadline = nullptr) {
+                if (q_empty && is_running) {
+                    StatsClock::time_point start;
+                    if (Stats::enabled) { start = StatsClock::now(); }
+                    do {
+                        if (!wait_fill(deadline)) { break; }
+                    } while (q_empty && is_running);
+                    if (Stats::enabled) { stats.on_block(StatsClock::now() - start); }
+                }
+                if (q_empty && !is_running && error) {
+                    std::exception_ptr e = error;
+                    mtx_rw.unlock();
+                    std::rethrow_exception(e);
+                }
+                return !q_empty;
+            }
+
+            bool want_release() const {
+                return resident != 0 && idle_timeout.count() >= 0
+                    && (was_idle || RingMemory::over_budget());
+            }
+
+            size_t read(void* o_buf, size_t i_len,
+                        const StatsClock::time_point* deadline = nullptr) {
                 char* buf = (char*)o_buf;
                 size_t len = i_len;
                 
                 while (len > 0) {
-                    mtx_rw.lock();
-                    
-                    while (q_empty && is_running) {
-                        cnd_w.wait(mtx_rw);
-                    }
-                    if (q_empty) {
-                        mtx_rw.unlock();
-                        break;
-                    }
-                    
-                    size_t n_size = q_tail<=q_head ? buffer_size-q_head : q_tail-q_head;
+                    const char* ptr_head;
+                    size_t n_size = peek_span(ptr_head, 1, deadline);
+                    if (n_size == 0) { break; }
                     if (n_size > len) { n_size = len; }
                     
-                    char* ptr_head = buffer+q_head;
-                    
-                    mtx_rw.unlock();
-                    
                     memcpy(buf, ptr_head, n_size);
-                    
-                    mtx_rw.lock();
-                    
-                    q_head += n_size;
-                    if (q_head == buffer_size) { q_head = 0; }
-                    if (q_head == q_tail) { q_empty = true; }
-                    
-                    mtx_rw.unlock();
-                    cnd_r.notify_one();
+                    consume(n_size);
                     
                     buf += n_size;
                     len -= n_size;
@@ -187,19 +358,42 @@ namespace Stream {
                 
                 return i_len - len;
             }
+
+            size_t peek_span(const char*& data, size_t want,
+                             const StatsClock::time_point* deadline = nullptr) {
+                size_t n_size = 0;
+                mtx_rw.lock();
+                while (wait_data(deadline)) {
+                    n_size = q_tail<=q_head ? buffer_size-q_head : q_tail-q_head;
+                    // Past the end of the ring, the bytes are not adjacent.
+                    if (n_size >= want || q_tail <= q_head || !is_running) { break; }
+                    if (!wait_fill(deadline)) { break; }
+                }
+                data = buffer+q_head;
+                mtx_rw.unlock();
+                return n_size;
+            }
+
+            void consume(size_t size) {
+                mtx_rw.lock();
+                
+                q_head += size;
+                if (q_head == buffer_size) { q_head = 0; }
+                if (q_head == q_tail) { q_empty = true; }
+                
+                mtx_rw.unlock();
+                cnd_r.notify_one();
+            }
             
             int peek() {
                 mtx_rw.lock();
                 
-                while (q_empty && is_running) {
-                    cnd_w.wait(mtx_rw);
-                }
-                if (q_empty) {
+                if (!wait_data()) {
                     mtx_rw.unlock();
                     return -1;
                 }
                 
-                char res = buffer[q_head];
+                unsigned char res = buffer[q_head];
                 
                 if (++q_head == buffer_size) { q_head = 0; }
                 if (q_head == q_tail) { q_empty = true; }
@@ -240,10 +434,7 @@ namespace Stream {
                 while (len > 0 && eol[matched] != '\0') {
                     mtx_rw.lock();
                     
-                    while (q_empty && is_running) {
-                        cnd_w.wait(mtx_rw);
-                    }
-                    if (q_empty) {
+                    if (!wait_data()) {
                         mtx_rw.unlock();
                         break;
                     }
@@ -298,14 +489,22 @@ namespace Stream {
         
         std::unique_ptr<Body> body;
         
-        void initialize() {
+        void initialize(const ThreadPlacement& placement) {
             body->q_head = 0;
             body->q_tail = 0;
             body->q_empty = true;
+            body->resident = 0;
+            body->idle_timeout = RingMemory::idle_timeout();
+            body->was_idle = false;
             body->is_running = true;
+
+            // Waited on with the file before each read, so that the
+            // thread can always be stopped.
+            if (_CanReadWait<Reader>::value) { body->cancel.fd(); }
             
             Body* pbody = body.get();
-            body->reader_thread = std::thread(
+            body->reader_thread = _placed_thread(
+                placement, body->buffer, body->buffer_size, body->resident,
                 [ pbody ] { pbody->keep_reading(); }
             );
         }
@@ -7,35 +7,56 @@
 //  Copyright (c) 2014年 RnMss. All rights reserved.
 //
 
-#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "StreamDefs.h"
+#include "RingMemory.h"
+#include "StreamStats.h"
+#include "Cancellation.h"
+#include "ThreadPlacement.h"
 
 namespace Stream {
 
-    template <class Writer, class WriteFunc = Write<Writer> >
+    // A buffer_size of zero is 4096 bytes, and ADVISED_SIZE lets the
+    // Writer choose (see Advise).  A batch_size of zero is a quarter of
+    // the buffer.  The thread writing
+    // the file is placed as `placement` says.
+    template <class Writer, class WriteFunc = Write<Writer>, class Stats = NoStats >
     class BufferedWriter {
     public:
         BufferedWriter() {}
         
         explicit
-        BufferedWriter(Writer&& file, size_t buffer_size = 4096, size_t batch_size = 1024) {
+        BufferedWriter(Writer&& file, size_t buffer_size = 0, size_t batch_size = 0,
+                       const ThreadPlacement& placement = ThreadPlacement()) {
             Body* pbody = new Body(std::move(file));
             body = std::unique_ptr<Body>(pbody);
-            body->buffer = new char[buffer_size];
+            buffer_size = _ring_size(body->file, buffer_size, true);
+            if (batch_size == 0) { batch_size = buffer_size / 4; }
+            body->buffer = RingMemory::allocate(buffer_size);
             body->buffer_size = buffer_size;
             body->flush_barrier = buffer_size;
             body->batch_size = batch_size;
-            initialize();
+            initialize(placement);
         }
         
         explicit
-        BufferedWriter(const Writer& file, size_t buffer_size = 4096, size_t batch_size = 1024) {
+        BufferedWriter(const Writer& file, size_t buffer_size = 0, size_t batch_size = 0,
+                       const ThreadPlacement& placement = ThreadPlacement()) {
             Body* pbody = new Body(file);
             body = std::unique_ptr<Body>(pbody);
-            body->buffer = new char[buffer_size];
+            buffer_size = _ring_size(body->file, buffer_size, true);
+            if (batch_size == 0) { batch_size = buffer_size / 4; }
+            body->buffer = RingMemory::allocate(buffer_size);
             body->buffer_size = buffer_size;
             body->flush_barrier = buffer_size;
             body->batch_size = batch_size;
-            initialize();
+            initialize(placement);
         }
         
         BufferedWriter(BufferedWriter&& that) {
@@ -53,7 +74,7 @@ namespace Stream {
             close();
             body->writer_thread.join();
             
-            delete[] body->buffer;
+            RingMemory::deallocate(body->buffer, body->buffer_size, body->resident);
         }
         
         BufferedWriter(const BufferedWriter&) = delete;
@@ -62,9 +83,90 @@ namespace Stream {
         size_t write(const void* data, size_t size) {
             return body->write(data, size);
         }
+
+        // As write(), but gives up waiting for room in the ring once
+        // `deadline` has passed.  Returns the bytes taken.
+        size_t write_until(const void* data, size_t size, StatsClock::time_point deadline) {
+            return body->write(data, size, &deadline);
+        }
+
+        template <class Rep, class Period>
+        size_t write_for(const void* data, size_t size,
+                         const std::chrono::duration<Rep, Period>& timeout) {
+            return write_until(data, size, StatsClock::now() + timeout);
+        }
         
-        void flush() {
-            body->flush();
+        // Waits until everything written so far has been written out.
+        // Returns false if the writer stopped before that.
+        bool flush() {
+            return body->flush(nullptr);
+        }
+
+        // As flush(), but returns false once `deadline` has passed.
+        bool flush_until(StatsClock::time_point deadline) {
+            return body->flush(&deadline);
+        }
+
+        template <class Rep, class Period>
+        bool flush_for(const std::chrono::duration<Rep, Period>& timeout) {
+            return flush_until(StatsClock::now() + timeout);
+        }
+
+        // As flush(), then makes what was written so far durable
+        // (Sync<Writer>, fdatasync for a PosixFile).  Callers from
+        // several threads are committed as a group: a sync covers all
+        // that was written out when it began, and releases everyone it
+        // covers, so a log pays one sync per batch, not per record.
+        // Returns false if the writer stopped, or a sync failed; after
+        // a failure, nothing more is taken as durable.  A Writer without
+        // a Sync specialization always fails.
+        bool flush_durable() {
+            return body->flush_durable();
+        }
+
+        // Points `data` at free space in the ring, so that bytes can be
+        // stored in place, and returns its size; waits while the ring is
+        // full.  Returns 0 once the writer is closed.  Nothing else may
+        // be written before commit().
+        size_t reserve(char*& data) {
+            return body->reserve(data);
+        }
+
+        // Appends the first `size` bytes stored through reserve().
+        void commit(size_t size) {
+            body->commit(size);
+        }
+        
+        // The ring is given back to the kernel once it has stayed empty
+        // for `timeout`.  A negative timeout keeps the ring resident.
+        void set_idle_release(RingMemory::duration timeout) {
+            std::lock_guard<std::mutex> lock(body->mtx_rw);
+            body->idle_timeout = timeout;
+            body->cnd_w.notify_all();
+        }
+
+        // Bytes are written out at the latest `latency` after they
+        // were put into the empty ring, even if there are fewer than
+        // `batch_size` of them.  Zero turns the deadline off.
+        void set_max_latency(std::chrono::microseconds latency) {
+            std::lock_guard<std::mutex> lock(body->mtx_rw);
+            body->max_latency = latency;
+            body->cnd_w.notify_all();
+        }
+
+        // In adaptive mode, the batch size follows the write rate and
+        // the cost of writefunc: the ring is written out once the bytes
+        // arrived in the time of a few writefunc calls, with at most
+        // half the ring in a batch.  Otherwise `batch_size` is used.
+        void set_adaptive_batch(bool on) {
+            std::lock_guard<std::mutex> lock(body->mtx_rw);
+            body->adaptive = on;
+            body->batch_now = body->batch_size;
+            body->cnd_w.notify_all();
+        }
+
+        const Stats& stats() const {
+            return body->stats;
         }
         
         void close() {
@@ -72,11 +174,28 @@ namespace Stream {
             body->cnd_w.notify_all();
             body->cnd_r.notify_all();
         }
+
+        // Closes the writer and drops what is not written yet, instead
+        // of waiting for a slow file to take it.  A thread blocked
+        // writing is woken if the Writer supports WriteWait, and the
+        // token was taken with cancellation() before.
+        void cancel() {
+            body->cancel.cancel();
+            close();
+        }
+
+        // The token cancel() sets.  From now on the thread waits on it
+        // with WriteWait before each write.
+        CancellationToken cancellation() const {
+            body->cancel.fd();
+            return body->cancel;
+        }
         
     private:
         struct Body {
             Writer file;
             WriteFunc writefunc;
+            Stats stats;
             
             char* buffer;
             size_t q_head;
@@ -84,15 +203,47 @@ namespace Stream {
             bool q_empty;
             size_t buffer_size;
             size_t batch_size;
+            size_t batch_now;
             size_t flush_barrier;
+            size_t resident;
+            bool q_filling;
+            
+            RingMemory::duration idle_timeout;
+
+            typedef std::chrono::steady_clock Clock;
+
+            // Deadline of the oldest byte in the ring.
+            std::chrono::microseconds max_latency;
+            Clock::time_point q_since;
+
+            // Estimates of the adaptive batch size: bytes put into the
+            // ring per ns, and ns per writefunc call.
+            bool adaptive;
+            size_t bytes_in;
+            size_t rate_bytes;
+            Clock::time_point rate_since;
+            double rate;
+            double cost;
             
             std::thread writer_thread;
             
             bool is_running;
+            bool writer_done;
+            CancellationToken cancel;
             
             std::mutex mtx_rw;
             std::condition_variable_any cnd_r;
             std::condition_variable_any cnd_w;
+
+            // Group commit of flush_durable().  bytes_out is guarded by
+            // mtx_rw, the rest by mtx_sync.
+            size_t bytes_out;
+            size_t bytes_pushed;        // bytes_out when the file was last flushed
+            size_t bytes_synced;
+            bool is_syncing;
+            bool sync_failed;
+            std::mutex mtx_sync;
+            std::condition_variable cnd_sync;
             
             Body(const Writer& f) : file(f) {}
             Body(Writer&& f) : file(std::move(f)) {}
@@ -100,6 +251,44 @@ namespace Stream {
             bool want_flush() const {
                 return flush_barrier != buffer_size;
             }
+
+            // Whether writing the ring up to `q_head_2` passes the
+            // flush barrier.
+            bool passes_barrier(size_t q_head_2) const {
+                return (q_head_2 == buffer_size && flush_barrier == 0) ||
+                       (q_head < flush_barrier && flush_barrier <= q_head_2);
+            }
+
+            void update_batch(Clock::time_point start, Clock::time_point end) {
+                const double ALPHA = 0.125;
+                // writefunc costs at most 1/COST_SHARE of the time it takes
+                // to produce a batch.
+                const double COST_SHARE = 8;
+
+                double ns = std::chrono::duration<double, std::nano>(end - start).count();
+                cost += ALPHA * (ns - cost);
+
+                double period = std::chrono::duration<double, std::nano>(end - rate_since).count();
+                if (period > 0) {
+                    rate += ALPHA * ((bytes_in - rate_bytes) / period - rate);
+                }
+                rate_bytes = bytes_in;
+                rate_since = end;
+
+                double batch = rate * cost * COST_SHARE;
+                size_t limit = buffer_size / 2;
+                batch_now = batch < 1 ? 1 : batch > limit ? limit : (size_t)batch;
+            }
+
+            bool want_release() const {
+                return q_empty && !q_filling && resident != 0
+                    && idle_timeout.count() >= 0;
+            }
+
+            void release() {
+                q_head = q_tail = 0;
+                RingMemory::release(buffer, resident);
+            }
             
             void keep_writing() {
                 while (true) {
@@ -118,8 +307,22 @@ namespace Stream {
                         }
 
                         if (!is_running) { break; }
-                        if (q_size > batch_size) { break; }
+                        if (q_size > batch_now) { break; }
                         if (want_flush()) { break; }
+                        if (!q_empty && max_latency.count() > 0) {
+                            Clock::time_point deadline = q_since + max_latency;
+                            if (Clock::now() >= deadline) { break; }
+                            cnd_w.wait_until(mtx_rw, deadline);
+                            continue;
+                        }
+                        if (want_release()) {
+                            if (RingMemory::over_budget() ||
+                                cnd_w.wait_for(mtx_rw, idle_timeout) == std::cv_status::timeout)
+                            {
+                                if (want_release()) { release(); }
+                            }
+                            continue;
+                        }
                         cnd_w.wait(mtx_rw);
                     }
 
@@ -129,22 +332,47 @@ namespace Stream {
                     }
 
                     char* ptr_head = buffer + q_head;
+                    bool more = q_size > n_size && !passes_barrier(q_head + n_size);
+                    // Read under the lock: the setters may change them
+                    // during the write.
+                    bool adapt = adaptive;
+                    bool timed = adapt || max_latency.count() > 0 || Stats::enabled;
                     mtx_rw.unlock();
 
+                    Clock::time_point start, end;
+
                     ssize_t n_write = 0;
                     if (n_size != 0) {
-                        n_write = writefunc(file, ptr_head, n_size);
+                        if (cancel.is_cancelled()) { break; }
+                        if (cancel.is_watched() &&
+                            !Stream::write_wait<Writer>(file, cancel.fd())) { break; }
+                        if (timed) { start = Clock::now(); }
+                        n_write = _write_hinted(writefunc, file, ptr_head, n_size, more, 0);
+                        if (timed) { end = Clock::now(); }
+                        stats.on_io(n_write > 0 ? n_write : 0);
+                        if (Stats::enabled) { stats.on_syscall(end - start); }
                         if (n_write <= 0) { break; }
                     }
 
                     mtx_rw.lock();
                     {
-                        size_t q_head_2 = q_head + n_write;
+                        if (adapt && n_size != 0) { update_batch(start, end); }
 
-                        if ((q_head_2 == buffer_size && flush_barrier == 0) || 
-                            (q_head < flush_barrier && flush_barrier <= q_head_2))
-                        {
-                            flush_barrier = buffer_size;
+                        size_t q_head_2 = q_head + n_write;
+                        bytes_out += n_write;
+
+                        if (passes_barrier(q_head_2)) {
+                            // Let the file push out what it holds back
+                            // before the flushers are released.
+                            size_t out = bytes_out;
+                            mtx_rw.unlock();
+                            Stream::flush<Writer>(file);
+                            mtx_rw.lock();
+                            if (out > bytes_pushed) { bytes_pushed = out; }
+
+                            if (passes_barrier(q_head_2)) {
+                                flush_barrier = buffer_size;
+                            }
                         }
 
                         if (q_head_2 == buffer_size) 
@@ -153,94 +381,219 @@ namespace Stream {
 
                         q_empty = (q_head == q_tail);
 
+                        // If all that was queued before the write went
+                        // out, what is left arrived during it.  Otherwise
+                        // the oldest bytes, e.g. those wrapped around the
+                        // end of the ring, keep their time.
+                        if (!q_empty && n_size != 0 && timed &&
+                            (size_t)n_write == q_size) { q_since = start; }
                     }
                     mtx_rw.unlock();
                     cnd_r.notify_all();
                 }
 
+                mtx_rw.lock();
                 is_running = false;
+                writer_done = true;
+                mtx_rw.unlock();
                 cnd_r.notify_all();
             }
 
-            size_t write(const void* data, size_t size) {
+            // Waits on cnd_r, until `deadline` if there is one.  mtx_rw
+            // must be held.  Returns false on timeout.
+            bool wait_room(const StatsClock::time_point* deadline) {
+                if (deadline == nullptr) {
+                    cnd_r.wait(mtx_rw);
+                    return true;
+                }
+                return cnd_r.wait_until(mtx_rw, *deadline) == std::cv_status::no_timeout;
+            }
+
+            size_t write(const void* data, size_t size,
+                         const StatsClock::time_point* deadline = nullptr) {
                 const char* buf = (const char*)data;
                 size_t len = size;
 
                 while (len > 0) {
-                    mtx_rw.lock();
+                    char* ptr_tail;
+                    size_t n_size = reserve(ptr_tail, deadline);
+                    if (n_size == 0) { break; }
+                    if (n_size > len) { n_size = len; }
 
-                    while (!q_empty && q_head==q_tail && is_running) {
-                        cnd_r.wait(mtx_rw);
-                    }
-                    if (!is_running) {
-                        mtx_rw.unlock();
-                        break;
-                    }
+                    memcpy(ptr_tail, buf, n_size);
+                    commit(n_size);
 
-                    size_t n_size = q_tail<q_head ? q_head-q_tail : buffer_size-q_tail ;
-                    if (n_size > len) { n_size = len; }
+                    buf += n_size;
+                    len -= n_size;
+                }
 
-                    char* ptr_tail = buffer+q_tail;
+                return size - len;
+            }
 
+            size_t reserve(char*& data, const StatsClock::time_point* deadline = nullptr) {
+                mtx_rw.lock();
+
+                if (!q_empty && q_head==q_tail && is_running) {
+                    StatsClock::time_point start;
+                    if (Stats::enabled) { start = StatsClock::now(); }
+                    do {
+                        if (!wait_room(deadline)) { break; }
+                    } while (!q_empty && q_head==q_tail && is_running);
+                    if (Stats::enabled) { stats.on_block(StatsClock::now() - start); }
+                }
+                if (!is_running || (!q_empty && q_head==q_tail)) {
                     mtx_rw.unlock();
+                    data = nullptr;
+                    return 0;
+                }
 
-                    memcpy(ptr_tail, buf, n_size);
+                // Start an empty ring over, to hand out all of it.
+                if (q_empty) { q_head = q_tail = 0; }
 
-                    mtx_rw.lock();
+                size_t n_size = q_tail<q_head ? q_head-q_tail : buffer_size-q_tail ;
 
-                    q_tail += n_size;
-                    if (q_tail == buffer_size) { q_tail = 0; }
-                    q_empty = false;
+                data = buffer+q_tail;
+                q_filling = true;
+                if (q_empty && max_latency.count() > 0) { q_since = Clock::now(); }
 
+                mtx_rw.unlock();
+                return n_size;
+            }
+
+            void commit(size_t n_size) {
+                mtx_rw.lock();
+
+                q_filling = false;
+                if (n_size == 0) {
                     mtx_rw.unlock();
                     cnd_w.notify_one();
+                    return;
+                }
 
-                    buf += n_size;
-                    len -= n_size;
+                q_tail += n_size;
+                RingMemory::touch(resident, q_tail);
+                if (q_tail == buffer_size) { q_tail = 0; }
+                q_empty = false;
+                bytes_in += n_size;
+                if (Stats::enabled) {
+                    stats.on_fill(q_head < q_tail ? q_tail - q_head
+                                                  : buffer_size - q_head + q_tail);
                 }
 
-                return size - len;
+                mtx_rw.unlock();
+                cnd_w.notify_one();
             }
 
-            void flush() {
-                mtx_rw.lock();
-                {
-                    assert(is_running);
-
-                    if (q_empty) {
-                        mtx_rw.unlock();
-                        return;
-                    }
+            bool flush(const StatsClock::time_point* deadline) {
+                StatsClock::time_point start;
+                if (Stats::enabled) { start = StatsClock::now(); }
 
+                bool done;
+                mtx_rw.lock();
+                if (q_empty) {
+                    // The thread may have written the ring out by itself,
+                    // on a full batch or the latency deadline, without
+                    // flushing the file: a corked socket would hold the
+                    // last segment back.
+                    size_t out = bytes_out;
+                    bool push = out != bytes_pushed && !writer_done;
+                    if (push) { bytes_pushed = out; }
+                    mtx_rw.unlock();
+                    if (push) { Stream::flush<Writer>(file); }
+                    mtx_rw.lock();
+                    done = true;
+                } else if (writer_done) {
+                    done = false;
+                } else {
                     flush_barrier = q_tail;
                     cnd_w.notify_all();
 
+                    while (want_flush() && !writer_done) {
+                        if (!wait_room(deadline)) { break; }
+                    }
+                    done = !want_flush();
                 }
                 mtx_rw.unlock();
 
+                // Every call counts, those with nothing to wait for too.
+                if (Stats::enabled) { stats.on_flush(StatsClock::now() - start); }
+                return done;
+            }
+
+            bool flush_durable() {
+                size_t target;
                 mtx_rw.lock();
-                while (want_flush()) {
-                    cnd_r.wait(mtx_rw);
-                }
+                target = bytes_in;
                 mtx_rw.unlock();
+
+                if (!flush(nullptr)) { return false; }
+
+                std::unique_lock<std::mutex> lock(mtx_sync);
+                while (bytes_synced < target && !sync_failed) {
+                    if (is_syncing) {
+                        // Its sync may have begun before our bytes were
+                        // written out; if so, the next one is ours.
+                        cnd_sync.wait(lock);
+                        continue;
+                    }
+
+                    is_syncing = true;
+                    mtx_rw.lock();
+                    size_t upto = bytes_out;
+                    mtx_rw.unlock();
+                    lock.unlock();
+
+                    bool ok = Stream::sync<Writer>(file);
+
+                    lock.lock();
+                    is_syncing = false;
+                    if (!ok) { sync_failed = true; }
+                    else if (upto > bytes_synced) { bytes_synced = upto; }
+                    cnd_sync.notify_all();
+                }
+                return !sync_failed;
             }
 
         };
             
         std::unique_ptr<Body> body;
         
-        void initialize() {
+        void initialize(const ThreadPlacement& placement) {
             body->q_head = 0;
             body->q_tail = 0;
             body->q_empty = true;
+            body->resident = 0;
+            body->q_filling = false;
+            body->idle_timeout = RingMemory::idle_timeout();
+            body->batch_now = body->batch_size;
+            body->max_latency = std::chrono::microseconds(0);
+            body->adaptive = false;
+            body->bytes_in = 0;
+            body->rate_bytes = 0;
+            body->rate_since = Body::Clock::now();
+            body->rate = 0;
+            body->cost = 0;
             body->is_running = true;
+            body->writer_done = false;
+            body->bytes_out = 0;
+            body->bytes_pushed = 0;
+            body->bytes_synced = 0;
+            body->is_syncing = false;
+            body->sync_failed = false;
 
             Body* pbody = body.get();
-            body->writer_thread = std::thread(
+            body->writer_thread = _placed_thread(
+                placement, body->buffer, body->buffer_size, body->resident,
                 [ pbody ] { pbody->keep_writing(); }
             );
         }
 
     };
-}
 
+    template <class Writer, class WriteFunc, class Stats>
+    struct Flush< BufferedWriter<Writer, WriteFunc, Stats> > {
+        void operator() (BufferedWriter<Writer, WriteFunc, Stats>& wr) const {
+            wr.flush();
+        }
+    };
+}
\ No newline at end of file
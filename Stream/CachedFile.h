@@ -0,0 +1,346 @@
+#pragma once
+
+/*****************************************************************
+ *
+ * Random reads from a file, through a cache of its blocks.
+ *
+ *   CachedFile index(PosixFile(fd), 16 << 10, 256 << 20);
+ *
+ *   char key[24];
+ *   index.pread_at(slot * 24, key, sizeof key);         // copied
+ *
+ *   CachedFile::View v = index.get_at(offset, 4096);    // not copied
+ *   parse(v.data(), v.size());
+ *
+ * The file is read in blocks of `block_size`, kept in an LRU cache
+ * of `capacity` bytes.  The cache is cut into shards, each with a
+ * lock of its own, so any number of threads can read at once; a
+ * block missed by several of them is read once.
+ *
+ * A View holds on to its block, which stays valid, evicted or not,
+ * as long as the view lives.  It covers at most the rest of the
+ * block, so it may be shorter than asked for: get_at(offset + size)
+ * gives the next part.
+ *
+ * With `prefetch` > 0, a miss, or the first hit on a block that was
+ * prefetched, has a background thread read the next `prefetch`
+ * blocks, so that a scan mostly hits.
+ *
+ * The file is taken not to change while cached; its size is read
+ * once, when the cache is made.
+ *
+ *****************************************************************/
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "StreamDefs.h"
+#include "PosixFileDesc.h"
+
+namespace Stream {
+
+    struct _CachedBlock {
+        std::unique_ptr<char[]> data;
+        size_t size;
+        bool ready;             // read in; unchanged from then on
+        bool prefetched;        // not yet hit since it was prefetched
+    };
+
+    class CachedFile {
+    public:
+        static const size_t MAX_SHARDS = 16;
+
+        class View {
+        public:
+            View() : ptr(nullptr), len(0) {}
+
+            const char* data() const { return ptr; }
+            size_t size() const { return len; }
+            bool empty() const { return len == 0; }
+
+        private:
+            friend class CachedFile;
+
+            std::shared_ptr<const _CachedBlock> block;
+            const char* ptr;
+            size_t len;
+        };
+
+        CachedFile() {}
+
+        explicit
+        CachedFile(PosixFile&& file, size_t block_size = 64 << 10,
+                   size_t capacity = 64 << 20, size_t prefetch = 0)
+            : body(new Body(std::move(file)))
+        {
+            if (block_size == 0) { block_size = 64 << 10; }
+
+            struct stat st;
+            body->file_size = ::fstat(body->file.get(), &st) == 0 ? st.st_size : 0;
+            body->block_size = block_size;
+
+            size_t blocks = std::max<size_t>(capacity / block_size, 1);
+            size_t shards = 1;
+            while (shards * 2 <= std::min(blocks, MAX_SHARDS)) { shards *= 2; }
+            body->n_shards = shards;
+            body->shard_blocks = blocks / shards;
+
+            body->prefetch = prefetch;
+            body->hits = 0;
+            body->misses = 0;
+            body->is_running = true;
+            if (prefetch != 0) {
+                Body* pbody = body.get();
+                body->prefetcher = std::thread(
+                    [ pbody ] { pbody->keep_prefetching(); }
+                );
+            }
+        }
+
+        CachedFile(CachedFile&& that) {
+            body = std::move(that.body);
+        }
+
+        CachedFile& operator= (CachedFile&& that) {
+            body = std::move(that.body);
+            return *this;
+        }
+
+        ~CachedFile() {
+            if (body == nullptr) { return; }
+
+            if (body->prefetcher.joinable()) {
+                {
+                    std::lock_guard<std::mutex> lock(body->mtx_q);
+                    body->is_running = false;
+                }
+                body->cnd_q.notify_all();
+                body->prefetcher.join();
+            }
+        }
+
+        CachedFile(const CachedFile&) = delete;
+        CachedFile& operator= (const CachedFile&) = delete;
+
+        // Copies up to `size` bytes from `offset` on.  Returns how many;
+        // fewer at the end of the file, or if a read fails.
+        size_t pread_at(uint64_t offset, void* data, size_t size) {
+            char* dst = (char*)data;
+            size_t done = 0;
+            while (done < size) {
+                View v = get_at(offset + done, size - done);
+                if (v.empty()) { break; }
+                std::memcpy(dst + done, v.data(), v.size());
+                done += v.size();
+            }
+            return done;
+        }
+
+        // Up to `size` bytes from `offset` on, in the cache, and no
+        // further than the end of their block.  Empty at the end of the
+        // file, or if the read fails.
+        View get_at(uint64_t offset, size_t size) {
+            View v;
+            if (size == 0 || offset >= body->file_size) { return v; }
+
+            uint64_t index = offset / body->block_size;
+            size_t skip = (size_t)(offset % body->block_size);
+            std::shared_ptr<_CachedBlock> block = body->fetch(index, false);
+            if (block == nullptr || skip >= block->size) { return v; }
+
+            v.ptr = block->data.get() + skip;
+            v.len = std::min(size, block->size - skip);
+            v.block = std::move(block);
+            return v;
+        }
+
+        uint64_t size() const {
+            return body->file_size;
+        }
+
+        size_t block_size() const {
+            return body->block_size;
+        }
+
+        uint64_t hits() const {
+            return body->hits.load(std::memory_order_relaxed);
+        }
+
+        uint64_t misses() const {
+            return body->misses.load(std::memory_order_relaxed);
+        }
+
+    private:
+        struct Shard {
+            struct Entry {
+                std::shared_ptr<_CachedBlock> block;
+                std::list<uint64_t>::iterator lru_pos;
+            };
+
+            std::mutex mtx;
+            std::condition_variable cnd;        // a block has been read, or failed
+            std::list<uint64_t> lru;            // most recently used first
+            std::unordered_map<uint64_t, Entry> blocks;
+        };
+
+        struct Body {
+            PosixFile file;
+            uint64_t file_size;
+            size_t block_size;
+
+            Shard shards[MAX_SHARDS];
+            size_t n_shards;
+            size_t shard_blocks;
+
+            std::atomic<uint64_t> hits;
+            std::atomic<uint64_t> misses;
+
+            size_t prefetch;
+            std::deque<uint64_t> q_prefetch;
+            std::mutex mtx_q;
+            std::condition_variable cnd_q;
+            bool is_running;
+            std::thread prefetcher;
+
+            Body(PosixFile&& f) : file(std::move(f)) {}
+
+            Shard& shard_of(uint64_t index) {
+                // Spreads neighbouring blocks over the shards.
+                return shards[(index * 0x9E3779B97F4A7C15ull >> 32) & (n_shards - 1)];
+            }
+
+            // The block, read in if it is not cached.  A prefetch does
+            // not wait for a block being read by someone else, and
+            // returns nullptr instead.
+            std::shared_ptr<_CachedBlock> fetch(uint64_t index, bool prefetching) {
+                Shard& sh = shard_of(index);
+                std::unique_lock<std::mutex> lock(sh.mtx);
+
+                for ( ; ; ) {
+                    auto it = sh.blocks.find(index);
+                    if (it == sh.blocks.end()) { break; }
+
+                    std::shared_ptr<_CachedBlock> block = it->second.block;
+                    if (block->ready) {
+                        if (prefetching) { return block; }
+
+                        sh.lru.splice(sh.lru.begin(), sh.lru, it->second.lru_pos);
+                        bool ahead = block->prefetched;
+                        block->prefetched = false;
+                        lock.unlock();
+
+                        hits.fetch_add(1, std::memory_order_relaxed);
+                        if (ahead) { schedule_prefetch(index); }
+                        return block;
+                    }
+                    if (prefetching) { return nullptr; }
+                    sh.cnd.wait(lock);
+                }
+
+                // Missed: put a placeholder in, for the others to wait on,
+                // and read the block out of the lock.
+                std::shared_ptr<_CachedBlock> block = std::make_shared<_CachedBlock>();
+                block->size = 0;
+                block->ready = false;
+                block->prefetched = prefetching;
+                sh.lru.push_front(index);
+                sh.blocks[index] = Shard::Entry{ block, sh.lru.begin() };
+                lock.unlock();
+
+                if (!prefetching) {
+                    misses.fetch_add(1, std::memory_order_relaxed);
+                    schedule_prefetch(index);
+                }
+                bool ok = load(index, *block);
+
+                lock.lock();
+                if (!ok) {
+                    auto it = sh.blocks.find(index);
+                    sh.lru.erase(it->second.lru_pos);
+                    sh.blocks.erase(it);
+                    sh.cnd.notify_all();
+                    return nullptr;
+                }
+                block->ready = true;
+                evict(sh);
+                sh.cnd.notify_all();
+                return block;
+            }
+
+            // Drops the least recently used blocks over the capacity of
+            // the shard; blocks still being read are passed over.
+            // sh.mtx must be held.
+            void evict(Shard& sh) {
+                auto pos = sh.lru.end();
+                while (sh.blocks.size() > shard_blocks && pos != sh.lru.begin()) {
+                    --pos;
+                    auto it = sh.blocks.find(*pos);
+                    if (!it->second.block->ready) { continue; }
+                    sh.blocks.erase(it);
+                    pos = sh.lru.erase(pos);
+                }
+            }
+
+            bool load(uint64_t index, _CachedBlock& block) {
+                block.data.reset(new char[block_size]);
+                uint64_t offset = index * block_size;
+                size_t got = 0;
+                while (got < block_size) {
+                    ssize_t n = ::pread(file.get(), block.data.get() + got,
+                                        block_size - got, (off_t)(offset + got));
+                    if (n < 0 && errno == EINTR) { continue; }
+                    if (n < 0) { return false; }
+                    if (n == 0) { break; }
+                    got += n;
+                }
+                block.size = got;
+                return true;
+            }
+
+            void schedule_prefetch(uint64_t index) {
+                if (prefetch == 0) { return; }
+
+                uint64_t blocks = (file_size + block_size - 1) / block_size;
+                {
+                    std::lock_guard<std::mutex> lock(mtx_q);
+                    // Readers far ahead of the prefetcher gain nothing
+                    // from a longer queue.
+                    if (q_prefetch.size() >= 4 * prefetch) { return; }
+                    for (size_t i = 1; i <= prefetch && index + i < blocks; ++i) {
+                        q_prefetch.push_back(index + i);
+                    }
+                }
+                cnd_q.notify_one();
+            }
+
+            void keep_prefetching() {
+                std::unique_lock<std::mutex> lock(mtx_q);
+                for ( ; ; ) {
+                    cnd_q.wait(lock, [this] { return !q_prefetch.empty() || !is_running; });
+                    if (!is_running) { break; }
+
+                    uint64_t index = q_prefetch.front();
+                    q_prefetch.pop_front();
+                    lock.unlock();
+                    fetch(index, true);
+                    lock.lock();
+                }
+            }
+        };
+
+        std::unique_ptr<Body> body;
+    };
+
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+namespace Stream {
+
+    /*****************************************************************
+     *
+     * A flag that stops the threads of streams blocked on I/O.
+     *
+     * Copies share the flag.  Once cancelled, fd() becomes readable
+     * for good, so a thread waiting in poll() on it together with its
+     * file wakes up, and the file need not be closed under it.
+     *
+     * The descriptor is only made by the first fd(), so a token that
+     * is never watched costs no descriptor.  A BufferedReader watches
+     * its token whenever its file supports ReadWait, so that it can
+     * always be stopped; the writers poll on theirs only once it is
+     * handed out, to spare a syscall per write.
+     *
+     *****************************************************************/
+    class CancellationToken {
+    public:
+        CancellationToken() : state(new State()) {}
+
+        void cancel() const {
+            if (state->cancelled.exchange(true)) { return; }
+            state->signal();
+        }
+
+        bool is_cancelled() const {
+            return state->cancelled.load(std::memory_order_relaxed);
+        }
+
+        // Readable once cancelled; -1 if no descriptor can be made.
+        int fd() const {
+            int fd = state->rfd.load(std::memory_order_acquire);
+            return fd >= 0 ? fd : state->open();
+        }
+
+        bool is_watched() const {
+            return state->rfd.load(std::memory_order_relaxed) >= 0;
+        }
+
+    private:
+        struct State {
+            std::atomic<bool> cancelled;
+            std::atomic<int> rfd;
+            std::atomic<int> wfd;
+            std::mutex mtx_open;
+
+            State() : cancelled(false), rfd(-1), wfd(-1) {}
+
+            ~State() {
+                int r = rfd.load(), w = wfd.load();
+                if (r >= 0) { ::close(r); }
+                if (w >= 0 && w != r) { ::close(w); }
+            }
+
+            int open() {
+                std::lock_guard<std::mutex> lock(mtx_open);
+                int fd = rfd.load(std::memory_order_relaxed);
+                if (fd >= 0) { return fd; }
+
+                int fds[2];
+#if defined(__linux__)
+                fds[0] = fds[1] = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+                if (fds[0] < 0) { return -1; }
+#else
+                if (::pipe(fds) != 0) { return -1; }
+                for (int fd : fds) {
+                    ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+                    ::fcntl(fd, F_SETFL, O_NONBLOCK);
+                }
+#endif
+                wfd.store(fds[1]);
+                rfd.store(fds[0]);
+
+                // cancel() may have come before the descriptor was there.
+                if (cancelled.load()) { signal(); }
+                return fds[0];
+            }
+
+            void signal() {
+                int fd = wfd.load();
+                if (fd < 0) { return; }
+#if defined(__linux__)
+                uint64_t one = 1;
+#else
+                char one = 1;
+#endif
+                ssize_t n = ::write(fd, &one, sizeof one);
+                (void)n;
+            }
+        };
+
+        std::shared_ptr<State> state;
+    };
+
+}
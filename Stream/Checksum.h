@@ -0,0 +1,518 @@
+#pragma once
+
+/*****************************************************************
+ *
+ * Checksums of the bytes passing through a stream.
+ *
+ *   ChecksumWriter<BufferedWriter<PosixFile>, Crc32c> wr{
+ *       BufferedWriter<PosixFile>(PosixFile(fd)) };
+ *   print(wr, snapshot);
+ *   wr.write_trailer();                 // appends the CRC
+ *
+ *   ChecksumReader<BufferedReader<PosixFile>, Crc32c> rd(
+ *       BufferedReader<PosixFile>(PosixFile(fd)), true);
+ *   while (size_t n = rd.read(buf, sizeof buf)) { use(buf, n); }
+ *   if (!rd.verified()) { ... }
+ *
+ * The adapters hash what they pass on, as it goes by, so the data is
+ * read only once.  Over a BufferedWriter / BufferedReader, as above,
+ * the hashing happens on the user's thread while the bytes are in
+ * cache; under one (as its file) it happens on the stream's thread.
+ *
+ * With a trailer, the reader holds back the last Hash::SIZE bytes of
+ * the stream, which it never hands out, and compares them with the
+ * digest once the stream ends.  Trailers are little-endian.
+ *
+ * Crc32c uses the SSE4.2 crc32 instruction, if the CPU has it, on
+ * three interleaved streams which are then combined; or the ARMv8
+ * CRC instructions where the compiler targets them; or tables.
+ *
+ *****************************************************************/
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "StreamDefs.h"
+
+namespace Stream {
+
+    // CRC-32C (Castagnoli), as iSCSI, ext4 and SSE4.2 compute it.
+    class Crc32c {
+    public:
+        typedef uint32_t value_type;
+        static const size_t SIZE = 4;
+
+        Crc32c() : crc(0) {}
+
+        void update(const void* data, size_t size) {
+            crc = compute(crc, (const unsigned char*)data, size);
+        }
+
+        value_type value() const {
+            return crc;
+        }
+
+        void reset() {
+            crc = 0;
+        }
+
+        // The CRC of `size` bytes, continuing from `crc`.
+        static uint32_t compute(uint32_t crc, const unsigned char* p, size_t size) {
+#if defined(__ARM_FEATURE_CRC32)
+            return compute_arm(crc, p, size);
+#else
+#if defined(__x86_64__)
+            static const bool hw = __builtin_cpu_supports("sse4.2");
+            if (hw) { return compute_sse42(crc, p, size); }
+#endif
+            return compute_table(crc, p, size);
+#endif
+        }
+
+    private:
+        static const uint32_t POLY = 0x82f63b78;    // reflected
+        static const size_t LONG = 8192;
+        static const size_t SHORT = 256;
+
+        uint32_t crc;
+
+        static uint64_t load64(const unsigned char* p) {
+            uint64_t v;
+            std::memcpy(&v, p, 8);
+            return v;
+        }
+
+        // Slicing by 8.
+        struct Tables {
+            uint32_t t[8][256];
+
+            Tables() {
+                for (uint32_t n = 0; n < 256; ++n) {
+                    uint32_t c = n;
+                    for (int k = 0; k < 8; ++k) {
+                        c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+                    }
+                    t[0][n] = c;
+                }
+                for (uint32_t n = 0; n < 256; ++n) {
+                    for (int k = 1; k < 8; ++k) {
+                        t[k][n] = (t[k - 1][n] >> 8) ^ t[0][t[k - 1][n] & 0xff];
+                    }
+                }
+            }
+        };
+
+        static uint32_t compute_table(uint32_t crc, const unsigned char* p, size_t size) {
+            static const Tables tables;
+            const uint32_t (*t)[256] = tables.t;
+
+            crc = ~crc;
+            for ( ; size >= 8; p += 8, size -= 8) {
+                uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+                uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+                crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+                      t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+                      t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+                      t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+            }
+            for ( ; size > 0; ++p, --size) {
+                crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+            }
+            return ~crc;
+        }
+
+#if defined(__x86_64__)
+        // Tables that append `len` zero bytes to a CRC, byte by byte,
+        // to combine the CRCs of adjacent blocks (after zlib's
+        // crc32_combine).
+        struct Shift {
+            uint32_t t[4][256];
+
+            explicit Shift(size_t len) {
+                uint32_t op[32];
+                zeros_op(op, len);
+                for (uint32_t n = 0; n < 256; ++n) {
+                    t[0][n] = times(op, n);
+                    t[1][n] = times(op, n << 8);
+                    t[2][n] = times(op, n << 16);
+                    t[3][n] = times(op, n << 24);
+                }
+            }
+
+            uint32_t operator() (uint32_t crc) const {
+                return t[0][crc & 0xff] ^ t[1][(crc >> 8) & 0xff] ^
+                       t[2][(crc >> 16) & 0xff] ^ t[3][crc >> 24];
+            }
+
+            // GF(2) matrix times vector.
+            static uint32_t times(const uint32_t* mat, uint32_t vec) {
+                uint32_t sum = 0;
+                for ( ; vec != 0; vec >>= 1, ++mat) {
+                    if (vec & 1) { sum ^= *mat; }
+                }
+                return sum;
+            }
+
+            static void square(uint32_t* sq, const uint32_t* mat) {
+                for (int n = 0; n < 32; ++n) { sq[n] = times(mat, mat[n]); }
+            }
+
+            // The operator for `len` zero bytes; `len` a power of two.
+            static void zeros_op(uint32_t* even, size_t len) {
+                uint32_t odd[32];
+                odd[0] = POLY;
+                for (int n = 1; n < 32; ++n) { odd[n] = uint32_t(1) << (n - 1); }
+                square(even, odd);      // 2 bits
+                square(odd, even);      // 4 bits
+                for ( ; ; ) {
+                    square(even, odd);
+                    len >>= 1;
+                    if (len == 0) { return; }
+                    square(odd, even);
+                    len >>= 1;
+                    if (len == 0) { break; }
+                }
+                std::memcpy(even, odd, sizeof odd);
+            }
+        };
+
+        // The crc32 instruction has a latency of three cycles and a
+        // throughput of one per cycle, so three blocks are run at once.
+        template <size_t BLOCK>
+        __attribute__((target("sse4.2")))
+        static uint64_t blocks_sse42(uint64_t crc0, const unsigned char*& p, size_t& size) {
+            static const Shift shift(BLOCK);
+            while (size >= 3 * BLOCK) {
+                uint64_t crc1 = 0, crc2 = 0;
+                const unsigned char* end = p + BLOCK;
+                do {
+                    crc0 = _mm_crc32_u64(crc0, load64(p));
+                    crc1 = _mm_crc32_u64(crc1, load64(p + BLOCK));
+                    crc2 = _mm_crc32_u64(crc2, load64(p + 2 * BLOCK));
+                    p += 8;
+                } while (p < end);
+                crc0 = shift((uint32_t)crc0) ^ crc1;
+                crc0 = shift((uint32_t)crc0) ^ crc2;
+                p += 2 * BLOCK;
+                size -= 3 * BLOCK;
+            }
+            return crc0;
+        }
+
+        __attribute__((target("sse4.2")))
+        static uint32_t compute_sse42(uint32_t crc, const unsigned char* p, size_t size) {
+            uint64_t c = ~crc;
+            c = blocks_sse42<LONG>(c, p, size);
+            c = blocks_sse42<SHORT>(c, p, size);
+            for ( ; size >= 8; p += 8, size -= 8) {
+                c = _mm_crc32_u64(c, load64(p));
+            }
+            for ( ; size > 0; ++p, --size) {
+                c = _mm_crc32_u8((uint32_t)c, *p);
+            }
+            return ~(uint32_t)c;
+        }
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+        static uint32_t compute_arm(uint32_t crc, const unsigned char* p, size_t size) {
+            crc = ~crc;
+            for ( ; size >= 8; p += 8, size -= 8) {
+                crc = __crc32cd(crc, load64(p));
+            }
+            for ( ; size > 0; ++p, --size) {
+                crc = __crc32cb(crc, *p);
+            }
+            return ~crc;
+        }
+#endif
+    };
+
+    // xxHash64: not a CRC, but faster still without special
+    // instructions, and 64 bits wide.
+    class XxHash64 {
+    public:
+        typedef uint64_t value_type;
+        static const size_t SIZE = 8;
+
+        explicit XxHash64(uint64_t seed = 0) : seed(seed) {
+            reset();
+        }
+
+        void update(const void* data, size_t size) {
+            const unsigned char* p = (const unsigned char*)data;
+            total += size;
+
+            if (buffered != 0) {
+                size_t n = std::min(size, 32 - buffered);
+                std::memcpy(stripe + buffered, p, n);
+                buffered += n;
+                if (buffered < 32) { return; }
+                consume(stripe);
+                p += n;
+                size -= n;
+                buffered = 0;
+            }
+            for ( ; size >= 32; p += 32, size -= 32) {
+                consume(p);
+            }
+            std::memcpy(stripe, p, size);
+            buffered = size;
+        }
+
+        value_type value() const {
+            uint64_t h;
+            if (total >= 32) {
+                h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+                for (int i = 0; i < 4; ++i) {
+                    h = (h ^ round(0, v[i])) * P1 + P4;
+                }
+            } else {
+                h = seed + P5;
+            }
+            h += total;
+
+            const unsigned char* p = stripe;
+            size_t size = buffered;
+            for ( ; size >= 8; p += 8, size -= 8) {
+                h = rotl(h ^ round(0, load64(p)), 27) * P1 + P4;
+            }
+            if (size >= 4) {
+                uint32_t k;
+                std::memcpy(&k, p, 4);
+                h = rotl(h ^ (k * P1), 23) * P2 + P3;
+                p += 4;
+                size -= 4;
+            }
+            for ( ; size > 0; ++p, --size) {
+                h = rotl(h ^ (*p * P5), 11) * P1;
+            }
+
+            h ^= h >> 33;
+            h *= P2;
+            h ^= h >> 29;
+            h *= P3;
+            h ^= h >> 32;
+            return h;
+        }
+
+        void reset() {
+            v[0] = seed + P1 + P2;
+            v[1] = seed + P2;
+            v[2] = seed;
+            v[3] = seed - P1;
+            total = 0;
+            buffered = 0;
+        }
+
+    private:
+        static const uint64_t P1 = 11400714785074694791ULL;
+        static const uint64_t P2 = 14029467366897019727ULL;
+        static const uint64_t P3 = 1609587929392839161ULL;
+        static const uint64_t P4 = 9650029242287828579ULL;
+        static const uint64_t P5 = 2870177450012600261ULL;
+
+        uint64_t seed;
+        uint64_t v[4];
+        uint64_t total;
+        unsigned char stripe[32];
+        size_t buffered;
+
+        static uint64_t rotl(uint64_t x, int r) {
+            return (x << r) | (x >> (64 - r));
+        }
+
+        static uint64_t load64(const unsigned char* p) {
+            uint64_t v;
+            std::memcpy(&v, p, 8);
+            return v;
+        }
+
+        static uint64_t round(uint64_t acc, uint64_t input) {
+            return rotl(acc + input * P2, 31) * P1;
+        }
+
+        void consume(const unsigned char* p) {
+            for (int i = 0; i < 4; ++i) {
+                v[i] = round(v[i], load64(p + 8 * i));
+            }
+        }
+    };
+
+    template <class Hash>
+    void _put_digest(typename Hash::value_type value, unsigned char* out) {
+        for (size_t i = 0; i < Hash::SIZE; ++i) {
+            out[i] = (unsigned char)(value >> (8 * i));
+        }
+    }
+
+    template <class Writer, class Hash = Crc32c, class WriteFunc = Write<Writer> >
+    class ChecksumWriter {
+    public:
+        ChecksumWriter() {}
+
+        explicit
+        ChecksumWriter(Writer&& file, const Hash& hash = Hash())
+            : file(std::move(file)), hash(hash) {}
+
+        explicit
+        ChecksumWriter(const Writer& file, const Hash& hash = Hash())
+            : file(file), hash(hash) {}
+
+        ChecksumWriter(ChecksumWriter&&) = default;
+        ChecksumWriter& operator= (ChecksumWriter&&) = default;
+
+        size_t write(const void* data, size_t size) {
+            size_t n = writefunc(file, data, size);
+            hash.update(data, n);
+            return n;
+        }
+
+        // The digest of everything written so far.
+        typename Hash::value_type digest() const {
+            return hash.value();
+        }
+
+        // Appends the digest, which is not hashed itself.  Returns
+        // false on error.
+        bool write_trailer() {
+            unsigned char out[Hash::SIZE];
+            _put_digest<Hash>(hash.value(), out);
+            return writefunc(file, out, sizeof out) == sizeof out;
+        }
+
+        void close() {
+            Stream::close<Writer>(file);
+        }
+
+        Writer& stream() {
+            return file;
+        }
+
+    private:
+        Writer file;
+        Hash hash;
+        WriteFunc writefunc;
+    };
+
+    template <class Reader, class Hash = Crc32c, class ReadFunc = Read<Reader> >
+    class ChecksumReader {
+    public:
+        ChecksumReader() {}
+
+        // With `trailer`, the stream ends with the digest of what comes
+        // before it.
+        explicit
+        ChecksumReader(Reader&& file, bool trailer = false, const Hash& hash = Hash())
+            : file(std::move(file)), hash(hash), trailer(trailer), ended(false) {}
+
+        explicit
+        ChecksumReader(const Reader& file, bool trailer = false, const Hash& hash = Hash())
+            : file(file), hash(hash), trailer(trailer), ended(false) {}
+
+        ChecksumReader(ChecksumReader&&) = default;
+        ChecksumReader& operator= (ChecksumReader&&) = default;
+
+        size_t read(void* data, size_t size) {
+            if (!trailer) {
+                size_t n = readfunc(file, data, size);
+                hash.update(data, n);
+                return n;
+            }
+            return read_held((char*)data, size);
+        }
+
+        // The digest of everything read so far.
+        typename Hash::value_type digest() const {
+            return hash.value();
+        }
+
+        // Whether the stream has ended with the trailer it should.
+        bool verified() const {
+            if (!ended || held.size() != Hash::SIZE) { return false; }
+            unsigned char out[Hash::SIZE];
+            _put_digest<Hash>(hash.value(), out);
+            return std::memcmp(out, held.data(), Hash::SIZE) == 0;
+        }
+
+        void close() {
+            Stream::close<Reader>(file);
+        }
+
+        Reader& stream() {
+            return file;
+        }
+
+    private:
+        static const size_t SMALL_READ = 4096;
+
+        Reader file;
+        Hash hash;
+        ReadFunc readfunc;
+        bool trailer;
+        bool ended;
+        std::vector<char> held;         // not handed out yet; ends with the trailer
+
+        // Hands out what is read, but for the last Hash::SIZE bytes.
+        size_t read_held(char* out, size_t size) {
+            const size_t K = Hash::SIZE;
+            if (size == 0) { return 0; }
+            for ( ; ; ) {
+                if (held.size() > K) {
+                    size_t n = std::min(size, held.size() - K);
+                    std::memcpy(out, held.data(), n);
+                    held.erase(held.begin(), held.begin() + n);
+                    hash.update(out, n);
+                    return n;
+                }
+                if (ended) { return 0; }
+
+                size_t h = held.size();
+                if (size > K) {
+                    // Straight into `out`, after what is held.
+                    std::memcpy(out, held.data(), h);
+                    size_t n = readfunc(file, out + h, size - h);
+                    if (n == 0) {
+                        ended = true;
+                        return 0;
+                    }
+                    size_t t = h + n;
+                    held.assign(out + std::max(t, K) - K, out + t);
+                    if (t > K) {
+                        hash.update(out, t - K);
+                        return t - K;
+                    }
+                } else {
+                    held.resize(h + SMALL_READ);
+                    size_t n = readfunc(file, &held[h], SMALL_READ);
+                    held.resize(h + n);
+                    if (n == 0) { ended = true; }
+                }
+            }
+        }
+    };
+
+    template <class Writer, class Hash, class WriteFunc>
+    struct Flush< ChecksumWriter<Writer, Hash, WriteFunc> > {
+        void operator() (ChecksumWriter<Writer, Hash, WriteFunc>& wr) const {
+            Stream::flush<Writer>(wr.stream());
+        }
+    };
+
+    template <class Writer, class Hash, class WriteFunc>
+    struct Sync< ChecksumWriter<Writer, Hash, WriteFunc> > {
+        bool operator() (ChecksumWriter<Writer, Hash, WriteFunc>& wr) const {
+            return Stream::sync<Writer>(wr.stream());
+        }
+    };
+
+}
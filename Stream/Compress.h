@@ -0,0 +1,442 @@
+#pragma once
+
+/*****************************************************************
+ *
+ * Fast LZ compression of a byte stream.
+ *
+ *   BufferedWriter<CompressWriter<PosixFile> > wr{
+ *       CompressWriter<PosixFile>(PosixFile(fd)), ADVISED_SIZE };
+ *   print(wr, output);
+ *
+ *   BufferedReader<DecompressReader<PosixFile> > rd{
+ *       DecompressReader<PosixFile>(PosixFile(fd)) };
+ *
+ * As the file of a BufferedWriter (above), a CompressWriter compresses
+ * the ring segments on the writer's thread, so the producer only
+ * copies into the ring.  On top of one, it compresses on the
+ * producer's thread instead.  Likewise for DecompressReader.
+ *
+ * The stream is a series of blocks of at most `block_size` bytes,
+ * each an 8-byte header (the stored size, whose top bit marks a block
+ * stored as is, and the original size, both little-endian uint32)
+ * and the block.  A CompressWriter gathers writes into whole blocks,
+ * and writes out what it holds on flush, when the BufferedWriter
+ * above it catches up with the producer, and on destruction.
+ *
+ * The codec is LZ77 with a one-way hash table and greedy matching,
+ * in the LZ4 sequence format: it trades ratio for speed, hundreds of
+ * MB/s per core compressing, more decompressing.  Blocks do not
+ * refer to each other, and one that does not shrink is stored.
+ * Corrupt blocks are not always detected; stack a ChecksumWriter
+ * under the compressor where that matters.  Those that are, and a
+ * truncated stream, throw StreamException from read(); under a
+ * BufferedReader, from its read(), after the blocks before them.
+ *
+ *****************************************************************/
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "StreamDefs.h"
+
+namespace Stream {
+
+    struct _Lz {
+        static const int HASH_BITS = 12;
+        static const size_t MIN_MATCH = 4;
+        static const size_t MAX_OFFSET = 65535;
+        static const size_t LAST_LITERALS = 5;      // a block ends in literals
+        static const size_t MATCH_LIMIT = 12;       // no match starts after end - 12
+
+        // Room for the worst case, incompressible data.
+        static size_t bound(size_t size) {
+            return size + size / 255 + 16;
+        }
+
+        static uint32_t load32(const unsigned char* p) {
+            uint32_t v;
+            std::memcpy(&v, p, 4);
+            return v;
+        }
+
+        static uint64_t load64(const unsigned char* p) {
+            uint64_t v;
+            std::memcpy(&v, p, 8);
+            return v;
+        }
+
+        static uint32_t hash(uint32_t v) {
+            return (v * 2654435761u) >> (32 - HASH_BITS);
+        }
+
+        static unsigned char* put_length(unsigned char* op, size_t len) {
+            for ( ; len >= 255; len -= 255) { *op++ = 255; }
+            *op++ = (unsigned char)len;
+            return op;
+        }
+
+        // Compresses `size` bytes into `dst`.  Returns the compressed
+        // size, or 0 if it would not be less than `cap`.
+        static size_t compress(const char* src, size_t size, char* dst, size_t cap) {
+            uint32_t table[1 << HASH_BITS];
+            std::memset(table, 0, sizeof table);
+
+            const unsigned char* base = (const unsigned char*)src;
+            const unsigned char* ip = base;
+            const unsigned char* anchor = base;
+            const unsigned char* end = base + size;
+            const unsigned char* limit = size > MATCH_LIMIT ? end - MATCH_LIMIT : base;
+            unsigned char* op = (unsigned char*)dst;
+            unsigned char* oend = op + cap;
+
+            size_t misses = 0;
+            while (ip < limit) {
+                uint32_t seq = load32(ip);
+                uint32_t h = hash(seq);
+                const unsigned char* ref = base + table[h];
+                table[h] = (uint32_t)(ip - base);
+
+                if (ref >= ip || (size_t)(ip - ref) > MAX_OFFSET || load32(ref) != seq) {
+                    // Skip faster through data that does not compress.
+                    ip += 1 + (misses++ >> 6);
+                    continue;
+                }
+                misses = 0;
+
+                const unsigned char* m = ip + MIN_MATCH;
+                const unsigned char* r = ref + MIN_MATCH;
+                const unsigned char* mend = end - LAST_LITERALS;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                while (m + 8 <= mend) {
+                    uint64_t x = load64(m) ^ load64(r);
+                    if (x != 0) {
+                        size_t same = __builtin_ctzll(x) >> 3;
+                        m += same;
+                        r += same;
+                        break;
+                    }
+                    m += 8;
+                    r += 8;
+                }
+#endif
+                while (m < mend && *m == *r) { ++m; ++r; }
+
+                size_t lit = ip - anchor;
+                size_t mlen = m - ip - MIN_MATCH;
+                if ((size_t)(oend - op) < lit + lit / 255 + mlen / 255 + 8) { return 0; }
+
+                unsigned char* token = op++;
+                *token = (unsigned char)((std::min<size_t>(lit, 15) << 4) | std::min<size_t>(mlen, 15));
+                if (lit >= 15) { op = put_length(op, lit - 15); }
+                std::memcpy(op, anchor, lit);
+                op += lit;
+                size_t off = ip - ref;
+                *op++ = (unsigned char)off;
+                *op++ = (unsigned char)(off >> 8);
+                if (mlen >= 15) { op = put_length(op, mlen - 15); }
+
+                ip = anchor = m;
+            }
+
+            size_t lit = end - anchor;
+            if ((size_t)(oend - op) < lit + lit / 255 + 2) { return 0; }
+            *op++ = (unsigned char)(std::min<size_t>(lit, 15) << 4);
+            if (lit >= 15) { op = put_length(op, lit - 15); }
+            std::memcpy(op, anchor, lit);
+            op += lit;
+
+            size_t n = op - (unsigned char*)dst;
+            return n < cap ? n : 0;
+        }
+
+        static bool get_length(const unsigned char*& ip, const unsigned char* iend, size_t& len) {
+            unsigned char b;
+            do {
+                if (ip == iend) { return false; }
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+            return true;
+        }
+
+        // Decompresses `size` bytes into exactly `raw` bytes at `dst`.
+        // Returns false if the block is corrupt.
+        static bool decompress(const char* src, size_t size, char* dst, size_t raw) {
+            const unsigned char* ip = (const unsigned char*)src;
+            const unsigned char* iend = ip + size;
+            char* op = dst;
+            char* oend = dst + raw;
+
+            while (ip < iend) {
+                unsigned token = *ip++;
+
+                size_t lit = token >> 4;
+                if (lit == 15 && !get_length(ip, iend, lit)) { return false; }
+                if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) { return false; }
+                std::memcpy(op, ip, lit);
+                op += lit;
+                ip += lit;
+                if (ip == iend) { break; }
+
+                if (iend - ip < 2) { return false; }
+                size_t off = ip[0] | ip[1] << 8;
+                ip += 2;
+                if (off == 0 || off > (size_t)(op - dst)) { return false; }
+
+                size_t mlen = token & 15;
+                if (mlen == 15 && !get_length(ip, iend, mlen)) { return false; }
+                mlen += MIN_MATCH;
+                if (mlen > (size_t)(oend - op)) { return false; }
+
+                const char* m = op - off;
+                if (off >= mlen) {
+                    std::memcpy(op, m, mlen);
+                } else {
+                    // Overlapping: the match repeats its last `off` bytes.
+                    for (size_t i = 0; i < mlen; ++i) { op[i] = m[i]; }
+                }
+                op += mlen;
+            }
+            return op == oend;
+        }
+
+        static void put32(char* p, uint32_t v) {
+            for (int i = 0; i < 4; ++i) { p[i] = (char)(v >> (8 * i)); }
+        }
+
+        static uint32_t get32(const char* p) {
+            uint32_t v = 0;
+            for (int i = 0; i < 4; ++i) { v |= (uint32_t)(unsigned char)p[i] << (8 * i); }
+            return v;
+        }
+
+        static const size_t HEADER = 8;
+        static const uint32_t STORED = 0x80000000u;
+    };
+
+    template <class Writer, class WriteFunc = Write<Writer> >
+    class CompressWriter {
+    public:
+        CompressWriter() {}
+
+        explicit
+        CompressWriter(Writer&& file, size_t block_size = 64 << 10)
+            : file(std::move(file)), block(std::min<size_t>(block_size, _Lz::STORED - 1)) {}
+
+        explicit
+        CompressWriter(const Writer& file, size_t block_size = 64 << 10)
+            : file(file), block(std::min<size_t>(block_size, _Lz::STORED - 1)) {}
+
+        CompressWriter(CompressWriter&&) = default;
+        CompressWriter& operator= (CompressWriter&&) = default;
+
+        ~CompressWriter() {
+            if (!stage.empty()) { emit(stage.data(), stage.size()); }
+        }
+
+        // Unless `more` data follows right away, the partial block is
+        // written out too.  Returns 0 on error.
+        size_t write(const void* data, size_t size, bool more = true) {
+            const char* p = (const char*)data;
+            size_t left = size;
+
+            if (!stage.empty()) {
+                size_t take = std::min(left, block - stage.size());
+                stage.insert(stage.end(), p, p + take);
+                p += take;
+                left -= take;
+                if (stage.size() == block) {
+                    if (!emit_stage()) { return 0; }
+                }
+            }
+            for ( ; left >= block; p += block, left -= block) {
+                if (!emit(p, block)) { return 0; }
+            }
+            stage.insert(stage.end(), p, p + left);
+
+            if (!more && !stage.empty() && !emit_stage()) { return 0; }
+            return size;
+        }
+
+        // Writes out the partial block.
+        bool flush() {
+            bool ok = stage.empty() || emit_stage();
+            Stream::flush<Writer>(file);
+            return ok;
+        }
+
+        void close() {
+            flush();
+            Stream::close<Writer>(file);
+        }
+
+        size_t block_size() const {
+            return block;
+        }
+
+        Writer& stream() {
+            return file;
+        }
+
+    private:
+        Writer file;
+        WriteFunc writefunc;
+        size_t block;
+        std::vector<char> stage;
+        std::vector<char> out;
+
+        bool emit_stage() {
+            bool ok = emit(stage.data(), stage.size());
+            stage.clear();
+            return ok;
+        }
+
+        bool emit(const char* data, size_t size) {
+            out.resize(_Lz::HEADER + _Lz::bound(size));
+            char* body = &out[_Lz::HEADER];
+            size_t n = _Lz::compress(data, size, body, size);
+            if (n == 0) {
+                std::memcpy(body, data, size);
+                _Lz::put32(&out[0], (uint32_t)size | _Lz::STORED);
+                n = size;
+            } else {
+                _Lz::put32(&out[0], (uint32_t)n);
+            }
+            _Lz::put32(&out[4], (uint32_t)size);
+
+            size_t total = _Lz::HEADER + n;
+            return writefunc(file, out.data(), total) == total;
+        }
+    };
+
+    template <class Reader, class ReadFunc = Read<Reader> >
+    class DecompressReader {
+    public:
+        DecompressReader() {}
+
+        // Blocks larger than `max_block` are taken for a corrupt stream.
+        explicit
+        DecompressReader(Reader&& file, size_t max_block = 4 << 20)
+            : file(std::move(file)), max_block(max_block), pos(0) {}
+
+        explicit
+        DecompressReader(const Reader& file, size_t max_block = 4 << 20)
+            : file(file), max_block(max_block), pos(0) {}
+
+        DecompressReader(DecompressReader&&) = default;
+        DecompressReader& operator= (DecompressReader&&) = default;
+
+        // Returns what is left of the current block, or the next one;
+        // 0 at the end of stream.
+        size_t read(void* data, size_t size) {
+            if (pos == block.size()) {
+                pos = 0;
+                block.clear();
+
+                char header[_Lz::HEADER];
+                if (!read_full(header, sizeof header, true)) { return 0; }
+                uint32_t stored = _Lz::get32(header);
+                size_t raw = _Lz::get32(header + 4);
+                bool is_stored = (stored & _Lz::STORED) != 0;
+                stored &= ~_Lz::STORED;
+                if (raw > max_block || stored > _Lz::bound(raw) || (is_stored && stored != raw)) {
+                    throw StreamException("corrupt compressed block");
+                }
+
+                if (is_stored && raw <= size) {
+                    read_full((char*)data, raw, false);
+                    return raw;
+                }
+                in.resize(stored);
+                read_full(in.data(), stored, false);
+                if (is_stored) {
+                    in.swap(block);
+                } else if (raw <= size) {
+                    decode((char*)data, raw);
+                    return raw;
+                } else {
+                    block.resize(raw);
+                    decode(block.data(), raw);
+                }
+            }
+
+            size_t n = std::min(size, block.size() - pos);
+            std::memcpy(data, block.data() + pos, n);
+            pos += n;
+            return n;
+        }
+
+        void close() {
+            Stream::close<Reader>(file);
+        }
+
+        Reader& stream() {
+            return file;
+        }
+
+    private:
+        Reader file;
+        ReadFunc readfunc;
+        size_t max_block;
+        std::vector<char> in;
+        std::vector<char> block;        // decompressed, not handed out yet
+        size_t pos;
+
+        // Returns false on a clean end of stream, if `at_boundary`.
+        bool read_full(char* data, size_t size, bool at_boundary) {
+            size_t done = 0;
+            while (done < size) {
+                size_t n = readfunc(file, data + done, size - done);
+                if (n == 0) {
+                    if (done == 0 && at_boundary) { return false; }
+                    throw StreamException("truncated compressed block");
+                }
+                done += n;
+            }
+            return true;
+        }
+
+        void decode(char* dst, size_t raw) {
+            if (!_Lz::decompress(in.data(), in.size(), dst, raw)) {
+                throw StreamException("corrupt compressed block");
+            }
+        }
+    };
+
+    // Lets a BufferedWriter above tell when it has caught up.
+    template <class Writer, class WriteFunc>
+    struct Write< CompressWriter<Writer, WriteFunc> > {
+        size_t operator() (CompressWriter<Writer, WriteFunc>& wr,
+                           const void* data, size_t size, bool more = true) const {
+            return wr.write(data, size, more);
+        }
+    };
+
+    template <class Writer, class WriteFunc>
+    struct Flush< CompressWriter<Writer, WriteFunc> > {
+        void operator() (CompressWriter<Writer, WriteFunc>& wr) const {
+            wr.flush();
+        }
+    };
+
+    // Only what has been flushed out of the staged block is made
+    // durable.
+    template <class Writer, class WriteFunc>
+    struct Sync< CompressWriter<Writer, WriteFunc> > {
+        bool operator() (CompressWriter<Writer, WriteFunc>& wr) const {
+            return Stream::sync<Writer>(wr.stream());
+        }
+    };
+
+    // A ring of four blocks, so that a batch is one block, if asked for
+    // (ADVISED_SIZE).
+    template <class Writer, class WriteFunc>
+    struct Advise< CompressWriter<Writer, WriteFunc> > {
+        size_t operator() (CompressWriter<Writer, WriteFunc>& wr, bool) const {
+            return 4 * wr.block_size();
+        }
+    };
+
+}
@@ -0,0 +1,433 @@
+#pragma once
+
+/*****************************************************************
+ *
+ * A writer shared by many producer threads.
+ *
+ *   ConcurrentWriter<PosixFile> log{ PosixFile(fd) };
+ *
+ *   // on any thread
+ *   log.write(line, size);            // one record
+ *   {
+ *       auto rec = log.record();      // one record, built piecewise
+ *       print(rec, "GET ", path, " ", status, "\n");
+ *   }
+ *
+ * Every producer thread appends whole records to a staging area of
+ * its own, so producers do not contend with each other, and records
+ * are never interleaved.  A single writer thread collects the staged
+ * records of all threads in the order they were appended and writes
+ * each batch with one gathered write (WriteV).
+ *
+ *****************************************************************/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "StreamDefs.h"
+
+namespace Stream {
+
+    template <class Writer, class WriteVFunc = WriteV<Writer> >
+    class ConcurrentWriter {
+        struct Body;
+
+    public:
+        // A record built by several writes, e.g. by print().
+        // It is appended when it is committed or destroyed.
+        class Record {
+        public:
+            explicit Record(ConcurrentWriter& wr) : body(wr.body.get()), size(0) {}
+
+            Record(Record&& that) : body(that.body), size(that.size), spill(std::move(that.spill)) {
+                std::memcpy(local, that.local, std::min(size, sizeof local));
+                that.body = nullptr;
+            }
+
+            Record(const Record&) = delete;
+            Record& operator= (const Record&) = delete;
+
+            ~Record() {
+                commit();
+            }
+
+            size_t write(const void* data, size_t n) {
+                if (size + n <= sizeof local) {
+                    std::memcpy(local + size, data, n);
+                } else {
+                    if (spill.empty()) { spill.assign(local, size); }
+                    spill.append((const char*)data, n);
+                }
+                size += n;
+                return n;
+            }
+
+            void commit() {
+                if (body == nullptr) { return; }
+                if (size != 0) {
+                    body->append(spill.empty() ? local : spill.data(), size);
+                }
+                body = nullptr;
+            }
+
+        private:
+            Body* body;
+            size_t size;
+            char local[256];
+            std::string spill;
+        };
+
+        ConcurrentWriter() {}
+
+        explicit
+        ConcurrentWriter(Writer&& file, size_t staging_size = 65536, size_t batch_size = 16384) {
+            body = std::unique_ptr<Body>(new Body(std::move(file)));
+            initialize(staging_size, batch_size);
+        }
+
+        explicit
+        ConcurrentWriter(const Writer& file, size_t staging_size = 65536, size_t batch_size = 16384) {
+            body = std::unique_ptr<Body>(new Body(file));
+            initialize(staging_size, batch_size);
+        }
+
+        ConcurrentWriter(ConcurrentWriter&& that) {
+            body = std::move(that.body);
+        }
+
+        ConcurrentWriter& operator= (ConcurrentWriter&& that) {
+            body = std::move(that.body);
+            return *this;
+        }
+
+        ~ConcurrentWriter() {
+            if (body == nullptr) { return; }
+
+            close();
+            body->writer_thread.join();
+        }
+
+        ConcurrentWriter(const ConcurrentWriter&) = delete;
+        ConcurrentWriter& operator= (const ConcurrentWriter&) = delete;
+
+        // Appends one record.
+        size_t write(const void* data, size_t size) {
+            return body->append(data, size);
+        }
+
+        Record record() {
+            return Record(*this);
+        }
+
+        // Waits until every record appended before the call, by any
+        // thread, has been written.
+        void flush() {
+            body->flush();
+        }
+
+        void close() {
+            std::lock_guard<std::mutex> lock(body->mtx_w);
+            body->is_running = false;
+            body->cnd_w.notify_all();
+        }
+
+        // Records are written out at the latest `latency` after they
+        // were appended, even if there are fewer than `batch_size`
+        // bytes staged.  Zero turns the deadline off.
+        void set_max_latency(std::chrono::microseconds latency) {
+            std::lock_guard<std::mutex> lock(body->mtx_w);
+            body->max_latency = latency;
+            body->cnd_w.notify_all();
+        }
+
+    private:
+        struct Entry {
+            uint64_t seq;
+            size_t size;
+        };
+
+        // Records of one producer thread.  The producer appends to
+        // `bytes`/`entries`; the writer thread moves them to
+        // `w_bytes`/`w_entries` and writes them from there.
+        struct Staging {
+            std::mutex mtx;
+            std::condition_variable cnd;
+            std::vector<char> bytes;
+            std::vector<Entry> entries;
+
+            std::vector<char> w_bytes;
+            std::vector<Entry> w_entries;
+            size_t w_entry;
+            size_t w_offset;
+
+            Staging() : w_entry(0), w_offset(0) {}
+        };
+
+        struct Body {
+            typedef std::chrono::steady_clock Clock;
+
+            Writer file;
+            WriteVFunc writevfunc;
+
+            uint64_t id;
+            std::shared_ptr<char> alive;    // expires with the body
+            size_t staging_size;
+            size_t batch_size;
+
+            std::mutex mtx_s;
+            std::vector<std::unique_ptr<Staging>> stagings;
+
+            std::atomic<uint64_t> next_seq;
+            std::atomic<size_t> pending;
+
+            std::mutex mtx_w;
+            std::condition_variable cnd_w;
+            std::condition_variable cnd_r;
+            uint64_t flush_target;
+            uint64_t written_seq;
+            std::atomic<bool> is_running;
+
+            // When the oldest unwritten record was appended, if
+            // `has_since`.  Guarded by mtx_w.
+            std::chrono::microseconds max_latency;
+            Clock::time_point since;
+            bool has_since;
+
+            std::thread writer_thread;
+
+            Body(const Writer& f) : file(f) {}
+            Body(Writer&& f) : file(std::move(f)) {}
+
+            static std::atomic<uint64_t>& last_id() {
+                static std::atomic<uint64_t> counter(0);
+                return counter;
+            }
+
+            struct CacheEntry {
+                uint64_t id;
+                std::weak_ptr<char> alive;
+                Staging* staging;
+            };
+
+            // The staging area of the calling thread, found through a
+            // thread-local cache keyed by writer id, as ids are never
+            // reused (addresses could be).  Entries of writers that
+            // were destroyed are dropped on the next miss.
+            Staging& staging() {
+                thread_local std::vector<CacheEntry> cache;
+
+                for (auto& c : cache) {
+                    if (c.id == id) { return *c.staging; }
+                }
+
+                cache.erase(std::remove_if(cache.begin(), cache.end(),
+                                [](const CacheEntry& c) { return c.alive.expired(); }),
+                            cache.end());
+
+                Staging* s = new Staging();
+                {
+                    std::lock_guard<std::mutex> lock(mtx_s);
+                    stagings.emplace_back(s);
+                }
+                CacheEntry c = { id, alive, s };
+                cache.push_back(c);
+                return *s;
+            }
+
+            size_t append(const void* data, size_t size) {
+                Staging& s = staging();
+                size_t before;
+                {
+                    std::unique_lock<std::mutex> lock(s.mtx);
+                    while (is_running && s.bytes.size() >= staging_size) {
+                        s.cnd.wait(lock);
+                    }
+                    if (!is_running) { return 0; }
+
+                    // Taken under the staging lock, so that every record
+                    // numbered below a cut is staged once the writer
+                    // thread has taken all staging locks.
+                    Entry e = { next_seq.fetch_add(1), size };
+                    s.entries.push_back(e);
+                    s.bytes.insert(s.bytes.end(), (const char*)data, (const char*)data + size);
+                    before = pending.fetch_add(size);
+                }
+
+                if (before < batch_size && before + size >= batch_size) {
+                    std::lock_guard<std::mutex> lock(mtx_w);
+                    cnd_w.notify_one();
+                } else if (before == 0) {
+                    // The first record since the last batch starts the
+                    // latency deadline.
+                    std::lock_guard<std::mutex> lock(mtx_w);
+                    if (max_latency.count() > 0 && !has_since) {
+                        since = Clock::now();
+                        has_since = true;
+                        cnd_w.notify_one();
+                    }
+                }
+                return size;
+            }
+
+            void flush() {
+                std::unique_lock<std::mutex> lock(mtx_w);
+                uint64_t target = next_seq.load();
+                if (flush_target < target) { flush_target = target; }
+                cnd_w.notify_all();
+                while (written_seq < target && is_running) {
+                    cnd_r.wait(lock);
+                }
+            }
+
+            void keep_writing() {
+                std::unique_lock<std::mutex> lock(mtx_w);
+                for ( ; ; ) {
+                    while (is_running && pending < batch_size && flush_target <= written_seq) {
+                        if (pending != 0 && max_latency.count() > 0) {
+                            if (!has_since) {
+                                since = Clock::now();
+                                has_since = true;
+                            }
+                            Clock::time_point deadline = since + max_latency;
+                            if (Clock::now() >= deadline) { break; }
+                            cnd_w.wait_until(lock, deadline);
+                            continue;
+                        }
+                        cnd_w.wait(lock);
+                    }
+                    if (!is_running && pending == 0) { break; }
+
+                    uint64_t cut = next_seq.load();
+                    Clock::time_point start = Clock::now();
+                    lock.unlock();
+
+                    bool ok = write_batch(cut);
+
+                    lock.lock();
+                    if (!ok) {
+                        is_running = false;
+                    } else if (written_seq < cut) {
+                        written_seq = cut;
+                    }
+                    // What is left was appended after the cut.
+                    has_since = pending != 0;
+                    since = start;
+                    cnd_r.notify_all();
+                    if (!ok) { break; }
+                }
+
+                // Wake producers blocked on a full staging area.
+                std::lock_guard<std::mutex> lock_s(mtx_s);
+                for (auto& s : stagings) {
+                    std::lock_guard<std::mutex> lock_one(s->mtx);
+                    s->cnd.notify_all();
+                }
+            }
+
+            // Moves what the producer staged to the writer's side.
+            static void take(Staging& s) {
+                std::lock_guard<std::mutex> lock(s.mtx);
+                if (s.entries.empty()) { return; }
+
+                if (s.w_entry == s.w_entries.size()) {
+                    s.w_bytes.clear();
+                    s.w_entries.clear();
+                    s.w_entry = 0;
+                    s.w_offset = 0;
+                    s.w_bytes.swap(s.bytes);
+                    s.w_entries.swap(s.entries);
+                } else {
+                    s.w_bytes.insert(s.w_bytes.end(), s.bytes.begin(), s.bytes.end());
+                    s.w_entries.insert(s.w_entries.end(), s.entries.begin(), s.entries.end());
+                    s.bytes.clear();
+                    s.entries.clear();
+                }
+                s.cnd.notify_all();
+            }
+
+            // Writes every staged record numbered below `cut`, in order.
+            bool write_batch(uint64_t cut) {
+                std::vector<Staging*> list;
+                {
+                    std::lock_guard<std::mutex> lock(mtx_s);
+                    for (auto& s : stagings) { list.push_back(s.get()); }
+                }
+                for (Staging* s : list) { take(*s); }
+
+                typedef std::pair<uint64_t, size_t> Head;
+                std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+                for (size_t i = 0; i < list.size(); ++i) {
+                    Staging& s = *list[i];
+                    if (s.w_entry < s.w_entries.size()) {
+                        heads.push(Head(s.w_entries[s.w_entry].seq, i));
+                    }
+                }
+
+                std::vector<iovec> iov;
+                size_t total = 0;
+                size_t last = list.size();
+                while (!heads.empty() && heads.top().first < cut) {
+                    size_t i = heads.top().second;
+                    heads.pop();
+
+                    Staging& s = *list[i];
+                    const Entry& e = s.w_entries[s.w_entry];
+                    char* ptr = s.w_bytes.data() + s.w_offset;
+
+                    // Consecutive records of a thread are adjacent.
+                    if (last == i && !iov.empty()) {
+                        iov.back().iov_len += e.size;
+                    } else {
+                        iovec v = { ptr, e.size };
+                        iov.push_back(v);
+                    }
+                    last = i;
+                    total += e.size;
+
+                    s.w_offset += e.size;
+                    s.w_entry += 1;
+                    if (s.w_entry < s.w_entries.size()) {
+                        heads.push(Head(s.w_entries[s.w_entry].seq, i));
+                    }
+                }
+
+                if (iov.empty()) { return true; }
+
+                size_t n = writevfunc(file, iov.data(), iov.size());
+                pending -= total;
+                return n == total;
+            }
+        };
+
+        std::unique_ptr<Body> body;
+
+        void initialize(size_t staging_size, size_t batch_size) {
+            body->id = ++Body::last_id();
+            body->alive = std::make_shared<char>();
+            body->staging_size = staging_size;
+            body->batch_size = std::max<size_t>(1, std::min(batch_size, staging_size));
+            body->next_seq = 0;
+            body->pending = 0;
+            body->flush_target = 0;
+            body->written_seq = 0;
+            body->is_running = true;
+            body->max_latency = std::chrono::microseconds(0);
+            body->has_since = false;
+
+            Body* pbody = body.get();
+            body->writer_thread = std::thread(
+                [ pbody ] { pbody->keep_writing(); }
+            );
+        }
+    };
+
+}
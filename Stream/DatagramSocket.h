@@ -0,0 +1,357 @@
+#pragma once
+
+/*****************************************************************
+ *
+ * A datagram socket that receives and sends in batches.
+ *
+ *   DatagramSocket udp(PosixFile(fd), 64);
+ *
+ *   DatagramSocket::Datagram* batch;
+ *   while (size_t n = udp.receive(batch)) {     // one recvmmsg
+ *       for (size_t i = 0; i < n; ++i) {
+ *           handle(batch[i].data, batch[i].size);
+ *       }
+ *   }
+ *
+ *   udp.send(data, size, (sockaddr*)&to, sizeof to);  // queued
+ *   udp.flush();                                      // one sendmmsg
+ *
+ * Received datagrams live in a ring of `depth` preallocated slots,
+ * filled `batch` at a time, so a batch stays valid while the next
+ * depth / batch - 1 batches are received.
+ *
+ * With GRO, the kernel may hand several datagrams of one sender in a
+ * slot, each `segment_size` long but the last; slots must then hold
+ * 64 KiB.  With GSO, queued datagrams of equal size to one peer are
+ * sent as one buffer, which the kernel (or the NIC) cuts up.
+ *
+ *****************************************************************/
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include "StreamDefs.h"
+#include "PosixFileDesc.h"
+
+namespace Stream {
+
+    class DatagramSocket {
+    public:
+        struct Datagram {
+            char* data;
+            size_t size;
+            size_t segment_size;        // GRO: size of each datagram held
+            sockaddr_storage peer;
+            socklen_t peer_len;
+        };
+
+        static const size_t MAX_DATAGRAM = 65536;
+
+        DatagramSocket()
+            : batch(0), slot_size(0), rx_next(0), read_pos(0), read_end(0),
+              tx_count(0), gso(false) {}
+
+        // `depth` is rounded up to a multiple of `batch`, and is twice
+        // `batch` if zero.  Longer datagrams are truncated to `slot_size`.
+        explicit
+        DatagramSocket(PosixFile&& sock, size_t batch = 64, size_t depth = 0, size_t slot_size = 2048)
+            : sock(std::move(sock)), batch(std::max<size_t>(1, batch)),
+              slot_size(slot_size), rx_next(0), read_pos(0), read_end(0),
+              tx_count(0), gso(false)
+        {
+            if (depth < this->batch) { depth = 2 * this->batch; }
+            depth = (depth + this->batch - 1) / this->batch * this->batch;
+
+            rx_buffer.resize(depth * slot_size);
+            rx_slots.resize(depth);
+            for (size_t i = 0; i < depth; ++i) {
+                rx_slots[i].data = &rx_buffer[i * slot_size];
+            }
+            rx_control.resize(this->batch * CONTROL);
+            tx_buffer.resize(this->batch * slot_size);
+            tx_slots.resize(this->batch);
+            tx_control.resize(this->batch * CONTROL);
+#if defined(__linux__)
+            rx_hdr.resize(this->batch);
+            tx_hdr.resize(this->batch);
+            rx_iov.resize(this->batch);
+            tx_iov.resize(this->batch);
+#endif
+        }
+
+        DatagramSocket(DatagramSocket&&) = default;
+        DatagramSocket& operator= (DatagramSocket&&) = default;
+
+        ~DatagramSocket() {
+            if (!sock.empty()) { flush(); }
+        }
+
+        int get() const {
+            return sock.get();
+        }
+
+        // Waits for one datagram, then takes up to `batch` that have
+        // arrived with one call.  Points `first` at them and returns
+        // how many; 0 on error.
+        size_t receive(Datagram*& first) {
+            if (rx_next == rx_slots.size()) { rx_next = 0; }
+            Datagram* slots = &rx_slots[rx_next];
+
+#if defined(__linux__)
+            mmsghdr* hdr = &rx_hdr[0];
+            for (size_t i = 0; i < batch; ++i) {
+                rx_iov[i].iov_base = slots[i].data;
+                rx_iov[i].iov_len = slot_size;
+                std::memset(&hdr[i], 0, sizeof hdr[i]);
+                hdr[i].msg_hdr.msg_name = &slots[i].peer;
+                hdr[i].msg_hdr.msg_namelen = sizeof slots[i].peer;
+                hdr[i].msg_hdr.msg_iov = &rx_iov[i];
+                hdr[i].msg_hdr.msg_iovlen = 1;
+                hdr[i].msg_hdr.msg_control = &rx_control[i * CONTROL];
+                hdr[i].msg_hdr.msg_controllen = CONTROL;
+            }
+
+            int n;
+            do {
+                n = ::recvmmsg(sock.get(), hdr, batch, MSG_WAITFORONE, nullptr);
+            } while (n < 0 && errno == EINTR);
+            if (n <= 0) { return 0; }
+
+            for (int i = 0; i < n; ++i) {
+                slots[i].size = hdr[i].msg_len;
+                slots[i].peer_len = hdr[i].msg_hdr.msg_namelen;
+                slots[i].segment_size = gro_size(hdr[i].msg_hdr, hdr[i].msg_len);
+            }
+#else
+            int n = 0;
+            while ((size_t)n < batch) {
+                Datagram& d = slots[n];
+                d.peer_len = sizeof d.peer;
+                ssize_t r = ::recvfrom(sock.get(), d.data, slot_size, n == 0 ? 0 : MSG_DONTWAIT,
+                                       (sockaddr*)&d.peer, &d.peer_len);
+                if (r < 0 && errno == EINTR) { continue; }
+                if (r < 0) { break; }
+                d.size = r;
+                d.segment_size = r;
+                n += 1;
+            }
+            if (n == 0) { return 0; }
+#endif
+            first = slots;
+            rx_next += batch;
+            read_pos = read_end = 0;
+            return n;
+        }
+
+        // Copies one datagram (or GRO segment group), receiving a
+        // batch when the last one is used up.
+        size_t read(void* data, size_t size) {
+            if (read_pos == read_end) {
+                Datagram* first;
+                size_t n = receive(first);
+                if (n == 0) { return 0; }
+                read_pos = first - &rx_slots[0];
+                read_end = read_pos + n;
+            }
+            const Datagram& d = rx_slots[read_pos++];
+            size_t n = std::min(size, d.size);
+            std::memcpy(data, d.data, n);
+            return n;
+        }
+
+        // Queues one datagram to `to` (or to the connected peer), and
+        // sends the queue once `batch` are waiting.  Returns false on
+        // error.
+        bool send(const void* data, size_t size, const sockaddr* to = nullptr, socklen_t to_len = 0) {
+            if (size > capacity()) {
+                // Too long for a slot: keep the order, then send it alone.
+                if (!flush()) { return false; }
+                ssize_t n = ::sendto(sock.get(), data, size, 0, to, to_len);
+                return n == (ssize_t)size;
+            }
+
+            if (tx_count != 0 && coalesce(data, size, to, to_len)) {
+                return true;
+            }
+            if (tx_count == batch && !flush()) { return false; }
+
+            TxSlot& s = tx_slots[tx_count++];
+            std::memcpy(slot(s), data, size);
+            s.size = size;
+            s.segment_size = size;
+            s.peer_len = to_len;
+            if (to_len != 0) { std::memcpy(&s.peer, to, to_len); }
+
+            return tx_count < batch || flush();
+        }
+
+        // Sends one datagram to the connected peer, as part of a batch.
+        size_t write(const void* data, size_t size) {
+            return send(data, size) ? size : 0;
+        }
+
+        // Sends every queued datagram.  Returns false on error; the
+        // queue is emptied anyway.
+        bool flush() {
+            size_t done = 0;
+            bool ok = true;
+            while (done < tx_count && ok) {
+#if defined(__linux__)
+                mmsghdr* hdr = &tx_hdr[0];
+                size_t count = tx_count - done;
+                for (size_t i = 0; i < count; ++i) {
+                    TxSlot& s = tx_slots[done + i];
+                    tx_iov[i].iov_base = slot(s);
+                    tx_iov[i].iov_len = s.size;
+                    std::memset(&hdr[i], 0, sizeof hdr[i]);
+                    hdr[i].msg_hdr.msg_name = s.peer_len != 0 ? &s.peer : nullptr;
+                    hdr[i].msg_hdr.msg_namelen = s.peer_len;
+                    hdr[i].msg_hdr.msg_iov = &tx_iov[i];
+                    hdr[i].msg_hdr.msg_iovlen = 1;
+                    if (s.size > s.segment_size) {
+                        set_gso_size(hdr[i].msg_hdr, &tx_control[i * CONTROL], s.segment_size);
+                    }
+                }
+
+                int n = ::sendmmsg(sock.get(), hdr, count, 0);
+                if (n < 0 && errno == EINTR) { continue; }
+                if (n <= 0) { ok = false; break; }
+                done += n;
+#else
+                TxSlot& s = tx_slots[done];
+                ssize_t n = ::sendto(sock.get(), slot(s), s.size, 0,
+                                     s.peer_len != 0 ? (const sockaddr*)&s.peer : nullptr,
+                                     s.peer_len);
+                if (n < 0 && errno == EINTR) { continue; }
+                if (n != (ssize_t)s.size) { ok = false; break; }
+                done += 1;
+#endif
+            }
+            tx_count = 0;
+            return ok;
+        }
+
+        // Lets the kernel merge datagrams of one flow on receipt.
+        // Returns false if it is not supported, or if slots are too
+        // short for merged datagrams.
+        bool set_gro(bool on) {
+#if defined(UDP_GRO)
+            if (on && slot_size < MAX_DATAGRAM) { return false; }
+            int v = on;
+            return ::setsockopt(sock.get(), IPPROTO_UDP, UDP_GRO, &v, sizeof v) == 0;
+#else
+            return !on;
+#endif
+        }
+
+        // Sends runs of equal-sized datagrams to one peer as one buffer
+        // (UDP_SEGMENT).  Returns false if it is not supported.
+        bool set_gso(bool on) {
+#if defined(UDP_SEGMENT)
+            flush();
+            gso = on;
+            tx_buffer.resize(batch * capacity());
+            return true;
+#else
+            return !on;
+#endif
+        }
+
+    private:
+        static const size_t MAX_SEGMENTS = 64;
+        static const size_t CONTROL = 64;
+
+        struct TxSlot {
+            size_t size;
+            size_t segment_size;
+            sockaddr_storage peer;
+            socklen_t peer_len;
+        };
+
+        PosixFile sock;
+        size_t batch;
+        size_t slot_size;
+
+        std::vector<char> rx_buffer;
+        std::vector<Datagram> rx_slots;
+        std::vector<char> rx_control;
+        size_t rx_next;
+        size_t read_pos;
+        size_t read_end;
+
+        std::vector<char> tx_buffer;
+        std::vector<TxSlot> tx_slots;
+        std::vector<char> tx_control;
+        size_t tx_count;
+        bool gso;
+
+#if defined(__linux__)
+        std::vector<mmsghdr> rx_hdr;
+        std::vector<mmsghdr> tx_hdr;
+        std::vector<iovec> rx_iov;
+        std::vector<iovec> tx_iov;
+#endif
+
+        size_t capacity() const {
+            return gso ? MAX_DATAGRAM : slot_size;
+        }
+
+        char* slot(const TxSlot& s) {
+            return &tx_buffer[(&s - &tx_slots[0]) * capacity()];
+        }
+
+        // Appends the datagram to the last queued one, if GSO can send
+        // both as one: same peer, same size (or a shorter last one).
+        bool coalesce(const void* data, size_t size, const sockaddr* to, socklen_t to_len) {
+            if (!gso) { return false; }
+            TxSlot& s = tx_slots[tx_count - 1];
+            if (size > s.segment_size || s.size % s.segment_size != 0) { return false; }
+            if (s.size + size > capacity() - 64 || s.size / s.segment_size >= MAX_SEGMENTS) { return false; }
+            if (s.peer_len != to_len || (to_len != 0 && std::memcmp(&s.peer, to, to_len) != 0)) {
+                return false;
+            }
+            std::memcpy(slot(s) + s.size, data, size);
+            s.size += size;
+            return true;
+        }
+
+#if defined(__linux__)
+        static size_t gro_size(const msghdr& msg, size_t size) {
+#if defined(UDP_GRO)
+            for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR((msghdr*)&msg, cm)) {
+                if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO) {
+                    int v;
+                    std::memcpy(&v, CMSG_DATA(cm), sizeof v);
+                    return v;
+                }
+            }
+#endif
+            (void)msg;
+            return size;
+        }
+
+        static void set_gso_size(msghdr& msg, char* control, size_t segment_size) {
+#if defined(UDP_SEGMENT)
+            msg.msg_control = control;
+            msg.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+            cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+            cm->cmsg_level = IPPROTO_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t v = segment_size;
+            std::memcpy(CMSG_DATA(cm), &v, sizeof v);
+#else
+            (void)msg; (void)control; (void)segment_size;
+#endif
+        }
+#endif
+    };
+
+}
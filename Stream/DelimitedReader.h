@@ -0,0 +1,307 @@
+#pragma once
+
+/*****************************************************************
+ *
+ * CSV / TSV rows, split in place.
+ *
+ *   DelimitedReader<PosixFile> rd(PosixFile(fd), '\t');
+ *   DelimitedReader<PosixFile>::Row row;
+ *   while (rd.read_row(row)) {
+ *       for (auto& f : row) { use(f.data, f.size); }
+ *   }
+ *
+ * Rows end with "\n" or "\r\n"; fields are separated by `delimiter`.
+ * A field enclosed in `quote` may hold delimiters and newlines, and
+ * a doubled quote stands for one quote (RFC 4180).  A `quote` of '\0'
+ * turns quoting off, as TSV usually wants.
+ *
+ * The bytes are classified 64 at a time into bitmasks of delimiters,
+ * quotes and newlines (SSE2 or AVX2 where the compiler targets it).
+ * The running XOR of the quote mask marks the bytes inside quotes,
+ * whose delimiters and newlines are masked off (as simdjson does).
+ *
+ * Fields are views into the ring of the underlying BufferedReader,
+ * valid until the next row.  A row is copied only if it wraps around
+ * the end of the ring, and a quoted field only if it holds a doubled
+ * quote.  Reusing one Row, no allocation happens once the buffers
+ * have grown to the longest row.
+ *
+ *****************************************************************/
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__PCLMUL__)
+#include <wmmintrin.h>
+#endif
+
+#include "StreamDefs.h"
+#include "BufferedReader.h"
+
+namespace Stream {
+
+    // Bitmasks of the delimiters, quotes and newlines of 64 bytes.
+    struct _DelimitedMasks {
+        uint64_t delim;
+        uint64_t quote;
+        uint64_t eol;
+
+        void classify(const char* p, char delimiter, char quote_char) {
+#if defined(__AVX2__)
+            __m256i lo = _mm256_loadu_si256((const __m256i*)p);
+            __m256i hi = _mm256_loadu_si256((const __m256i*)(p + 32));
+            delim = match(lo, hi, _mm256_set1_epi8(delimiter));
+            quote = match(lo, hi, _mm256_set1_epi8(quote_char));
+            eol   = match(lo, hi, _mm256_set1_epi8('\n'));
+#elif defined(__SSE2__)
+            __m128i v[4];
+            for (int i = 0; i < 4; ++i) {
+                v[i] = _mm_loadu_si128((const __m128i*)(p + 16 * i));
+            }
+            delim = match(v, _mm_set1_epi8(delimiter));
+            quote = match(v, _mm_set1_epi8(quote_char));
+            eol   = match(v, _mm_set1_epi8('\n'));
+#else
+            delim = quote = eol = 0;
+            for (int i = 0; i < 64; ++i) {
+                uint64_t bit = uint64_t(1) << i;
+                if (p[i] == delimiter)  { delim |= bit; }
+                if (p[i] == quote_char) { quote |= bit; }
+                if (p[i] == '\n')       { eol   |= bit; }
+            }
+#endif
+            if (quote_char == '\0') { quote = 0; }
+        }
+
+#if defined(__AVX2__)
+        static uint64_t match(__m256i lo, __m256i hi, __m256i c) {
+            uint32_t l = _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, c));
+            uint32_t h = _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, c));
+            return l | (uint64_t)h << 32;
+        }
+#elif defined(__SSE2__)
+        static uint64_t match(const __m128i* v, __m128i c) {
+            uint64_t m = 0;
+            for (int i = 0; i < 4; ++i) {
+                m |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[i], c)) << (16 * i);
+            }
+            return m;
+        }
+#endif
+
+        // Bit i is the XOR of bits 0..i.
+        static uint64_t prefix_xor(uint64_t x) {
+#if defined(__PCLMUL__)
+            __m128i r = _mm_clmulepi64_si128(_mm_set_epi64x(0, (long long)x),
+                                             _mm_set1_epi8(-1), 0);
+            return (uint64_t)_mm_cvtsi128_si64(r);
+#else
+            x ^= x << 1;
+            x ^= x << 2;
+            x ^= x << 4;
+            x ^= x << 8;
+            x ^= x << 16;
+            x ^= x << 32;
+            return x;
+#endif
+        }
+    };
+
+    template <class Reader, class ReadFunc = Read<Reader> >
+    class DelimitedReader {
+    public:
+        typedef BufferedReader<Reader, ReadFunc> Input;
+
+        struct Field {
+            const char* data;
+            size_t size;
+        };
+
+        typedef std::vector<Field> Row;
+
+        DelimitedReader() {}
+
+        // Rows longer than `max_row` (e.g. after an unbalanced quote)
+        // are taken for a corrupt stream.
+        explicit
+        DelimitedReader(Reader&& file, char delimiter = ',', char quote = '"',
+                        size_t buffer_size = 0, size_t max_row = 16 << 20)
+            : input(std::move(file), buffer_size), delimiter(delimiter), quote(quote),
+              max_row(max_row), pending(0) {}
+
+        explicit
+        DelimitedReader(const Reader& file, char delimiter = ',', char quote = '"',
+                        size_t buffer_size = 0, size_t max_row = 16 << 20)
+            : input(file, buffer_size), delimiter(delimiter), quote(quote),
+              max_row(max_row), pending(0) {}
+
+        DelimitedReader(DelimitedReader&&) = default;
+        DelimitedReader& operator= (DelimitedReader&&) = default;
+
+        // Reads the next row into `row`; the previous one is dropped.
+        // Returns false at the end of stream.
+        bool read_row(Row& row) {
+            if (pending != 0) {
+                input.consume(pending);
+                pending = 0;
+            }
+            ends.clear();
+            in_quote = false;
+
+            const char* data;
+            size_t row_end = 0;
+
+            // The row in place, as long as the ring can hold it.
+            size_t scanned = 0, want = 1;
+            for ( ; ; ) {
+                size_t n = input.peek_span(data, want);
+                if (n == 0) { return false; }
+
+                size_t nl = scan(data + scanned, n - scanned, scanned);
+                if (nl != NONE) {
+                    row_end = nl;
+                    pending = nl + 1;
+                    break;
+                }
+                scanned = n;
+                if (n > max_row) {
+                    throw StreamException("row exceeds the maximum size");
+                }
+                if (n < want) { break; }
+                want = n + 1;
+            }
+
+            // Wrapped or at the end of stream: go on in a copy.
+            if (pending == 0) {
+                line.assign(data, data + scanned);
+                input.consume(scanned);
+
+                for ( ; ; ) {
+                    const char* p;
+                    size_t n = input.peek_span(p, 1);
+                    if (n == 0) {
+                        row_end = line.size();
+                        break;
+                    }
+
+                    size_t nl = scan(p, n, line.size());
+                    size_t take = nl != NONE ? nl - line.size() + 1 : n;
+                    line.insert(line.end(), p, p + take);
+                    input.consume(take);
+                    if (nl != NONE) {
+                        row_end = nl;
+                        break;
+                    }
+                    if (line.size() > max_row) {
+                        throw StreamException("row exceeds the maximum size");
+                    }
+                }
+                data = line.data();
+            }
+
+            split(data, row_end, row);
+            return true;
+        }
+
+        Input& stream() {
+            return input;
+        }
+
+    private:
+        static const size_t NONE = (size_t)-1;
+
+        Input input;
+        char delimiter;
+        char quote;
+        size_t max_row;
+        size_t pending;
+
+        bool in_quote;
+        std::vector<size_t> ends;       // offsets of the delimiters of the row
+        std::vector<char> line;         // a row that wrapped around the ring
+        std::vector<char> unquoted;     // fields with doubled quotes
+
+        // Scans the `n` bytes at `p`, which are at `base` in the row.
+        // Records the delimiters, and returns the offset of the newline
+        // that ends the row, or NONE.
+        size_t scan(const char* p, size_t n, size_t base) {
+            _DelimitedMasks m;
+            for (size_t off = 0; off < n; off += 64) {
+                size_t k = n - off;
+                uint64_t valid = ~uint64_t(0);
+                if (k >= 64) {
+                    m.classify(p + off, delimiter, quote);
+                } else {
+                    char tail[64] = {};
+                    std::memcpy(tail, p + off, k);
+                    m.classify(tail, delimiter, quote);
+                    valid = (uint64_t(1) << k) - 1;
+                }
+
+                uint64_t inside = _DelimitedMasks::prefix_xor(m.quote);
+                if (in_quote) { inside = ~inside; }
+                in_quote = (inside & ~(valid >> 1) & valid) != 0;
+
+                uint64_t structural = (m.delim | m.eol) & ~inside & valid;
+                while (structural != 0) {
+                    int i = __builtin_ctzll(structural);
+                    if (m.eol & (uint64_t(1) << i)) {
+                        return base + off + i;
+                    }
+                    ends.push_back(base + off + i);
+                    structural &= structural - 1;
+                }
+            }
+            return NONE;
+        }
+
+        void split(const char* data, size_t row_end, Row& row) {
+            if (row_end > 0 && data[row_end - 1] == '\r') { row_end -= 1; }
+            ends.push_back(row_end);
+
+            if (unquoted.size() < row_end) { unquoted.resize(row_end); }
+            size_t used = 0;
+
+            row.clear();
+            size_t start = 0;
+            for (size_t end : ends) {
+                if (end > row_end) { end = row_end; }
+                Field f = { data + start, end - start };
+
+                if (quote != '\0' && f.size >= 2 &&
+                    f.data[0] == quote && f.data[f.size - 1] == quote)
+                {
+                    f.data += 1;
+                    f.size -= 2;
+                    if (std::memchr(f.data, quote, f.size) != nullptr) {
+                        f = unescape(f, unquoted.data() + used);
+                        used += f.size;
+                    }
+                }
+                row.push_back(f);
+                start = end + 1;
+            }
+        }
+
+        // Copies the field to `out`, with doubled quotes made single.
+        Field unescape(Field f, char* out) const {
+            size_t n = 0;
+            for (size_t i = 0; i < f.size; ++i) {
+                out[n++] = f.data[i];
+                if (f.data[i] == quote && i + 1 < f.size && f.data[i + 1] == quote) {
+                    ++i;
+                }
+            }
+            Field r = { out, n };
+            return r;
+        }
+    };
+
+}
@@ -0,0 +1,461 @@
+#pragma once
+
+/*****************************************************************
+ *
+ * A file read or written around the page cache (O_DIRECT).
+ *
+ *   BufferedWriter<DirectFile> wr(DirectFile("dump.bin", DirectFile::output));
+ *   ...
+ *   BufferedReader<DirectFile> rd(DirectFile("dump.bin", DirectFile::input));
+ *
+ * Bytes are gathered into block-aligned buffers, and up to `depth`
+ * of them are read ahead or written behind at once, each by an I/O
+ * thread of the file.  On close, the unaligned tail of an output file
+ * is written padded to the alignment, and the file is truncated to
+ * its real length.
+ *
+ * Where the file system refuses O_DIRECT, the file is opened
+ * normally, and the pages are dropped from the cache once they have
+ * been read or written (POSIX_FADV_DONTNEED).  Written blocks are
+ * handed to writeback as they go (sync_file_range), without waiting
+ * for them to reach the disk.
+ *
+ * A read error throws StreamException, rather than ending the file
+ * early.  flush() waits for the blocks written behind, and writes the
+ * partial block at the end as well.
+ *
+ *****************************************************************/
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "StreamDefs.h"
+
+namespace Stream {
+
+    class DirectFile {
+    public:
+        enum open_mode { input, output };
+
+        static const size_t ALIGNMENT = 4096;
+
+        DirectFile() {}
+
+        // `block_size` is rounded up to the alignment.
+        DirectFile(const std::string& path, open_mode mode,
+                   size_t block_size = 1 << 20, size_t depth = 4)
+            : state(new State(path, mode, block_size, depth)) {}
+
+        DirectFile(DirectFile&& that) : state(std::move(that.state)) {}
+
+        DirectFile& operator= (DirectFile&& that) {
+            state = std::move(that.state);
+            return *this;
+        }
+
+        DirectFile(const DirectFile&) = delete;
+        DirectFile& operator= (const DirectFile&) = delete;
+
+        ~DirectFile() {
+            if (state) {
+                try { close(); } catch (...) {}
+            }
+        }
+
+        bool empty() const {
+            return !state || state->closed;
+        }
+
+        // Whether the file really bypasses the page cache.
+        bool is_direct() const {
+            return state && state->direct;
+        }
+
+        size_t read(void* data, size_t size) {
+            if (!state) { return 0; }
+            return state->read((char*)data, size);
+        }
+
+        size_t write(const void* data, size_t size) {
+            if (!state) { return 0; }
+            return state->write((const char*)data, size);
+        }
+
+        // Returns once every byte written so far is in the file.
+        // Returns false if a write failed.
+        bool flush() {
+            return state && state->flush();
+        }
+
+        // As flush(), then makes the file durable (fdatasync).
+        bool sync() {
+            return state && state->sync();
+        }
+
+        // Safe to call while another thread is blocked in read(),
+        // which then returns.  The buffers live until destruction.
+        void close() {
+            if (state) {
+                state->close();
+            }
+        }
+
+    private:
+        struct Slot {
+            char* buffer;
+            size_t size;        // bytes held (output) or read (input)
+            size_t pos;         // bytes consumed (input)
+            off_t offset;
+            bool busy;          // queued or in progress in an I/O thread
+            bool last;          // input: the read reached the end
+            int error;
+        };
+
+        struct State {
+            int fd;
+            bool direct;
+            open_mode mode;
+            size_t block_size;
+
+            std::vector<Slot> slots;
+            size_t current;
+            off_t next_offset;
+            bool at_end;
+            int error;
+
+            std::vector<std::thread> threads;
+            std::vector<Slot*> queue;
+            std::mutex mtx;
+            std::condition_variable cnd_queue;
+            std::condition_variable cnd_done;
+            bool is_running;
+            std::atomic<bool> closed;
+
+            // write() and flush() may be called from different threads:
+            // BufferedWriter flushes from the thread calling its flush().
+            std::mutex mtx_out;
+
+            State(const std::string& path, open_mode m, size_t bsize, size_t depth)
+                : fd(-1), direct(false), mode(m), current(0), next_offset(0),
+                  at_end(false), error(0), is_running(true), closed(false)
+            {
+                int flags = (mode == input) ? O_RDONLY : (O_WRONLY | O_CREAT | O_TRUNC);
+
+#if defined(O_DIRECT)
+                fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+                direct = fd >= 0;
+#endif
+                if (fd < 0) {
+                    fd = ::open(path.c_str(), flags, 0644);
+                }
+                if (fd < 0) {
+                    throw StreamException("DirectFile: cannot open " + path);
+                }
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+                direct = ::fcntl(fd, F_NOCACHE, 1) == 0;
+#endif
+
+                block_size = (bsize + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+                if (block_size == 0) { block_size = ALIGNMENT; }
+                if (depth == 0) { depth = 1; }
+
+                slots.resize(depth);
+                for (Slot& s : slots) {
+                    void* p = nullptr;
+                    if (::posix_memalign(&p, ALIGNMENT, block_size) != 0) {
+                        free_buffers();
+                        ::close(fd);
+                        throw std::bad_alloc();
+                    }
+                    s.buffer = (char*)p;
+                    s.size = 0;
+                    s.pos = 0;
+                    s.offset = 0;
+                    s.busy = false;
+                    s.last = false;
+                    s.error = 0;
+                }
+
+                for (size_t i = 0; i < depth; ++i) {
+                    threads.emplace_back([this] { keep_working(); });
+                }
+
+                if (mode == input) {
+                    for (Slot& s : slots) { submit(s); }
+                }
+            }
+
+            ~State() {
+                stop();
+                free_buffers();
+                if (fd >= 0) { ::close(fd); }
+            }
+
+            void stop() {
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    is_running = false;
+                    cnd_queue.notify_all();
+                }
+                for (std::thread& t : threads) {
+                    if (t.joinable()) { t.join(); }
+                }
+            }
+
+            void free_buffers() {
+                for (Slot& s : slots) { std::free(s.buffer); s.buffer = nullptr; }
+            }
+
+            void keep_working() {
+                std::unique_lock<std::mutex> lock(mtx);
+                for ( ; ; ) {
+                    while (is_running && queue.empty()) {
+                        cnd_queue.wait(lock);
+                    }
+                    if (queue.empty()) { break; }
+
+                    Slot* s = queue.front();
+                    queue.erase(queue.begin());
+                    lock.unlock();
+
+                    if (mode == input) {
+                        do_read(*s);
+                    } else {
+                        do_write(*s);
+                    }
+
+                    lock.lock();
+                    s->busy = false;
+                    cnd_done.notify_all();
+                }
+            }
+
+            void do_read(Slot& s) {
+                size_t got = 0;
+                while (got < block_size) {
+                    ssize_t n = ::pread(fd, s.buffer + got, block_size - got, s.offset + got);
+                    if (n < 0 && errno == EINTR) { continue; }
+                    if (n < 0) { s.error = errno; break; }
+                    if (n == 0) { break; }
+                    got += n;
+                    // A short O_DIRECT read only happens at the end.
+                    if (direct && got % ALIGNMENT != 0) { break; }
+                }
+                s.size = got;
+                s.pos = 0;
+                s.last = got < block_size;
+                if (!direct && got > 0) {
+                    ::posix_fadvise(fd, s.offset, got, POSIX_FADV_DONTNEED);
+                }
+            }
+
+            void do_write(Slot& s) {
+                size_t done = 0;
+                while (done < s.size) {
+                    ssize_t n = ::pwrite(fd, s.buffer + done, s.size - done, s.offset + done);
+                    if (n < 0 && errno == EINTR) { continue; }
+                    if (n <= 0) { s.error = n < 0 ? errno : EIO; break; }
+                    done += n;
+                }
+                if (!direct && done > 0) {
+                    drop_written(s.offset, done);
+                }
+            }
+
+            // Starts writeback of the block just written, and drops the
+            // block before it from the cache, once it is on the disk.
+            // Dirty pages cannot be dropped, and syncing each block
+            // would stall the writes.
+            void drop_written(off_t offset, size_t size) {
+#if defined(SYNC_FILE_RANGE_WRITE)
+                ::sync_file_range(fd, offset, size, SYNC_FILE_RANGE_WRITE);
+                if (offset >= (off_t)block_size) {
+                    off_t prev = offset - block_size;
+                    ::sync_file_range(fd, prev, block_size,
+                                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                      SYNC_FILE_RANGE_WAIT_AFTER);
+                    ::posix_fadvise(fd, prev, block_size, POSIX_FADV_DONTNEED);
+                }
+#else
+                ::fdatasync(fd);
+                ::posix_fadvise(fd, offset, size, POSIX_FADV_DONTNEED);
+#endif
+            }
+
+            void submit(Slot& s) {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (closed) { return; }
+                s.offset = next_offset;
+                next_offset += block_size;
+                s.busy = true;
+                queue.push_back(&s);
+                cnd_queue.notify_one();
+            }
+
+            // Waits until the slot is not in flight, and collects its error.
+            void wait(Slot& s) {
+                std::unique_lock<std::mutex> lock(mtx);
+                while (s.busy) {
+                    cnd_done.wait(lock);
+                }
+                if (s.error != 0 && error == 0) { error = s.error; }
+            }
+
+            void raise() const {
+                throw StreamException(std::string("DirectFile: ") + std::strerror(error));
+            }
+
+            // What was read before an error is returned first.
+            size_t read(char* data, size_t size) {
+                size_t total = 0;
+                while (total < size && !at_end && !closed) {
+                    Slot& s = slots[current];
+                    wait(s);
+                    if (error != 0) {
+                        if (total == 0) { raise(); }
+                        break;
+                    }
+
+                    size_t n = std::min(size - total, s.size - s.pos);
+                    std::memcpy(data + total, s.buffer + s.pos, n);
+                    s.pos += n;
+                    total += n;
+
+                    if (s.pos == s.size) {
+                        if (s.last) {
+                            at_end = true;
+                        } else {
+                            submit(s);
+                            current = (current + 1) % slots.size();
+                        }
+                    }
+                }
+                return total;
+            }
+
+            size_t write(const char* data, size_t size) {
+                std::lock_guard<std::mutex> lock(mtx_out);
+                size_t total = 0;
+                while (total < size) {
+                    Slot& s = slots[current];
+                    if (s.busy || s.size == block_size) {
+                        wait(s);
+                        s.size = 0;
+                    }
+                    if (error != 0) { break; }
+
+                    size_t n = std::min(size - total, block_size - s.size);
+                    std::memcpy(s.buffer + s.size, data + total, n);
+                    s.size += n;
+                    total += n;
+
+                    if (s.size == block_size) {
+                        submit(s);
+                        current = (current + 1) % slots.size();
+                    }
+                }
+                return total;
+            }
+
+            bool flush() {
+                if (mode != output) { return true; }
+                std::lock_guard<std::mutex> lock(mtx_out);
+                if (closed) { return error == 0; }
+                for (Slot& s : slots) { wait(s); }
+
+                // The block is written again once it is full.
+                Slot& s = slots[current];
+                if (error == 0 && s.size != 0) { write_partial(s); }
+                return error == 0;
+            }
+
+            bool sync() {
+                if (!flush()) { return false; }
+                std::lock_guard<std::mutex> lock(mtx_out);
+                if (closed) { return false; }
+                for ( ; ; ) {
+#if defined(__linux__)
+                    int res = ::fdatasync(fd);
+#else
+                    int res = ::fsync(fd);
+#endif
+                    if (res == 0) { return true; }
+                    if (errno != EINTR) { return false; }
+                }
+            }
+
+            // Writes the partial block padded to the alignment, and
+            // cuts the padding off the file.
+            void write_partial(Slot& s) {
+                size_t size = s.size;
+                size_t padded = (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+                std::memset(s.buffer + size, 0, padded - size);
+                s.size = padded;
+                s.offset = next_offset;
+                do_write(s);
+                s.size = size;
+                if (s.error != 0) {
+                    error = s.error;
+                } else if (::ftruncate(fd, next_offset + size) != 0) {
+                    error = errno;
+                }
+            }
+
+            void close() {
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    if (closed) { return; }
+                    closed = true;
+                }
+                std::unique_lock<std::mutex> lock_out(mtx_out, std::defer_lock);
+                if (mode == output) { lock_out.lock(); }
+                for (Slot& s : slots) { wait(s); }
+
+                if (mode == output && error == 0) {
+                    Slot& s = slots[current];
+                    if (s.size != 0 && s.size != block_size) { write_partial(s); }
+                }
+
+                stop();
+
+                int fd0 = fd;
+                fd = -1;
+                if (::close(fd0) != 0 && error == 0) {
+                    error = errno;
+                }
+                // A read error has been thrown by read() already, and
+                // an input file loses nothing on close.
+                if (mode == output && error != 0) { raise(); }
+            }
+        };
+
+        std::unique_ptr<State> state;
+    };
+
+    template <>
+    struct Flush<DirectFile> {
+        void operator() (DirectFile& file) const {
+            file.flush();
+        }
+    };
+
+    template <>
+    struct Sync<DirectFile> {
+        bool operator() (DirectFile& file) const {
+            return file.sync();
+        }
+    };
+
+}
@@ -0,0 +1,437 @@
+#pragma once
+
+/*****************************************************************
+ *
+ * Hex and base64, encoded into and decoded out of streams.
+ *
+ *   print(wr, "id=", hex(id, sizeof id), " body=", base64(body));
+ *
+ *   unsigned char id[16];
+ *   if (!read_hex(rd, id, sizeof id)) { ... }
+ *
+ * Into a writer with reserve() / commit(), as a BufferedWriter, the
+ * text is encoded in place in its ring; into others, through a small
+ * buffer on the stack.
+ *
+ * Hex is encoded and decoded 16 bytes at a time with SSE2, base64 12
+ * bytes at a time with SSSE3 where the CPU has it (after Muła and
+ * Lemire), and otherwise a byte (or three) at a time.  Decoding
+ * rejects anything outside the alphabet; base64 may come with or
+ * without padding.
+ *
+ *****************************************************************/
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__)
+#include <tmmintrin.h>
+#endif
+
+#include "StreamDefs.h"
+#include "Print.h"
+
+namespace Stream {
+
+    struct _Hex {
+        static void encode(const unsigned char* src, size_t size, char* dst, bool upper) {
+            const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+            size_t i = 0;
+#if defined(__SSE2__)
+            const __m128i mask = _mm_set1_epi8(0x0f);
+            const __m128i letters = _mm_set1_epi8(upper ? 'A' - '0' - 10 : 'a' - '0' - 10);
+            for ( ; i + 16 <= size; i += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+                __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+                __m128i lo = _mm_and_si128(v, mask);
+                _mm_storeu_si128((__m128i*)(dst + 2 * i), ascii(_mm_unpacklo_epi8(hi, lo), letters));
+                _mm_storeu_si128((__m128i*)(dst + 2 * i + 16), ascii(_mm_unpackhi_epi8(hi, lo), letters));
+            }
+#endif
+            for ( ; i < size; ++i) {
+                dst[2 * i] = digits[src[i] >> 4];
+                dst[2 * i + 1] = digits[src[i] & 15];
+            }
+        }
+
+        // Decodes the 2 * size digits at `src`.
+        static bool decode(const char* src, size_t size, unsigned char* dst) {
+            size_t i = 0;
+#if defined(__SSE2__)
+            for ( ; i + 16 <= size; i += 16) {
+                __m128i a, b;
+                if (!nibbles(_mm_loadu_si128((const __m128i*)(src + 2 * i)), a) ||
+                    !nibbles(_mm_loadu_si128((const __m128i*)(src + 2 * i + 16)), b))
+                {
+                    return false;
+                }
+                _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(join(a), join(b)));
+            }
+#endif
+            for ( ; i < size; ++i) {
+                int hi = value(src[2 * i]);
+                int lo = value(src[2 * i + 1]);
+                if ((hi | lo) < 0) { return false; }
+                dst[i] = (unsigned char)(hi << 4 | lo);
+            }
+            return true;
+        }
+
+        static int value(char c) {
+            if (c >= '0' && c <= '9') { return c - '0'; }
+            if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+            if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+            return -1;
+        }
+
+#if defined(__SSE2__)
+        static __m128i ascii(__m128i x, __m128i letters) {
+            __m128i over9 = _mm_cmpgt_epi8(x, _mm_set1_epi8(9));
+            return _mm_add_epi8(_mm_add_epi8(x, _mm_set1_epi8('0')), _mm_and_si128(over9, letters));
+        }
+
+        // c in [lo, hi]; bytes over 0x7f are negative, so never in.
+        static __m128i in_range(__m128i c, char lo, char hi) {
+            return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(lo - 1)),
+                                 _mm_cmpgt_epi8(_mm_set1_epi8(hi + 1), c));
+        }
+
+        static bool nibbles(__m128i c, __m128i& out) {
+            __m128i digit = in_range(c, '0', '9');
+            __m128i lower = in_range(c, 'a', 'f');
+            __m128i upper = in_range(c, 'A', 'F');
+            out = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                  _mm_or_si128(_mm_and_si128(lower, _mm_sub_epi8(c, _mm_set1_epi8('a' - 10))),
+                               _mm_and_si128(upper, _mm_sub_epi8(c, _mm_set1_epi8('A' - 10)))));
+            __m128i valid = _mm_or_si128(digit, _mm_or_si128(lower, upper));
+            return _mm_movemask_epi8(valid) == 0xffff;
+        }
+
+        // Pairs of nibbles, high first, into the low byte of 16-bit lanes.
+        static __m128i join(__m128i v) {
+            __m128i hi = _mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0x00ff)), 4);
+            return _mm_or_si128(hi, _mm_srli_epi16(v, 8));
+        }
+#endif
+    };
+
+    struct _Base64 {
+        static const size_t NONE = (size_t)-1;
+
+        static size_t encoded_size(size_t size) {
+            return (size + 2) / 3 * 4;
+        }
+
+        static const char* alphabet(bool url) {
+            return url ? "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"
+                       : "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        }
+
+        // Writes encoded_size(size) characters, padded.
+        static void encode(const unsigned char* src, size_t size, char* dst, bool url) {
+            size_t i = 0;
+#if defined(__x86_64__)
+            static const bool simd = __builtin_cpu_supports("ssse3");
+            if (simd) { i = encode_ssse3(src, size, dst, url); }
+#endif
+            const char* abc = alphabet(url);
+            char* out = dst + i / 3 * 4;
+            for ( ; i + 3 <= size; i += 3) {
+                uint32_t v = src[i] << 16 | src[i + 1] << 8 | src[i + 2];
+                *out++ = abc[v >> 18];
+                *out++ = abc[(v >> 12) & 63];
+                *out++ = abc[(v >> 6) & 63];
+                *out++ = abc[v & 63];
+            }
+            if (i < size) {
+                uint32_t v = src[i] << 16 | (i + 1 < size ? src[i + 1] << 8 : 0);
+                *out++ = abc[v >> 18];
+                *out++ = abc[(v >> 12) & 63];
+                *out++ = i + 1 < size ? abc[(v >> 6) & 63] : '=';
+                *out++ = '=';
+            }
+        }
+
+        // Returns the number of bytes decoded, or NONE.
+        static size_t decode(const char* src, size_t size, unsigned char* dst, bool url) {
+            if (size % 4 == 0 && size > 0 && src[size - 1] == '=') {
+                size -= src[size - 2] == '=' ? 2 : 1;
+            }
+            if (size % 4 == 1) { return NONE; }
+
+            size_t i = 0, o = 0;
+#if defined(__x86_64__)
+            static const bool simd = __builtin_cpu_supports("ssse3");
+            if (simd && !decode_ssse3(src, size, dst, url, i, o)) { return NONE; }
+#endif
+            const signed char* table = values(url);
+            for ( ; i + 4 <= size; i += 4) {
+                int a = table[(unsigned char)src[i]], b = table[(unsigned char)src[i + 1]];
+                int c = table[(unsigned char)src[i + 2]], d = table[(unsigned char)src[i + 3]];
+                if ((a | b | c | d) < 0) { return NONE; }
+                uint32_t v = a << 18 | b << 12 | c << 6 | d;
+                dst[o++] = (unsigned char)(v >> 16);
+                dst[o++] = (unsigned char)(v >> 8);
+                dst[o++] = (unsigned char)v;
+            }
+            if (i < size) {
+                int a = table[(unsigned char)src[i]], b = table[(unsigned char)src[i + 1]];
+                int c = i + 2 < size ? table[(unsigned char)src[i + 2]] : 0;
+                if ((a | b | c) < 0) { return NONE; }
+                uint32_t v = a << 18 | b << 12 | c << 6;
+                dst[o++] = (unsigned char)(v >> 16);
+                if (i + 2 < size) { dst[o++] = (unsigned char)(v >> 8); }
+            }
+            return o;
+        }
+
+        struct Values {
+            signed char t[256];
+
+            explicit Values(bool url) {
+                std::memset(t, -1, sizeof t);
+                const char* abc = alphabet(url);
+                for (int i = 0; i < 64; ++i) { t[(unsigned char)abc[i]] = (signed char)i; }
+            }
+        };
+
+        static const signed char* values(bool url) {
+            static const Values std_values(false);
+            static const Values url_values(true);
+            return url ? url_values.t : std_values.t;
+        }
+
+#if defined(__x86_64__)
+        // 12 bytes into 16 characters, reading 16 bytes.  Returns how
+        // many bytes it has encoded, a multiple of 12.
+        __attribute__((target("ssse3")))
+        static size_t encode_ssse3(const unsigned char* src, size_t size, char* dst, bool url) {
+            const __m128i shuffle = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+            const __m128i shift_lut = _mm_setr_epi8(
+                'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                '0' - 52, '0' - 52, '0' - 52, (url ? '-' : '+') - 62, (url ? '_' : '/') - 63, 'A', 0, 0);
+
+            size_t i = 0;
+            for ( ; i + 16 <= size; i += 12, dst += 16) {
+                __m128i in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i)), shuffle);
+
+                // The four 6-bit fields of each 3 bytes, one per byte.
+                __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+                __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+                __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+                __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+                __m128i idx = _mm_or_si128(t1, t3);
+
+                // 0..25 -> 13, 26..51 -> 0, 52..63 -> 1..12: the range,
+                // and the offset of its first character.
+                __m128i range = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+                __m128i below26 = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+                range = _mm_or_si128(range, _mm_and_si128(below26, _mm_set1_epi8(13)));
+                __m128i out = _mm_add_epi8(_mm_shuffle_epi8(shift_lut, range), idx);
+
+                _mm_storeu_si128((__m128i*)dst, out);
+            }
+            return i;
+        }
+
+        static __m128i in_range(__m128i c, char lo, char hi) {
+            return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(lo - 1)),
+                                 _mm_cmpgt_epi8(_mm_set1_epi8(hi + 1), c));
+        }
+
+        // 16 characters into 12 bytes, leaving the last block to the
+        // caller.  Returns false on a character outside the alphabet.
+        __attribute__((target("ssse3")))
+        static bool decode_ssse3(const char* src, size_t size, unsigned char* dst, bool url,
+                                 size_t& i, size_t& o) {
+            const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+            const char c62 = url ? '-' : '+';
+            const char c63 = url ? '_' : '/';
+
+            for ( ; i + 16 < size; i += 16, o += 12) {
+                __m128i c = _mm_loadu_si128((const __m128i*)(src + i));
+
+                __m128i upper = in_range(c, 'A', 'Z');
+                __m128i lower = in_range(c, 'a', 'z');
+                __m128i digit = in_range(c, '0', '9');
+                __m128i is62 = _mm_cmpeq_epi8(c, _mm_set1_epi8(c62));
+                __m128i is63 = _mm_cmpeq_epi8(c, _mm_set1_epi8(c63));
+                __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower),
+                                             _mm_or_si128(digit, _mm_or_si128(is62, is63)));
+                if (_mm_movemask_epi8(valid) != 0xffff) { return false; }
+
+                __m128i v = _mm_or_si128(
+                    _mm_or_si128(_mm_and_si128(upper, _mm_sub_epi8(c, _mm_set1_epi8('A'))),
+                                 _mm_and_si128(lower, _mm_sub_epi8(c, _mm_set1_epi8('a' - 26)))),
+                    _mm_or_si128(_mm_and_si128(digit, _mm_add_epi8(c, _mm_set1_epi8(52 - '0'))),
+                                 _mm_or_si128(_mm_and_si128(is62, _mm_set1_epi8(62)),
+                                              _mm_and_si128(is63, _mm_set1_epi8(63)))));
+
+                // a b c d -> (a << 6 | b) (c << 6 | d) -> 24 bits a lane.
+                __m128i ab_cd = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+                __m128i abcd = _mm_madd_epi16(ab_cd, _mm_set1_epi32(0x00011000));
+                unsigned char out[16];
+                _mm_storeu_si128((__m128i*)out, _mm_shuffle_epi8(abcd, pack));
+                std::memcpy(dst + o, out, 12);
+            }
+            return true;
+        }
+#endif
+    };
+
+    struct _HexOf {
+        const unsigned char* data;
+        size_t size;
+        bool upper;
+    };
+
+    struct _Base64Of {
+        const unsigned char* data;
+        size_t size;
+        bool url;
+    };
+
+    inline _HexOf hex(const void* data, size_t size, bool upper = false) {
+        _HexOf h = { (const unsigned char*)data, size, upper };
+        return h;
+    }
+
+    template <class Bytes>
+    auto hex(const Bytes& bytes, bool upper = false) -> decltype(bytes.data(), bytes.size(), _HexOf()) {
+        return hex(bytes.data(), bytes.size(), upper);
+    }
+
+    inline _Base64Of base64(const void* data, size_t size, bool url = false) {
+        _Base64Of b = { (const unsigned char*)data, size, url };
+        return b;
+    }
+
+    template <class Bytes>
+    auto base64(const Bytes& bytes, bool url = false) -> decltype(bytes.data(), bytes.size(), _Base64Of()) {
+        return base64(bytes.data(), bytes.size(), url);
+    }
+
+    // Room to store into the writer in place, if it has reserve() and
+    // commit(); 0 if not.
+    template <class Writer>
+    auto _reserve(Writer& wr, char*& data, int) -> decltype(wr.reserve(data)) {
+        return wr.reserve(data);
+    }
+
+    template <class Writer>
+    size_t _reserve(Writer&, char*&, long) {
+        return 0;
+    }
+
+    template <class Writer>
+    auto _commit(Writer& wr, size_t size, int) -> decltype(wr.commit(size)) {
+        return wr.commit(size);
+    }
+
+    template <class Writer>
+    void _commit(Writer&, size_t, long) {}
+
+    // Encodes `size` bytes, `IN` at a time into `OUT` characters, in
+    // place where the writer lets it, and through `tmp` otherwise.
+    template <size_t IN, size_t OUT, class Writer, class Encode>
+    void _print_encoded(Writer& wr, const unsigned char* data, size_t size, Encode encode) {
+        char tmp[OUT * 256];
+        while (size > 0) {
+            size_t units = (size + IN - 1) / IN;
+
+            char* span;
+            size_t room = _reserve(wr, span, 0);
+            if (room != 0) {
+                size_t n = std::min(room / OUT, size / IN);
+                if (n != 0) { encode(data, n * IN, span); }
+                _commit(wr, n * OUT, 0);
+                if (n != 0) {
+                    data += n * IN;
+                    size -= n * IN;
+                    continue;
+                }
+                units = 1;      // too little room, or the last unit
+            }
+
+            size_t n = std::min(units, sizeof tmp / OUT);
+            size_t take = std::min(n * IN, size);
+            encode(data, take, tmp);
+            write<Writer>(wr, tmp, (take + IN - 1) / IN * OUT);
+            data += take;
+            size -= take;
+        }
+    }
+
+    template <class Writer>
+    struct Print<Writer, _HexOf> {
+        void operator() (Writer& wr, _HexOf h) const {
+            bool upper = h.upper;
+            _print_encoded<1, 2>(wr, h.data, h.size,
+                [upper](const unsigned char* src, size_t size, char* dst) {
+                    _Hex::encode(src, size, dst, upper);
+                });
+        }
+    };
+
+    template <class Writer>
+    struct Print<Writer, _Base64Of> {
+        void operator() (Writer& wr, _Base64Of b) const {
+            bool url = b.url;
+            _print_encoded<3, 4>(wr, b.data, b.size,
+                [url](const unsigned char* src, size_t size, char* dst) {
+                    _Base64::encode(src, size, dst, url);
+                });
+        }
+    };
+
+    // Decodes the 2 * size hex digits at `src`.  Returns false if one
+    // is not a hex digit.
+    inline bool hex_decode(const char* src, size_t size, void* dst) {
+        return _Hex::decode(src, size, (unsigned char*)dst);
+    }
+
+    // Decodes `size` characters of base64, padded or not, into at most
+    // size / 4 * 3 bytes.  Returns the number of bytes, or (size_t)-1
+    // if the text is not base64.
+    inline size_t base64_decode(const char* src, size_t size, void* dst, bool url = false) {
+        return _Base64::decode(src, size, (unsigned char*)dst, url);
+    }
+
+    // Reads the hex encoding of `size` bytes.  Returns false at the
+    // end of stream or on a character that is not a hex digit.
+    template <class Reader>
+    bool read_hex(Reader& rd, void* dst, size_t size) {
+        unsigned char* out = (unsigned char*)dst;
+        char tmp[4096];
+        while (size > 0) {
+            size_t n = std::min(size, sizeof tmp / 2);
+            if (read<Reader>(rd, tmp, 2 * n) != 2 * n) { return false; }
+            if (!_Hex::decode(tmp, n, out)) { return false; }
+            out += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    // Reads the padded base64 encoding of `size` bytes.
+    template <class Reader>
+    bool read_base64(Reader& rd, void* dst, size_t size, bool url = false) {
+        unsigned char* out = (unsigned char*)dst;
+        char tmp[4096];
+        while (size > 0) {
+            size_t n = std::min(size, sizeof tmp / 4 * 3);
+            size_t chars = _Base64::encoded_size(n);
+            if (read<Reader>(rd, tmp, chars) != chars) { return false; }
+            if (_Base64::decode(tmp, chars, out, url) != n) { return false; }
+            out += n;
+            size -= n;
+        }
+        return true;
+    }
+
+}
@@ -0,0 +1,247 @@
+#pragma once
+
+/*****************************************************************
+ *
+ * Length-prefixed messages.
+ *
+ *   FramedWriter<SocketWriter> wr(SocketWriter(std::move(sock)));
+ *   {
+ *       auto msg = wr.message();
+ *       print(msg, "GET ", path);         // serialized in place
+ *   }                                     // length patched, appended
+ *
+ *   FramedReader<SocketReader> rd(SocketReader(std::move(sock)));
+ *   FramedReader<SocketReader>::Frame frame;
+ *   while (rd.read_frame(frame)) {
+ *       handle(frame.data, frame.size);   // valid until the next frame
+ *   }
+ *
+ * Every message is a uint32_t length, in host order as put/get
+ * store it, followed by that many bytes.
+ *
+ * A frame is handed out as a view into the ring of the underlying
+ * BufferedReader.  It is copied only if it wraps around the end of
+ * the ring or is larger than the ring.  Likewise, a message is built
+ * in the ring of the BufferedWriter, and only moves to the heap if it
+ * outgrows the free space at the end of the ring.
+ *
+ *****************************************************************/
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "StreamDefs.h"
+#include "BufferedReader.h"
+#include "BufferedWriter.h"
+
+namespace Stream {
+
+    template <class Reader, class ReadFunc = Read<Reader> >
+    class FramedReader {
+    public:
+        typedef BufferedReader<Reader, ReadFunc> Input;
+
+        struct Frame {
+            const char* data;
+            size_t size;
+        };
+
+        FramedReader() {}
+
+        // Frames longer than `max_frame` are taken for a corrupt stream.
+        explicit
+        FramedReader(Reader&& file, size_t buffer_size = 0, size_t max_frame = 16 << 20)
+            : input(std::move(file), buffer_size), max_frame(max_frame), pending(0) {}
+
+        explicit
+        FramedReader(const Reader& file, size_t buffer_size = 0, size_t max_frame = 16 << 20)
+            : input(file, buffer_size), max_frame(max_frame), pending(0) {}
+
+        FramedReader(FramedReader&&) = default;
+        FramedReader& operator= (FramedReader&&) = default;
+
+        // Reads the next frame; the previous one is dropped.  Returns
+        // false at the end of stream, and throws on a truncated or
+        // oversized frame.
+        bool read_frame(Frame& frame) {
+            if (pending != 0) {
+                input.consume(pending);
+                pending = 0;
+            }
+
+            uint32_t length;
+            const char* p;
+            size_t n = input.peek_span(p, sizeof length);
+            if (n == 0) { return false; }
+            if (n >= sizeof length) {
+                std::memcpy(&length, p, sizeof length);
+                input.consume(sizeof length);
+            } else if (input.read(&length, sizeof length) != sizeof length) {
+                throw StreamException("truncated frame header");
+            }
+
+            if (length > max_frame) {
+                throw StreamException("frame exceeds the maximum size");
+            }
+
+            // Not peeked at: that would wait for the next frame.
+            if (length == 0) {
+                frame.data = "";
+                frame.size = 0;
+                return true;
+            }
+
+            n = input.peek_span(p, length);
+            if (n >= length) {
+                frame.data = p;
+                frame.size = length;
+                pending = length;
+                return true;
+            }
+
+            spill.resize(length);
+            if (input.read(spill.data(), length) != length) {
+                throw StreamException("truncated frame");
+            }
+            frame.data = spill.data();
+            frame.size = length;
+            return true;
+        }
+
+        Input& stream() {
+            return input;
+        }
+
+    private:
+        Input input;
+        size_t max_frame;
+        size_t pending;
+        std::vector<char> spill;
+    };
+
+    template <class Writer, class WriteFunc = Write<Writer> >
+    class FramedWriter {
+    public:
+        typedef BufferedWriter<Writer, WriteFunc> Output;
+
+        // One message, serialized by writes (e.g. by print).  It is
+        // appended when it is committed or destroyed.  A writer has at
+        // most one message open at a time.
+        class Message {
+        public:
+            explicit Message(Output& o) : out(&o), size(0) {
+                span_size = o.reserve(span);
+                if (span_size < HEADER) {
+                    o.commit(0);
+                    span = nullptr;
+                }
+            }
+
+            Message(Message&& that)
+                : out(that.out), span(that.span), span_size(that.span_size),
+                  size(that.size), spill(std::move(that.spill))
+            {
+                that.out = nullptr;
+            }
+
+            Message(const Message&) = delete;
+            Message& operator= (const Message&) = delete;
+
+            ~Message() {
+                try { commit(); } catch (...) {}
+            }
+
+            size_t write(const void* data, size_t n) {
+                if (span != nullptr && HEADER + size + n <= span_size) {
+                    std::memcpy(span + HEADER + size, data, n);
+                } else {
+                    if (span != nullptr) {
+                        // Outgrew the ring: continue on the heap.
+                        spill.assign(span + HEADER, size);
+                        out->commit(0);
+                        span = nullptr;
+                    }
+                    spill.append((const char*)data, n);
+                }
+                size += n;
+                return n;
+            }
+
+            // Patches the length and appends the message.  Returns
+            // false if it could not be written.
+            bool commit() {
+                if (out == nullptr) { return true; }
+                Output* o = out;
+                out = nullptr;
+
+                if (size > UINT32_MAX) {
+                    if (span != nullptr) { o->commit(0); }
+                    throw StreamException("message exceeds the maximum frame size");
+                }
+                uint32_t length = (uint32_t)size;
+
+                if (span != nullptr) {
+                    std::memcpy(span, &length, HEADER);
+                    o->commit(HEADER + size);
+                    return true;
+                }
+                return o->write(&length, HEADER) == HEADER &&
+                       o->write(spill.data(), size) == size;
+            }
+
+        private:
+            static const size_t HEADER = sizeof(uint32_t);
+
+            Output* out;
+            char* span;
+            size_t span_size;
+            size_t size;
+            std::string spill;
+        };
+
+        FramedWriter() {}
+
+        explicit
+        FramedWriter(Writer&& file, size_t buffer_size = 0, size_t batch_size = 0)
+            : output(std::move(file), buffer_size, batch_size) {}
+
+        explicit
+        FramedWriter(const Writer& file, size_t buffer_size = 0, size_t batch_size = 0)
+            : output(file, buffer_size, batch_size) {}
+
+        FramedWriter(FramedWriter&&) = default;
+        FramedWriter& operator= (FramedWriter&&) = default;
+
+        Message message() {
+            return Message(output);
+        }
+
+        // Appends one message.
+        bool write_frame(const void* data, size_t size) {
+            Message msg(output);
+            msg.write(data, size);
+            return msg.commit();
+        }
+
+        void flush() {
+            output.flush();
+        }
+
+        Output& stream() {
+            return output;
+        }
+
+    private:
+        Output output;
+    };
+
+    template <class Writer, class WriteFunc>
+    struct Flush< FramedWriter<Writer, WriteFunc> > {
+        void operator() (FramedWriter<Writer, WriteFunc>& wr) const {
+            wr.flush();
+        }
+    };
+
+}
@@ -0,0 +1,267 @@
+#pragma once
+
+/*****************************************************************
+ *
+ * Latency distributions, for the tails the counters hide.
+ *
+ *   BufferedWriter<PosixFile, Write<PosixFile>, LatencyStats> log(...);
+ *   ...
+ *   log.stats().flush_latency().value_at(0.999);  // p99.9, in ns
+ *   log.stats().dump(out);
+ *
+ * LatencyHistogram counts nanosecond values in log-linear buckets,
+ * as HdrHistogram does: each power of two is cut into SUB_BUCKETS
+ * equal buckets, so a value is known to within 1/SUB_BUCKETS (6%)
+ * from 1ns up to 2^64ns, in 976 counters.  Recording is a couple of
+ * relaxed atomic adds, so any number of threads may record, and read,
+ * at once without a lock.  Histograms of several streams are summed
+ * with merge().
+ *
+ * dump() writes one line of summary, then a line per non-empty
+ * bucket:
+ *
+ *   flush count=1200 mean=5210 min=890 max=1310720 p50=4096 ...
+ *   flush 4096 4351 310 0.512500
+ *
+ * the name, the lowest and highest value of the bucket, its count,
+ * and the fraction of the values up to its end.  Values are in ns.
+ *
+ *****************************************************************/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "StreamDefs.h"
+#include "StreamStats.h"
+
+namespace Stream {
+
+    class LatencyHistogram {
+    public:
+        static const int SUB_BITS = 4;
+        static const size_t SUB_BUCKETS = size_t(1) << SUB_BITS;
+
+        // Values below 2*SUB_BUCKETS have a bucket each; above, each
+        // power of two 2^k has SUB_BUCKETS, up to k = 63.
+        static const size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+        LatencyHistogram() {
+            clear();
+        }
+
+        LatencyHistogram(const LatencyHistogram&) = delete;
+        LatencyHistogram& operator= (const LatencyHistogram&) = delete;
+
+        void record(uint64_t ns) {
+            buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+            total.fetch_add(1, std::memory_order_relaxed);
+            sum.fetch_add(ns, std::memory_order_relaxed);
+            update_min(lowest, ns);
+            update_max(highest, ns);
+        }
+
+        void record(StatsClock::duration time) {
+            int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+            record(ns > 0 ? (uint64_t)ns : 0);
+        }
+
+        // Adds the values of `that`, which may be recorded into
+        // meanwhile.
+        void merge(const LatencyHistogram& that) {
+            for (size_t i = 0; i < BUCKETS; ++i) {
+                uint64_t n = that.buckets[i].load(std::memory_order_relaxed);
+                if (n != 0) { buckets[i].fetch_add(n, std::memory_order_relaxed); }
+            }
+            total.fetch_add(that.total.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            sum.fetch_add(that.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            update_min(lowest, that.lowest.load(std::memory_order_relaxed));
+            update_max(highest, that.highest.load(std::memory_order_relaxed));
+        }
+
+        // Not atomic as a whole: values recorded meanwhile may be
+        // partly kept.
+        void clear() {
+            for (auto& b : buckets) { b.store(0, std::memory_order_relaxed); }
+            total.store(0, std::memory_order_relaxed);
+            sum.store(0, std::memory_order_relaxed);
+            lowest.store(UINT64_MAX, std::memory_order_relaxed);
+            highest.store(0, std::memory_order_relaxed);
+        }
+
+        uint64_t count() const {
+            return total.load(std::memory_order_relaxed);
+        }
+
+        uint64_t min() const {
+            return count() == 0 ? 0 : lowest.load(std::memory_order_relaxed);
+        }
+
+        uint64_t max() const {
+            return highest.load(std::memory_order_relaxed);
+        }
+
+        uint64_t mean() const {
+            uint64_t n = count();
+            return n == 0 ? 0 : sum.load(std::memory_order_relaxed) / n;
+        }
+
+        // The value that a fraction `q` of the values are at or below,
+        // rounded up to the end of its bucket: value_at(0.999) is the
+        // p99.9.  0 if nothing has been recorded.
+        uint64_t value_at(double q) const {
+            uint64_t counts[BUCKETS];
+            uint64_t n = load(counts);
+            if (n == 0) { return 0; }
+
+            uint64_t rank = q <= 0 ? 1 : (uint64_t)std::ceil(q * n);
+            if (rank == 0) { rank = 1; }
+            if (rank > n) { rank = n; }
+
+            uint64_t seen = 0;
+            for (size_t i = 0; i < BUCKETS; ++i) {
+                seen += counts[i];
+                if (seen >= rank) { return std::min(highest_in(i), max()); }
+            }
+            return max();
+        }
+
+        template <class Writer>
+        void dump(Writer& wr, const char* name) const {
+            uint64_t counts[BUCKETS];
+            uint64_t n = load(counts);
+
+            char line[256];
+            int len = std::snprintf(line, sizeof line,
+                "%s count=%llu mean=%llu min=%llu max=%llu"
+                " p50=%llu p90=%llu p99=%llu p99.9=%llu p99.99=%llu\n",
+                name, ull(n), ull(mean()), ull(min()), ull(max()),
+                ull(value_at(0.5)), ull(value_at(0.9)), ull(value_at(0.99)),
+                ull(value_at(0.999)), ull(value_at(0.9999)));
+            put_line(wr, line, len);
+
+            uint64_t seen = 0;
+            for (size_t i = 0; i < BUCKETS; ++i) {
+                if (counts[i] == 0) { continue; }
+                seen += counts[i];
+                len = std::snprintf(line, sizeof line, "%s %llu %llu %llu %.6f\n",
+                    name, ull(lowest_in(i)), ull(highest_in(i)), ull(counts[i]),
+                    (double)seen / n);
+                put_line(wr, line, len);
+            }
+        }
+
+        static size_t bucket(uint64_t ns) {
+            if (ns < 2 * SUB_BUCKETS) { return (size_t)ns; }
+            int shift = 63 - __builtin_clzll(ns) - SUB_BITS;
+            return (size_t)shift * SUB_BUCKETS + (size_t)(ns >> shift);
+        }
+
+        static uint64_t lowest_in(size_t i) {
+            if (i < 2 * SUB_BUCKETS) { return i; }
+            int shift = (int)(i / SUB_BUCKETS) - 1;
+            return (uint64_t)(i % SUB_BUCKETS + SUB_BUCKETS) << shift;
+        }
+
+        static uint64_t highest_in(size_t i) {
+            if (i < 2 * SUB_BUCKETS) { return i; }
+            int shift = (int)(i / SUB_BUCKETS) - 1;
+            return lowest_in(i) + ((uint64_t(1) << shift) - 1);
+        }
+
+    private:
+        std::atomic<uint64_t> buckets[BUCKETS];
+        std::atomic<uint64_t> total;
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> lowest;
+        std::atomic<uint64_t> highest;
+
+        // Copies the buckets; returns their sum, which may be ahead of
+        // count() while values are being recorded.
+        uint64_t load(uint64_t* counts) const {
+            uint64_t n = 0;
+            for (size_t i = 0; i < BUCKETS; ++i) {
+                counts[i] = buckets[i].load(std::memory_order_relaxed);
+                n += counts[i];
+            }
+            return n;
+        }
+
+        template <class Writer>
+        static void put_line(Writer& wr, const char* line, int len) {
+            if (len <= 0) { return; }
+            if ((size_t)len >= 256) { len = 255; }
+            Stream::write<Writer>(wr, line, (size_t)len);
+        }
+
+        static unsigned long long ull(uint64_t v) {
+            return (unsigned long long)v;
+        }
+
+        static void update_min(std::atomic<uint64_t>& m, uint64_t v) {
+            uint64_t cur = m.load(std::memory_order_relaxed);
+            while (v < cur && !m.compare_exchange_weak(cur, v, std::memory_order_relaxed)) {}
+        }
+
+        static void update_max(std::atomic<uint64_t>& m, uint64_t v) {
+            uint64_t cur = m.load(std::memory_order_relaxed);
+            while (cur < v && !m.compare_exchange_weak(cur, v, std::memory_order_relaxed)) {}
+        }
+    };
+
+    // IoStats, and the distributions of
+    //
+    //   flush_latency()   BufferedWriter::flush(), from the call until
+    //                     the data before it is written out
+    //   io_latency()      each call of readfunc / writefunc
+    //   block_latency()   each wait of the consumer of a BufferedReader
+    //                     for data, or of the producer of a
+    //                     BufferedWriter for room
+    //
+    class LatencyStats : public IoStats {
+    public:
+        void on_syscall(StatsClock::duration time) {
+            IoStats::on_syscall(time);
+            io.record(time);
+        }
+
+        void on_block(StatsClock::duration time) {
+            IoStats::on_block(time);
+            block.record(time);
+        }
+
+        void on_flush(StatsClock::duration time) {
+            IoStats::on_flush(time);
+            flush.record(time);
+        }
+
+        const LatencyHistogram& flush_latency() const { return flush; }
+        const LatencyHistogram& io_latency() const { return io; }
+        const LatencyHistogram& block_latency() const { return block; }
+
+        // Adds the distributions of `that`; the counters of IoStats are
+        // left alone.
+        void merge(const LatencyStats& that) {
+            flush.merge(that.flush);
+            io.merge(that.io);
+            block.merge(that.block);
+        }
+
+        template <class Writer>
+        void dump(Writer& wr) const {
+            flush.dump(wr, "flush");
+            io.dump(wr, "io");
+            block.dump(wr, "block");
+        }
+
+    protected:
+        LatencyHistogram flush;
+        LatencyHistogram io;
+        LatencyHistogram block;
+    };
+
+}
@@ -0,0 +1,275 @@
+#pragma once
+
+/*****************************************************************
+ *
+ * Streams in memory, for formatting without a file.
+ *
+ *   MemoryWriter response;
+ *   print(response, "HTTP/1.1 200 OK\r\nContent-Length: ", len, "\r\n\r\n");
+ *   print(response, hex(digest, 16));
+ *   write(sock, response.data(), response.size());      // one syscall
+ *
+ *   MemoryReader rd(packet, packet_size);
+ *   uint32_t tag = get<uint32_t>(rd);
+ *
+ * BasicMemoryWriter<N> keeps the first N bytes in itself, on the
+ * stack when it is a local, and moves to the heap, doubling, past
+ * that.  Writes only fail by throwing std::bad_alloc.  MemoryWriter
+ * keeps 256 bytes inline.
+ *
+ * Both go through the Write / Read customization points like any
+ * file.  print() of strings, characters and integers and put() / get()
+ * of trivial types have specializations that make room once and store
+ * in place, with no partial-write loop.  The writer has reserve() and
+ * commit(), so the encoders of Encoding.h write straight into it; the
+ * reader has peek_span() and consume(), as BufferedReader has.
+ *
+ *****************************************************************/
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+
+#include "StreamDefs.h"
+#include "Print.h"
+
+namespace Stream {
+
+    template <size_t INLINE>
+    class BasicMemoryWriter {
+    public:
+        BasicMemoryWriter() : ptr(local), len(0), cap(INLINE) {}
+
+        BasicMemoryWriter(BasicMemoryWriter&& that) : ptr(local), len(0), cap(INLINE) {
+            take(that);
+        }
+
+        BasicMemoryWriter& operator= (BasicMemoryWriter&& that) {
+            if (this != &that) {
+                heap.reset();
+                ptr = local;
+                len = 0;
+                cap = INLINE;
+                take(that);
+            }
+            return *this;
+        }
+
+        BasicMemoryWriter(const BasicMemoryWriter&) = delete;
+        BasicMemoryWriter& operator= (const BasicMemoryWriter&) = delete;
+
+        size_t write(const void* data, size_t size) {
+            std::memcpy(room(size), data, size);
+            len += size;
+            return size;
+        }
+
+        // At least `want` bytes to store into, in place; commit() what
+        // was stored.  Returns their number.
+        size_t reserve(char*& data, size_t want = 1) {
+            data = room(want);
+            return cap - len;
+        }
+
+        void commit(size_t size) {
+            len += size;
+        }
+
+        // Room for `size` more bytes, which are not counted until
+        // commit().
+        char* room(size_t size) {
+            if (size > cap - len) { grow(size); }
+            return ptr + len;
+        }
+
+        void close() {}
+
+        const char* data() const { return ptr; }
+        char* data() { return ptr; }
+        size_t size() const { return len; }
+        size_t capacity() const { return cap; }
+        bool empty() const { return len == 0; }
+        bool on_heap() const { return ptr != local; }
+
+        // Keeps the memory.
+        void clear() {
+            len = 0;
+        }
+
+        std::string str() const {
+            return std::string(ptr, len);
+        }
+
+    private:
+        char* ptr;
+        size_t len;
+        size_t cap;
+        std::unique_ptr<char[]> heap;
+        char local[INLINE == 0 ? 1 : INLINE];
+
+        void grow(size_t size) {
+            size_t new_cap = std::max(cap * 2, len + size);
+            std::unique_ptr<char[]> p(new char[new_cap]);
+            std::memcpy(p.get(), ptr, len);
+            heap = std::move(p);
+            ptr = heap.get();
+            cap = new_cap;
+        }
+
+        void take(BasicMemoryWriter& that) {
+            if (that.on_heap()) {
+                heap = std::move(that.heap);
+                ptr = heap.get();
+                cap = that.cap;
+            } else {
+                std::memcpy(local, that.local, that.len);
+            }
+            len = that.len;
+
+            that.ptr = that.local;
+            that.len = 0;
+            that.cap = INLINE;
+        }
+    };
+
+    typedef BasicMemoryWriter<256> MemoryWriter;
+
+    class MemoryReader {
+    public:
+        MemoryReader() : begin(nullptr), cur(nullptr), end(nullptr) {}
+
+        MemoryReader(const void* data, size_t size)
+            : begin((const char*)data), cur(begin), end(begin + size) {}
+
+        size_t read(void* data, size_t size) {
+            size_t n = std::min(size, remaining());
+            std::memcpy(data, cur, n);
+            cur += n;
+            return n;
+        }
+
+        size_t peek_span(const char*& data, size_t /* want */) {
+            data = cur;
+            return remaining();
+        }
+
+        void consume(size_t size) {
+            cur += std::min(size, remaining());
+        }
+
+        void close() {}
+
+        size_t position() const { return cur - begin; }
+        size_t remaining() const { return end - cur; }
+        size_t size() const { return end - begin; }
+        bool at_end() const { return cur == end; }
+
+        void seek(size_t position) {
+            cur = begin + std::min(position, size());
+        }
+
+    private:
+        const char* begin;
+        const char* cur;
+        const char* end;
+    };
+
+    template <size_t N, class Data>
+    struct Put<BasicMemoryWriter<N>, Data> {
+        typename std::enable_if<std::is_trivial<Data>::value>::type
+            operator() (BasicMemoryWriter<N>& wr, const Data& data) const
+        {
+            std::memcpy(wr.room(sizeof(Data)), &data, sizeof(Data));
+            wr.commit(sizeof(Data));
+        }
+    };
+
+    template <class Data>
+    struct Get<MemoryReader, Data> {
+        typename std::enable_if<std::is_trivial<Data>::value, Data>::type
+            operator() (MemoryReader& rd) const
+        {
+            if (rd.remaining() < sizeof(Data)) {
+                throw StreamException("error occured reading stream");
+            }
+            Data result;
+            rd.read(&result, sizeof(Data));
+            return result;
+        }
+    };
+
+    template <size_t N>
+    struct Print<BasicMemoryWriter<N>, const char*> {
+        void operator() (BasicMemoryWriter<N>& wr, const char* str) const {
+            wr.write(str, std::strlen(str));
+        }
+    };
+
+    template <size_t N>
+    struct Print<BasicMemoryWriter<N>, char*> {
+        void operator() (BasicMemoryWriter<N>& wr, char* str) const {
+            wr.write(str, std::strlen(str));
+        }
+    };
+
+    template <size_t N>
+    struct Print<BasicMemoryWriter<N>, std::string> {
+        void operator() (BasicMemoryWriter<N>& wr, const std::string& str) const {
+            wr.write(str.data(), str.size());
+        }
+    };
+
+    template <size_t N>
+    struct Print<BasicMemoryWriter<N>, char> {
+        void operator() (BasicMemoryWriter<N>& wr, char c) const {
+            *wr.room(1) = c;
+            wr.commit(1);
+        }
+    };
+
+    // Formats the digits straight into the writer, counting them
+    // first.
+    template <size_t N, class Int>
+    void _print_integer_in_place(BasicMemoryWriter<N>& wr, Int num) {
+        typedef typename std::make_unsigned<Int>::type Unsigned;
+        bool negative = num < 0;
+        Unsigned n = negative ? Unsigned(0) - Unsigned(num) : Unsigned(num);
+
+        size_t digits = 1;
+        for (Unsigned m = n; m >= 10; m /= 10) { ++digits; }
+
+        size_t size = digits + (negative ? 1 : 0);
+        char* ptr = wr.room(size);
+        if (negative) { *ptr = '-'; }
+        char* p = ptr + size;
+        do {
+            *(--p) = char('0' + n % 10);
+            n /= 10;
+        } while (n != 0);
+        wr.commit(size);
+    }
+
+#pragma push_macro("DECL_PRINT_INT_IN_PLACE")
+#define DECL_PRINT_INT_IN_PLACE(INT) \
+    template <size_t N> \
+    struct Print<BasicMemoryWriter<N>, INT> { \
+        void operator() (BasicMemoryWriter<N>& wr, INT n) const { \
+            _print_integer_in_place(wr, n); \
+        } \
+    }
+
+    DECL_PRINT_INT_IN_PLACE(int);
+    DECL_PRINT_INT_IN_PLACE(unsigned int);
+    DECL_PRINT_INT_IN_PLACE(short);
+    DECL_PRINT_INT_IN_PLACE(unsigned short);
+    DECL_PRINT_INT_IN_PLACE(long);
+    DECL_PRINT_INT_IN_PLACE(unsigned long);
+    DECL_PRINT_INT_IN_PLACE(long long);
+    DECL_PRINT_INT_IN_PLACE(unsigned long long);
+    DECL_PRINT_INT_IN_PLACE(unsigned char);
+
+#pragma pop_macro("DECL_PRINT_INT_IN_PLACE")
+
+}
@@ -0,0 +1,366 @@
+#pragma once
+
+/*****************************************************************
+ *
+ * Line scanning of a large file on many threads.
+ *
+ *   PosixFile file(::open("access.log", O_RDONLY));
+ *
+ *   parallel_lines(file, "\n", [] (const char* line, size_t size) {
+ *       ...                               // any thread, any order
+ *   });
+ *
+ *   size_t errors = parallel_lines_reduce(file, "\n", size_t(0),
+ *       [] (size_t& n, const char* line, size_t size) { n += is_error(line, size); },
+ *       [] (size_t& total, size_t&& n) { total += n; });
+ *
+ * The file is cut into chunks of about `chunk_size` bytes, each moved
+ * forward to the next line start, so that every line lies in exactly
+ * one chunk.  Chunks are dealt out to the threads in contiguous runs,
+ * and a thread that runs out steals from the back of another's run.
+ * The threads are kept from one call to the next.
+ *
+ * The file is mapped if it can be, and otherwise read with pread.
+ * Lines are passed without `eol`, like getline.  The last line of the
+ * file need not end with `eol`.
+ *
+ *****************************************************************/
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "StreamDefs.h"
+#include "PosixFileDesc.h"
+
+namespace Stream {
+
+    class _LineChunks {
+    public:
+        _LineChunks(const PosixFile& file, const char* eol, size_t chunk_size)
+            : fd(file.get()), eol(eol), eol_len(std::strlen(eol)), data(nullptr), size(0)
+        {
+            if (eol_len == 0) {
+                throw StreamException("parallel_lines: empty end of line");
+            }
+
+            struct stat st;
+            if (::fstat(fd, &st) != 0) {
+                throw StreamException("parallel_lines: cannot stat the file");
+            }
+            size = st.st_size;
+
+            if (size != 0) {
+                void* p = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    data = (const char*)p;
+                    ::madvise(p, size, MADV_SEQUENTIAL);
+                }
+            }
+
+            if (chunk_size == 0) { chunk_size = 1; }
+            bounds.push_back(0);
+            for (size_t at = chunk_size; at < size; at += chunk_size) {
+                size_t start = line_start(std::max(at, bounds.back()));
+                if (start >= size) { break; }
+                if (start > bounds.back()) { bounds.push_back(start); }
+                at = std::max(at, start);
+            }
+            bounds.push_back(size);
+        }
+
+        ~_LineChunks() {
+            if (data != nullptr) {
+                ::munmap((void*)data, size);
+            }
+        }
+
+        _LineChunks(const _LineChunks&) = delete;
+        _LineChunks& operator= (const _LineChunks&) = delete;
+
+        size_t count() const {
+            return bounds.size() - 1;
+        }
+
+        // Calls fn(line, size) for every line of chunk `i`.  `scratch`
+        // holds the chunk when the file is not mapped.
+        template <class Func>
+        void scan(size_t i, std::vector<char>& scratch, Func& fn) const {
+            size_t lo = bounds[i], hi = bounds[i + 1];
+            const char* p;
+            if (data != nullptr) {
+                p = data + lo;
+            } else {
+                scratch.resize(hi - lo);
+                pread_all(scratch.data(), hi - lo, lo);
+                p = scratch.data();
+            }
+
+            const char* end = p + (hi - lo);
+            while (p < end) {
+                const char* found = std::search(p, end, eol, eol + eol_len);
+                fn(p, (size_t)(found - p));
+                if (found == end) { break; }
+                p = found + eol_len;
+            }
+        }
+
+    private:
+        int fd;
+        const char* eol;
+        size_t eol_len;
+
+        const char* data;
+        size_t size;
+        std::vector<size_t> bounds;
+
+        // The first line start at or after `at`.
+        size_t line_start(size_t at) const {
+            size_t from = at >= eol_len ? at - eol_len : 0;
+
+            if (data != nullptr) {
+                const char* end = data + size;
+                const char* found = std::search(data + from, end, eol, eol + eol_len);
+                while (found != end && (size_t)(found - data) + eol_len < at) {
+                    found = std::search(found + 1, end, eol, eol + eol_len);
+                }
+                return found == end ? size : (found - data) + eol_len;
+            }
+
+            // Read windows that overlap by the length of `eol`.
+            const size_t WINDOW = 65536;
+            std::vector<char> buf(WINDOW + eol_len);
+            while (from < size) {
+                size_t n = std::min(buf.size(), size - from);
+                pread_all(buf.data(), n, from);
+                const char* begin = buf.data();
+                const char* end = begin + n;
+                const char* found = std::search(begin, end, eol, eol + eol_len);
+                while (found != end && from + (found - begin) + eol_len < at) {
+                    found = std::search(found + 1, end, eol, eol + eol_len);
+                }
+                if (found != end) {
+                    return from + (found - begin) + eol_len;
+                }
+                if (n < buf.size()) { break; }
+                from += WINDOW;
+            }
+            return size;
+        }
+
+        void pread_all(char* buf, size_t n, size_t offset) const {
+            size_t got = 0;
+            while (got < n) {
+                ssize_t res = ::pread(fd, buf + got, n - got, offset + got);
+                if (res < 0 && errno == EINTR) { continue; }
+                if (res <= 0) {
+                    throw StreamException("parallel_lines: error reading the file");
+                }
+                got += res;
+            }
+        }
+    };
+
+    // Threads kept for _work_stealing, so that a call does not start
+    // new ones.  A task never waits for another to finish: a thread is
+    // started when none is idle, so calls may nest.
+    class _WorkerPool {
+    public:
+        static _WorkerPool& instance() {
+            static _WorkerPool pool;
+            return pool;
+        }
+
+        // Runs job(t) for t in [1, n) on pool threads, and job(0) on
+        // the calling one.  Returns once all have returned.
+        void run(size_t n, const std::function<void(size_t)>& job) {
+            Batch batch = { &job, n - 1, {} };
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                for (size_t t = 1; t < n; ++t) {
+                    tasks.push_back(Item(&batch, t));
+                }
+                while (tasks.size() > idle) {
+                    workers.emplace_back([this] { keep_working(); });
+                    idle += 1;
+                }
+                cnd.notify_all();
+            }
+            job(0);
+
+            std::unique_lock<std::mutex> lock(mtx);
+            while (batch.running != 0) {
+                batch.done.wait(lock);
+            }
+        }
+
+        ~_WorkerPool() {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                is_running = false;
+                cnd.notify_all();
+            }
+            for (std::thread& t : workers) { t.join(); }
+        }
+
+    private:
+        struct Batch {
+            const std::function<void(size_t)>* job;
+            size_t running;
+            std::condition_variable done;
+        };
+        typedef std::pair<Batch*, size_t> Item;
+
+        std::mutex mtx;
+        std::condition_variable cnd;
+        std::deque<Item> tasks;
+        std::vector<std::thread> workers;
+        size_t idle;            // workers not running a task
+        bool is_running;
+
+        _WorkerPool() : idle(0), is_running(true) {}
+
+        void keep_working() {
+            std::unique_lock<std::mutex> lock(mtx);
+            for ( ; ; ) {
+                while (is_running && tasks.empty()) {
+                    cnd.wait(lock);
+                }
+                if (tasks.empty()) { break; }
+
+                Item task = tasks.front();
+                tasks.pop_front();
+                idle -= 1;
+                lock.unlock();
+                (*task.first->job)(task.second);
+                lock.lock();
+                // Idle again before the caller can start the next batch.
+                idle += 1;
+                if (--task.first->running == 0) {
+                    task.first->done.notify_all();
+                }
+            }
+        }
+    };
+
+    // Runs work(i) for i in [0, count) on `threads` threads, the
+    // calling one included.  Each thread starts on a contiguous run of
+    // indices and, when done, steals from the back of other runs.
+    template <class Work>
+    void _work_stealing(size_t count, size_t threads, Work work) {
+        if (threads == 0) { threads = std::max(1u, std::thread::hardware_concurrency()); }
+        threads = std::max<size_t>(1, std::min(threads, count));
+
+        struct Queue {
+            std::mutex mtx;
+            std::deque<size_t> items;
+        };
+        std::vector<Queue> queues(threads);
+        for (size_t t = 0; t < threads; ++t) {
+            for (size_t i = count * t / threads; i < count * (t + 1) / threads; ++i) {
+                queues[t].items.push_back(i);
+            }
+        }
+
+        std::atomic<bool> failed(false);
+        std::exception_ptr error;
+        std::mutex mtx_error;
+
+        auto take = [&] (size_t self, size_t& item) {
+            for (size_t k = 0; k < threads; ++k) {
+                Queue& q = queues[(self + k) % threads];
+                std::lock_guard<std::mutex> lock(q.mtx);
+                if (q.items.empty()) { continue; }
+                if (k == 0) {
+                    item = q.items.front();
+                    q.items.pop_front();
+                } else {
+                    item = q.items.back();
+                    q.items.pop_back();
+                }
+                return true;
+            }
+            return false;
+        };
+
+        auto run = [&] (size_t self) {
+            size_t item;
+            while (!failed && take(self, item)) {
+                try {
+                    work(item);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(mtx_error);
+                    if (!error) { error = std::current_exception(); }
+                    failed = true;
+                }
+            }
+        };
+
+        _WorkerPool::instance().run(threads, run);
+
+        if (error) { std::rethrow_exception(error); }
+    }
+
+    // Calls fn(line, size) for every line of `file`, on `threads`
+    // threads (zero: one per core), in no particular order.
+    template <class Func>
+    void parallel_lines(const PosixFile& file, const char* eol, Func fn,
+                        size_t threads = 0, size_t chunk_size = 4 << 20)
+    {
+        _LineChunks chunks(file, eol, chunk_size);
+        _work_stealing(chunks.count(), threads, [&] (size_t i) {
+            thread_local std::vector<char> scratch;
+            chunks.scan(i, scratch, fn);
+        });
+    }
+
+    // The result of one chunk, a cache line away from its neighbours,
+    // which other threads update.  Wrapped, a bool gets an element of
+    // its own (std::vector<bool> packs them into shared words).
+    template <class Result>
+    struct _PaddedResult {
+        Result value;
+        char pad[64];
+
+        explicit _PaddedResult(const Result& r) : value(r) {}
+    };
+
+    // Folds the lines of every chunk into a copy of `init` with
+    // fn(result, line, size), then folds the chunk results in file order
+    // into `init` with reduce(total, std::move(result)).  `init` should
+    // be the identity of `reduce`.
+    template <class Result, class Func, class Reduce>
+    Result parallel_lines_reduce(const PosixFile& file, const char* eol, Result init,
+                          Func fn, Reduce reduce,
+                          size_t threads = 0, size_t chunk_size = 4 << 20)
+    {
+        _LineChunks chunks(file, eol, chunk_size);
+        std::vector< _PaddedResult<Result> > results(chunks.count(), _PaddedResult<Result>(init));
+
+        _work_stealing(chunks.count(), threads, [&] (size_t i) {
+            thread_local std::vector<char> scratch;
+            Result& r = results[i].value;
+            auto each = [&] (const char* line, size_t size) { fn(r, line, size); };
+            chunks.scan(i, scratch, each);
+        });
+
+        for (auto& r : results) {
+            reduce(init, std::move(r.value));
+        }
+        return init;
+    }
+
+}
@@ -0,0 +1,243 @@
+#pragma once
+
+/*****************************************************************
+ *
+ * Filters between a Reader and a Writer, composed at compile time.
+ *
+ *   Crc32c crc;
+ *   auto p = pipe(PosixFile(in))
+ *          | transform([](char* data, size_t size) { to_upper(data, size); })
+ *          | checksum(crc)
+ *          | into(PosixFile(out));
+ *   p.run();
+ *
+ * The source is read a chunk at a time into one buffer, and each
+ * chunk is handed down the filters to the sink.  A filter is any
+ * object with
+ *
+ *   template <class Next>
+ *   bool operator() (char* data, size_t size, Next& next);
+ *
+ * which calls next(data, size) with what it passes on (the chunk,
+ * changed in place, or its own output, in as many calls as it likes)
+ * and returns false to stop the pipe.  `Next` is the type of the rest
+ * of the chain, so the compiler sees, and inlines, the whole chain:
+ * there is no buffer or thread between the stages, and no virtual
+ * call.
+ *
+ * Sources and sinks passed as lvalues are referred to, and rvalues
+ * moved in.  They go through the Read and Write customization points,
+ * so a BufferedReader or BufferedWriter, or a ChecksumWriter, works as
+ * well as a file.
+ *
+ *****************************************************************/
+
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#include "StreamDefs.h"
+
+namespace Stream {
+
+    // Calls `filter` with `next` as the rest of the chain.
+    template <class Filter, class Next>
+    struct _Then {
+        Filter& filter;
+        Next& next;
+
+        _Then(Filter& filter, Next& next) : filter(filter), next(next) {}
+
+        bool operator() (char* data, size_t size) {
+            return filter(data, size, next);
+        }
+    };
+
+    struct _NoFilters {
+        template <class Next>
+        bool push(char* data, size_t size, Next& next) {
+            return next(data, size);
+        }
+    };
+
+    // The filters so far, `init`, and the last one, `filter`.
+    template <class Init, class Filter>
+    struct _Filters {
+        Init init;
+        Filter filter;
+
+        _Filters(Init&& init, Filter&& filter)
+            : init(std::move(init)), filter(std::move(filter)) {}
+
+        template <class Next>
+        bool push(char* data, size_t size, Next& next) {
+            _Then<Filter, Next> rest(filter, next);
+            return init.push(data, size, rest);
+        }
+    };
+
+    template <class Writer>
+    struct _Into {
+        Writer file;
+    };
+
+    template <class Writer>
+    struct _Sink {
+        typedef typename std::decay<Writer>::type File;
+        File& file;
+
+        // Writes all of it, as copy_io does; fails only when a write
+        // returns 0.
+        bool operator() (char* data, size_t size) {
+            while (size > 0) {
+                size_t n = Stream::write<File>(file, data, size);
+                if (n == 0) { return false; }
+                data += n;
+                size -= n;
+            }
+            return true;
+        }
+    };
+
+    template <class Reader, class Filters, class Writer>
+    class Pipeline {
+    public:
+        typedef typename std::decay<Reader>::type Source;
+        typedef typename std::decay<Writer>::type Sink;
+
+        Pipeline(Reader&& source, Filters&& filters, Writer&& sink, size_t chunk_size)
+            : src(std::forward<Reader>(source)), filters(std::move(filters)),
+              dst(std::forward<Writer>(sink)), chunk_size(chunk_size),
+              chunk(new char[chunk_size]) {}
+
+        Pipeline(Pipeline&&) = default;
+
+        // Moves one chunk through.  Returns its size; 0 at the end of
+        // the source, or once a filter or the sink has failed.
+        size_t step() {
+            size_t n = Stream::read<Source>(src, chunk.get(), chunk_size);
+            if (n == 0) { return 0; }
+            _Sink<Writer> sink = { dst };
+            return filters.push(chunk.get(), n, sink) ? n : 0;
+        }
+
+        // Moves everything through, then flushes the sink.  Returns
+        // false if a filter or the sink has failed.
+        bool run() {
+            for ( ; ; ) {
+                size_t n = Stream::read<Source>(src, chunk.get(), chunk_size);
+                if (n == 0) { break; }
+                _Sink<Writer> sink = { dst };
+                if (!filters.push(chunk.get(), n, sink)) { return false; }
+            }
+            Stream::flush<Sink>(dst);
+            return true;
+        }
+
+        Source& source() {
+            return src;
+        }
+
+        Sink& sink() {
+            return dst;
+        }
+
+    private:
+        Reader src;
+        Filters filters;
+        Writer dst;
+        size_t chunk_size;
+        std::unique_ptr<char[]> chunk;
+    };
+
+    template <class Reader, class Filters = _NoFilters>
+    class Pipe {
+    public:
+        Pipe(Reader&& source, Filters&& filters, size_t chunk_size)
+            : src(std::forward<Reader>(source)), filters(std::move(filters)),
+              chunk_size(chunk_size) {}
+
+        template <class Filter>
+        Pipe<Reader, _Filters<Filters, Filter> > operator| (Filter filter) && {
+            return Pipe<Reader, _Filters<Filters, Filter> >(
+                std::forward<Reader>(src),
+                _Filters<Filters, Filter>(std::move(filters), std::move(filter)),
+                chunk_size);
+        }
+
+        template <class Writer>
+        Pipeline<Reader, Filters, Writer> operator| (_Into<Writer>&& sink) && {
+            return Pipeline<Reader, Filters, Writer>(
+                std::forward<Reader>(src), std::move(filters),
+                std::forward<Writer>(sink.file), chunk_size);
+        }
+
+    private:
+        Reader src;
+        Filters filters;
+        size_t chunk_size;
+    };
+
+    template <class Reader>
+    Pipe<Reader> pipe(Reader&& source, size_t chunk_size = 64 << 10) {
+        return Pipe<Reader>(std::forward<Reader>(source), _NoFilters(), chunk_size);
+    }
+
+    template <class Writer>
+    _Into<Writer> into(Writer&& sink) {
+        return _Into<Writer>{ std::forward<Writer>(sink) };
+    }
+
+    // Changes the chunks in place: fn(char* data, size_t size).
+    template <class Func>
+    struct _Transform {
+        Func fn;
+
+        template <class Next>
+        bool operator() (char* data, size_t size, Next& next) {
+            fn(data, size);
+            return next(data, size);
+        }
+    };
+
+    template <class Func>
+    _Transform<Func> transform(Func fn) {
+        return _Transform<Func>{ std::move(fn) };
+    }
+
+    // Looks at the chunks: fn(const char* data, size_t size).
+    template <class Func>
+    struct _Tap {
+        Func fn;
+
+        template <class Next>
+        bool operator() (char* data, size_t size, Next& next) {
+            fn((const char*)data, size);
+            return next(data, size);
+        }
+    };
+
+    template <class Func>
+    _Tap<Func> tap(Func fn) {
+        return _Tap<Func>{ std::move(fn) };
+    }
+
+    // Feeds the chunks to `hash` (see Checksum.h), which the caller
+    // keeps to read the digest from.
+    template <class Hash>
+    struct _HashFilter {
+        Hash& hash;
+
+        template <class Next>
+        bool operator() (char* data, size_t size, Next& next) {
+            hash.update(data, size);
+            return next(data, size);
+        }
+    };
+
+    template <class Hash>
+    _HashFilter<Hash> checksum(Hash& hash) {
+        return _HashFilter<Hash>{ hash };
+    }
+
+}
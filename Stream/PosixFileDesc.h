@@ -9,6 +9,12 @@
 #pragma once
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <cerrno>
+#include <climits>
 
 #include <algorithm>
 #include <utility>
@@ -17,6 +23,8 @@
 
 namespace Stream {
 
+    enum class file_kind { invalid, regular, pipe, socket, character, block, directory, other };
+
     class PosixFile {
     public:
         PosixFile() : id(-1) {}
@@ -65,6 +73,97 @@ namespace Stream {
             return res;
         }
         
+        file_kind kind() const {
+            struct stat st;
+            if (id < 0 || ::fstat(id, &st) != 0) { return file_kind::invalid; }
+
+            if (S_ISREG(st.st_mode))  { return file_kind::regular; }
+            if (S_ISFIFO(st.st_mode)) { return file_kind::pipe; }
+            if (S_ISSOCK(st.st_mode)) { return file_kind::socket; }
+            if (S_ISCHR(st.st_mode))  { return file_kind::character; }
+            if (S_ISBLK(st.st_mode))  { return file_kind::block; }
+            if (S_ISDIR(st.st_mode))  { return file_kind::directory; }
+            return file_kind::other;
+        }
+
+        // Preferred I/O size of the file system (st_blksize).
+        size_t block_size() const {
+            struct stat st;
+            if (id < 0 || ::fstat(id, &st) != 0) { return 0; }
+            return st.st_blksize;
+        }
+
+        // Capacity of a pipe, or zero if unknown.
+        size_t pipe_size() const {
+#if defined(F_GETPIPE_SZ)
+            int size = ::fcntl(id, F_GETPIPE_SZ);
+            if (size > 0) { return size; }
+#endif
+            return 0;
+        }
+
+        // Ring size of a buffered stream over this file, if asked for
+        // (ADVISED_SIZE): a pipe's capacity, or enough blocks of a
+        // regular file to keep the disk streaming.
+        size_t preferred_buffer_size() const {
+            const size_t MIN_FILE = 128 << 10, MAX_FILE = 1 << 20;
+
+            switch (kind()) {
+                case file_kind::regular:
+                case file_kind::block:
+                    return std::min(std::max(block_size(), MIN_FILE), MAX_FILE);
+
+                case file_kind::pipe: {
+                    size_t size = pipe_size();
+                    return size != 0 ? size : 65536;
+                }
+
+                case file_kind::socket:
+                    return 65536;
+
+                default:
+                    return 0;
+            }
+        }
+
+        // Tells the kernel the file is read sequentially from the
+        // current offset on, and starts reading `ahead` bytes.
+        void advise_sequential(size_t ahead) const {
+#if defined(POSIX_FADV_SEQUENTIAL)
+            ::posix_fadvise(id, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#if defined(__linux__)
+            off_t offset = ::lseek(id, 0, SEEK_CUR);
+            if (offset >= 0 && ahead != 0) {
+                ::readahead(id, offset, ahead);
+            }
+#endif
+        }
+        
+        // Writes all of `iov`, unless an error occurs.
+        size_t writev(const iovec* iov, int iovcnt) {
+            size_t total = 0;
+            iovec part;
+            while (iovcnt > 0) {
+                ssize_t res = ::writev(id, iov, std::min(iovcnt, IOV_MAX));
+                if (res <= 0) { break; }
+                total += res;
+
+                size_t n = res;
+                while (iovcnt > 0 && n >= iov->iov_len) {
+                    n -= iov->iov_len; ++iov; --iovcnt;
+                }
+                if (n > 0) {
+                    part.iov_base = (char*)iov->iov_base + n;
+                    part.iov_len  = iov->iov_len - n;
+                    total += write_all(part);
+                    if (part.iov_len != 0) { break; }
+                    ++iov; --iovcnt;
+                }
+            }
+            return total;
+        }
+        
         void close() {
             if (id >= 0) {
                 int ret = ::close(id);
@@ -78,6 +177,85 @@ namespace Stream {
     protected:
         int id;
 
+        // Finishes a partially written iovec.  Returns the bytes
+        // written and leaves what is left in `part`.
+        size_t write_all(iovec& part) {
+            size_t total = 0;
+            while (part.iov_len > 0) {
+                size_t n = write(part.iov_base, part.iov_len);
+                if (n == 0) { break; }
+                part.iov_base = (char*)part.iov_base + n;
+                part.iov_len -= n;
+                total += n;
+            }
+            return total;
+        }
+
+    };
+
+    // Waits until `fd` is ready for `events`, or `cancel_fd` is
+    // readable, or `timeout_ms` (if not negative) has passed.  Returns
+    // false in the latter cases.
+    inline bool _wait_ready(int fd, short events, int cancel_fd, int timeout_ms = -1) {
+        pollfd pfd[2] = { { fd, events, 0 }, { cancel_fd, POLLIN, 0 } };
+        for ( ; ; ) {
+            int n = ::poll(pfd, cancel_fd >= 0 ? 2 : 1, timeout_ms);
+            if (n < 0 && errno == EINTR) { continue; }
+            if (n < 0) { return true; }
+            if (n == 0) { return false; }
+            if (cancel_fd >= 0 && pfd[1].revents != 0) { return false; }
+            return true;
+        }
+    }
+
+    template <>
+    struct ReadWait<PosixFile> {
+        bool operator() (PosixFile& file, int cancel_fd, int timeout_ms = -1) const {
+            return _wait_ready(file.get(), POLLIN, cancel_fd, timeout_ms);
+        }
+    };
+
+    template <>
+    struct WriteWait<PosixFile> {
+        bool operator() (PosixFile& file, int cancel_fd) const {
+            return _wait_ready(file.get(), POLLOUT, cancel_fd);
+        }
+    };
+
+    template <>
+    struct Advise<PosixFile> {
+        size_t operator() (PosixFile& file, bool writing) const {
+            size_t size = file.preferred_buffer_size();
+            if (!writing && file.kind() == file_kind::regular) {
+                file.advise_sequential(2 * size);
+            }
+            return size;
+        }
+    };
+
+    // Pipes, sockets and terminals keep nothing, and have nothing to
+    // sync (EINVAL).
+    template <>
+    struct Sync<PosixFile> {
+        bool operator() (PosixFile& file) const {
+            for ( ; ; ) {
+#if defined(__linux__)
+                int res = ::fdatasync(file.get());
+#else
+                int res = ::fsync(file.get());
+#endif
+                if (res == 0) { return true; }
+                if (errno == EINTR) { continue; }
+                return errno == EINVAL || errno == ENOTSUP;
+            }
+        }
+    };
+
+    template <>
+    struct WriteV<PosixFile> {
+        size_t operator() (PosixFile& wr, const iovec* iov, int iovcnt) const {
+            return wr.writev(iov, iovcnt);
+        }
     };
 
 };
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <new>
+
+namespace Stream {
+
+    /*****************************************************************
+     *
+     * Ring storage of BufferedReader / BufferedWriter.
+     *
+     * Rings are mapped anonymously, so an idle stream can hand its
+     * pages back to the kernel (MADV_DONTNEED) and keep the address
+     * range; the next byte stored in the ring faults a fresh page in.
+     *
+     * Every ring keeps track of how much of it may be resident, and
+     * the sum over all rings is checked against a global budget.
+     * While the budget is exceeded, a stream releases its ring as soon
+     * as the ring drains, instead of waiting for the idle timeout.
+     *
+     *****************************************************************/
+    class RingMemory {
+    public:
+        typedef std::chrono::milliseconds duration;
+
+        static char* allocate(size_t size) {
+            void* p = ::mmap(nullptr, round_up(size), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            return (char*)p;
+        }
+
+        static void deallocate(char* p, size_t size, size_t& resident) {
+            uncharge(resident);
+            ::munmap(p, round_up(size));
+        }
+
+        // Called after the bytes [0, end) of a ring have been stored to.
+        static void touch(size_t& resident, size_t end) {
+            if (end > resident) {
+                size_t r = round_up(end);
+                in_use_counter().fetch_add(r - resident, std::memory_order_relaxed);
+                resident = r;
+            }
+        }
+
+        // Faults in the first `size` bytes of a ring, on the node of
+        // the calling thread.  Nobody else may be using the ring.
+        static void populate(char* p, size_t size, size_t& resident) {
+            size_t end = round_up(size);
+#if defined(MADV_POPULATE_WRITE)
+            if (::madvise(p, end, MADV_POPULATE_WRITE) != 0)
+#endif
+            {
+                for (size_t off = 0; off < end; off += page_size()) {
+                    ((volatile char*)p)[off] = 0;
+                }
+            }
+            touch(resident, end);
+        }
+
+        // Drops the pages of a ring.  The ring must be empty, and
+        // nobody may be copying in or out of it.
+        static void release(char* p, size_t& resident) {
+            if (resident == 0) { return; }
+            ::madvise(p, resident, MADV_DONTNEED);
+            uncharge(resident);
+        }
+
+        // Bytes of ring memory that may currently be resident.
+        static size_t in_use() {
+            return in_use_counter().load(std::memory_order_relaxed);
+        }
+
+        static size_t budget() {
+            return budget_value().load(std::memory_order_relaxed);
+        }
+
+        static void set_budget(size_t bytes) {
+            budget_value().store(bytes, std::memory_order_relaxed);
+        }
+
+        static bool over_budget() {
+            return in_use() > budget();
+        }
+
+        // Default idle timeout of newly created streams.
+        // A negative timeout disables the release.
+        static duration idle_timeout() {
+            return duration(idle_timeout_value().load(std::memory_order_relaxed));
+        }
+
+        static void set_idle_timeout(duration timeout) {
+            idle_timeout_value().store(timeout.count(), std::memory_order_relaxed);
+        }
+
+    private:
+        static size_t page_size() {
+            static const size_t size = ::sysconf(_SC_PAGESIZE);
+            return size;
+        }
+
+        static size_t round_up(size_t n) {
+            size_t pg = page_size();
+            return (n + pg - 1) / pg * pg;
+        }
+
+        static void uncharge(size_t& resident) {
+            in_use_counter().fetch_sub(resident, std::memory_order_relaxed);
+            resident = 0;
+        }
+
+        static std::atomic<size_t>& in_use_counter() {
+            static std::atomic<size_t> counter(0);
+            return counter;
+        }
+
+        static std::atomic<size_t>& budget_value() {
+            static std::atomic<size_t> value(SIZE_MAX);
+            return value;
+        }
+
+        static std::atomic<duration::rep>& idle_timeout_value() {
+            static std::atomic<duration::rep> value(1000);
+            return value;
+        }
+    };
+
+}
@@ -36,6 +36,10 @@ namespace Stream {
             close();
         }
 
+        int get() const {
+            return _sock ? _sock->get() : -1;
+        }
+
         size_t read(void* data, size_t size) {
             return _sock->read(data, size);
         }
@@ -43,4 +47,11 @@ namespace Stream {
     protected:
         std::shared_ptr<PosixFile> _sock;
     };
+
+    template <>
+    struct ReadWait<SocketReader> {
+        bool operator() (SocketReader& file, int cancel_fd, int timeout_ms = -1) const {
+            return file.get() < 0 || _wait_ready(file.get(), POLLIN, cancel_fd, timeout_ms);
+        }
+    };
 }
@@ -2,17 +2,40 @@
 
 #include <memory>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#endif
+
+#include <cerrno>
+#include <cstdint>
 
 #include "PosixFileDesc.h"
 
 namespace Stream {
 
+    // Where the system has no MSG_MORE, the hint is dropped; the BSDs
+    // cork with TCP_NOPUSH.
+#if defined(MSG_MORE)
+    static const int _msg_more = MSG_MORE;
+#else
+    static const int _msg_more = 0;
+#endif
+
+#if defined(TCP_CORK)
+    static const int _tcp_cork = TCP_CORK;
+#elif defined(TCP_NOPUSH)
+    static const int _tcp_cork = TCP_NOPUSH;
+#endif
+
     class SocketWriter {
     public:
         SocketWriter() {}
 
-        SocketWriter(PosixFile&& file) 
+        SocketWriter(PosixFile&& file)
             : _sock(new PosixFile( std::move(file) )) {}
 
         SocketWriter(std::shared_ptr<PosixFile> pfile)
@@ -23,6 +46,10 @@ namespace Stream {
         SocketWriter(SocketWriter&& that) {
             _sock = that._sock;
             that._sock.reset();
+            _cork = that._cork;
+            _zerocopy_threshold = that._zerocopy_threshold;
+            _zc_sent = that._zc_sent;
+            _zc_done = that._zc_done;
         }
 
         void close() {
@@ -36,11 +63,180 @@ namespace Stream {
             close();
         }
 
+        int get() const {
+            return _sock ? _sock->get() : -1;
+        }
+
         size_t write(const void* data, size_t size) {
-            return _sock->write(data, size);
+            return write(data, size, false);
+        }
+
+        // `more` tells that more data follows right away, so the kernel
+        // may wait for it to fill the segment (MSG_MORE).
+        size_t write(const void* data, size_t size, bool more) {
+            int flags = more ? _msg_more : 0;
+
+            if (_zerocopy_threshold != 0 && size >= _zerocopy_threshold) {
+                return write_zerocopy(data, size, flags);
+            }
+            if (flags == 0) {
+                return _sock->write(data, size);
+            }
+
+            ssize_t res = ::send(_sock->get(), data, size, flags);
+            if (res < 0) res = 0;
+            return res;
+        }
+
+        // Pushes out a segment held back by the cork.
+        void flush() {
+            if (_cork) {
+                set_cork_option(false);
+                set_cork_option(true);
+            }
+        }
+
+        // While corked, partial segments are held back until flush().
+        void set_cork(bool on) {
+            _cork = on;
+            set_cork_option(on);
+        }
+
+        // Writes of at least `threshold` bytes are sent without copying
+        // them into the kernel (MSG_ZEROCOPY).  Such a write returns
+        // only after the kernel reports it is done with the data, so it
+        // pays off for large buffers only.  Zero turns it off.
+        // Returns false if the socket does not support it.
+        bool set_zerocopy(size_t threshold) {
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+            int on = threshold != 0;
+            if (::setsockopt(_sock->get(), SOL_SOCKET, SO_ZEROCOPY, &on, sizeof on) != 0) {
+                _zerocopy_threshold = 0;
+                return false;
+            }
+            _zerocopy_threshold = threshold;
+            return true;
+#else
+            _zerocopy_threshold = 0;
+            return threshold == 0;
+#endif
         }
 
     protected:
         std::shared_ptr<PosixFile> _sock;
+
+        bool _cork = false;
+        size_t _zerocopy_threshold = 0;
+
+        // Zero-copy sends are numbered by the kernel from zero;
+        // completions report ranges of these numbers.
+        uint32_t _zc_sent = 0;
+        uint32_t _zc_done = 0;
+
+        void set_cork_option(bool on) {
+#if defined(TCP_CORK) || defined(TCP_NOPUSH)
+            int v = on;
+            ::setsockopt(_sock->get(), IPPROTO_TCP, _tcp_cork, &v, sizeof v);
+#endif
+        }
+
+        size_t write_zerocopy(const void* data, size_t size, int flags) {
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+            ssize_t res = ::send(_sock->get(), data, size, flags | MSG_ZEROCOPY);
+            if (res < 0 && errno == ENOBUFS) {
+                // Out of optmem for pinning pages: copy this one.
+                res = ::send(_sock->get(), data, size, flags);
+                if (res < 0) res = 0;
+                return res;
+            }
+            if (res <= 0) { return 0; }
+
+            _zc_sent += 1;
+            if (!wait_zerocopy()) { return 0; }
+            return res;
+#else
+            ssize_t res = ::send(_sock->get(), data, size, flags);
+            if (res < 0) res = 0;
+            return res;
+#endif
+        }
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+        // Reads completions from the error queue until all zero-copy
+        // sends are done.  Returns false on a socket error.
+        bool wait_zerocopy() {
+            int fd = _sock->get();
+
+            while (_zc_done != _zc_sent) {
+                char control[128];
+                msghdr msg = {};
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof control;
+
+                if (::recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                        pollfd pfd = { fd, 0, 0 };
+                        ::poll(&pfd, 1, -1);
+                        continue;
+                    }
+                    return false;
+                }
+
+                for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+                    if (!(cm->cmsg_level == SOL_IP   && cm->cmsg_type == IP_RECVERR) &&
+                        !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                    {
+                        continue;
+                    }
+
+                    const sock_extended_err* serr = (const sock_extended_err*)CMSG_DATA(cm);
+                    if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                        return false;
+                    }
+
+                    _zc_done = serr->ee_data + 1;
+                    if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                        // The kernel copied anyway (e.g. loopback):
+                        // stop paying for the completions.
+                        _zerocopy_threshold = 0;
+                    }
+                }
+            }
+            return true;
+        }
+#endif
+    };
+
+    template <>
+    struct Write<SocketWriter> {
+        size_t operator() (SocketWriter& wr, const void* data, size_t size) const {
+            return wr.write(data, size);
+        }
+
+        size_t operator() (SocketWriter& wr, const void* data, size_t size, bool more) const {
+            return wr.write(data, size, more);
+        }
+    };
+
+    template <>
+    struct Flush<SocketWriter> {
+        void operator() (SocketWriter& wr) const {
+            wr.flush();
+        }
+    };
+
+    // Nothing to keep, as for a PosixFile socket.
+    template <>
+    struct Sync<SocketWriter> {
+        bool operator() (SocketWriter&) const {
+            return true;
+        }
+    };
+
+    template <>
+    struct WriteWait<SocketWriter> {
+        bool operator() (SocketWriter& file, int cancel_fd) const {
+            return file.get() < 0 || _wait_ready(file.get(), POLLOUT, cancel_fd);
+        }
     };
 }
@@ -12,6 +12,8 @@
 #include <utility>
 #include <type_traits>
 
+#include <sys/uio.h>
+
 #include "StreamExcept.h"
 
 namespace Stream {
@@ -23,6 +25,21 @@ namespace Stream {
         }
     };
     
+    // Gathered write, as writev(2).  Returns the number of bytes
+    // written, which is short only on error.
+    template <class Writer>
+    struct WriteV {
+        size_t operator() (Writer& wr, const iovec* iov, int iovcnt) const {
+            size_t total = 0;
+            for (int i = 0; i < iovcnt; ++i) {
+                size_t n = Write<Writer>()(wr, iov[i].iov_base, iov[i].iov_len);
+                total += n;
+                if (n != iov[i].iov_len) { break; }
+            }
+            return total;
+        }
+    };
+    
     template <class Reader>
     struct Read {
         size_t operator() (Reader& rd, void* data, size_t size) const {
@@ -37,6 +54,93 @@ namespace Stream {
         }
     };
     
+    // Tells a file that a message boundary has been reached, and what
+    // was written so far should go out now.  Most files have nothing
+    // to do for it.
+    template <class File>
+    struct Flush {
+        void operator() (File&) const {}
+    };
+
+    // Makes what was written to `file` durable, as fdatasync(2), and
+    // returns false if that failed.  A file that does not specialize
+    // it cannot tell, and fails.
+    template <class File>
+    struct Sync {
+        bool operator() (File&) const {
+            return false;
+        }
+    };
+    
+    // Tells a file that it is about to be read (or written)
+    // sequentially through a ring buffer, and returns the ring size that
+    // suits it, or zero if it has no preference.  That size is used only
+    // if the stream is asked for it (ADVISED_SIZE).
+    template <class File>
+    struct Advise {
+        size_t operator() (File&, bool /* writing */) const {
+            return 0;
+        }
+    };
+    
+    // The defaults of ReadWait and WriteWait derive from it: files
+    // without a specialization cannot be waited on.
+    struct _NoWait {};
+
+    // Waits until `file` can be read (or written) without blocking, or
+    // until `cancel_fd` becomes readable, in which case it returns
+    // false.  Files that cannot be waited on are always ready.
+    //
+    // A ReadWait may also take a timeout in milliseconds, negative for
+    // none, and return false once it has passed; one that does not is
+    // waited on without.
+    template <class File>
+    struct ReadWait : _NoWait {
+        bool operator() (File&, int /* cancel_fd */, int /* timeout_ms */ = -1) const {
+            return true;
+        }
+    };
+
+    template <class File>
+    struct WriteWait : _NoWait {
+        bool operator() (File&, int /* cancel_fd */) const {
+            return true;
+        }
+    };
+
+    // As the buffer_size of a buffered stream, has the file choose the
+    // ring size (see Advise).  Such rings can be much larger than the
+    // default of 4096 bytes: a pipe's capacity, 64K for a socket, up to
+    // 1M for a regular file.
+    static const size_t ADVISED_SIZE = (size_t)-1;
+
+    // Ring size of a buffered stream over `file`: `buffer_size`, 4096 if
+    // that is zero, or the size the file advises if it is ADVISED_SIZE.
+    // The file is advised in any case.
+    template <class File>
+    size_t _ring_size(File& file, size_t buffer_size, bool writing) {
+        size_t advised = Advise<File>()(file, writing);
+        if (buffer_size == ADVISED_SIZE) {
+            return advised != 0 ? advised : 4096;
+        }
+        return buffer_size != 0 ? buffer_size : 4096;
+    }
+    
+    // Calls `func(wr, data, size, more)` if the write functor accepts
+    // the hint that more data follows right away, and
+    // `func(wr, data, size)` otherwise.
+    template <class WriteFunc, class Writer>
+    auto _write_hinted(WriteFunc& func, Writer& wr, const void* data, size_t size, bool more, int)
+        -> decltype(func(wr, data, size, more))
+    {
+        return func(wr, data, size, more);
+    }
+
+    template <class WriteFunc, class Writer>
+    size_t _write_hinted(WriteFunc& func, Writer& wr, const void* data, size_t size, bool, long) {
+        return func(wr, data, size);
+    }
+    
     template <class Writer>
     size_t write(Writer& wr, const void* data, size_t size) {
         return Write<Writer>()(wr, data, size);
@@ -52,6 +156,42 @@ namespace Stream {
         Close<File>()(file);
     }
     
+    template <class File>
+    void flush(File& file) {
+        Flush<File>()(file);
+    }
+
+    template <class File>
+    bool sync(File& file) {
+        return Sync<File>()(file);
+    }
+
+    template <class Wait, class File>
+    auto _wait_timed(const Wait& wait, File& file, int cancel_fd, int timeout_ms, int)
+        -> decltype(wait(file, cancel_fd, timeout_ms))
+    {
+        return wait(file, cancel_fd, timeout_ms);
+    }
+
+    template <class Wait, class File>
+    bool _wait_timed(const Wait& wait, File& file, int cancel_fd, int, long) {
+        return wait(file, cancel_fd);
+    }
+
+    template <class File>
+    bool read_wait(File& file, int cancel_fd, int timeout_ms = -1) {
+        return _wait_timed(ReadWait<File>(), file, cancel_fd, timeout_ms, 0);
+    }
+
+    template <class File>
+    bool write_wait(File& file, int cancel_fd) {
+        return WriteWait<File>()(file, cancel_fd);
+    }
+
+    template <class File>
+    struct _CanReadWait
+        : std::integral_constant<bool, !std::is_base_of<_NoWait, ReadWait<File> >::value> {};
+    
     template <class Writer, class Data>
     struct Put {
         typename std::enable_if<std::is_trivial<Data>::value>::type
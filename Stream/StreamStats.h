@@ -0,0 +1,148 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace Stream {
+
+    /*****************************************************************
+     *
+     * Statistics policies of BufferedReader / BufferedWriter.
+     *
+     *   BufferedWriter<PosixFile, Write<PosixFile>, IoStats> wr(...);
+     *   ...
+     *   IoStats::Snapshot s = wr.stats().snapshot();
+     *
+     * A policy is notified of
+     *
+     *   on_io(size)      every call of readfunc/writefunc, with the
+     *                    number of bytes it moved
+     *   on_syscall(time) how long that call took
+     *   on_fill(size)    the fill level of the ring after it grew
+     *   on_block(time)   time the consumer (reader) or the producer
+     *                    (writer) spent waiting for the ring
+     *   on_flush(time)   latency of a BufferedWriter::flush()
+     *
+     * The streams only read the clock when `enabled` is true, so with
+     * NoStats (the default) everything is compiled out.
+     *
+     * LatencyStats (LatencyHistogram.h) also keeps the distributions
+     * of the times, for the tail latencies.
+     *
+     *****************************************************************/
+
+    typedef std::chrono::steady_clock StatsClock;
+
+    struct NoStats {
+        static const bool enabled = false;
+
+        struct Snapshot {};
+
+        void on_io(size_t) {}
+        void on_syscall(StatsClock::duration) {}
+        void on_fill(size_t) {}
+        void on_block(StatsClock::duration) {}
+        void on_flush(StatsClock::duration) {}
+
+        Snapshot snapshot() const { return Snapshot(); }
+    };
+
+    class IoStats {
+    public:
+        static const bool enabled = true;
+
+        // syscall_sizes[0] counts calls that moved nothing,
+        // syscall_sizes[k] calls that moved [2^(k-1), 2^k) bytes.
+        static const size_t SIZE_BUCKETS = 32;
+
+        struct Snapshot {
+            uint64_t bytes;
+            uint64_t syscalls;
+            uint64_t syscall_sizes[SIZE_BUCKETS];
+            uint64_t syscall_ns;
+            uint64_t fill_high_water;
+            uint64_t blocked_ns;
+            uint64_t flushes;
+            uint64_t flush_ns;
+            uint64_t flush_max_ns;
+        };
+
+        IoStats() {
+            bytes = 0; syscalls = 0; syscall_ns = 0; fill_high_water = 0;
+            blocked_ns = 0; flushes = 0; flush_ns = 0; flush_max_ns = 0;
+            for (auto& b : syscall_sizes) { b = 0; }
+        }
+
+        void on_io(size_t size) {
+            bytes.fetch_add(size, std::memory_order_relaxed);
+            syscalls.fetch_add(1, std::memory_order_relaxed);
+            syscall_sizes[size_bucket(size)].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void on_syscall(StatsClock::duration time) {
+            syscall_ns.fetch_add(to_ns(time), std::memory_order_relaxed);
+        }
+
+        void on_fill(size_t size) {
+            update_max(fill_high_water, size);
+        }
+
+        void on_block(StatsClock::duration time) {
+            blocked_ns.fetch_add(to_ns(time), std::memory_order_relaxed);
+        }
+
+        void on_flush(StatsClock::duration time) {
+            uint64_t ns = to_ns(time);
+            flushes.fetch_add(1, std::memory_order_relaxed);
+            flush_ns.fetch_add(ns, std::memory_order_relaxed);
+            update_max(flush_max_ns, ns);
+        }
+
+        // Counters are read one by one, so a snapshot taken while the
+        // stream is busy need not be consistent across fields.
+        Snapshot snapshot() const {
+            Snapshot s;
+            s.bytes           = bytes.load(std::memory_order_relaxed);
+            s.syscalls        = syscalls.load(std::memory_order_relaxed);
+            s.syscall_ns      = syscall_ns.load(std::memory_order_relaxed);
+            s.fill_high_water = fill_high_water.load(std::memory_order_relaxed);
+            s.blocked_ns      = blocked_ns.load(std::memory_order_relaxed);
+            s.flushes         = flushes.load(std::memory_order_relaxed);
+            s.flush_ns        = flush_ns.load(std::memory_order_relaxed);
+            s.flush_max_ns    = flush_max_ns.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < SIZE_BUCKETS; ++i) {
+                s.syscall_sizes[i] = syscall_sizes[i].load(std::memory_order_relaxed);
+            }
+            return s;
+        }
+
+        static size_t size_bucket(size_t size) {
+            size_t k = 0;
+            while (size != 0 && k < SIZE_BUCKETS-1) { size >>= 1; ++k; }
+            return k;
+        }
+
+    protected:
+        std::atomic<uint64_t> bytes;
+        std::atomic<uint64_t> syscalls;
+        std::atomic<uint64_t> syscall_sizes[SIZE_BUCKETS];
+        std::atomic<uint64_t> syscall_ns;
+        std::atomic<uint64_t> fill_high_water;
+        std::atomic<uint64_t> blocked_ns;
+        std::atomic<uint64_t> flushes;
+        std::atomic<uint64_t> flush_ns;
+        std::atomic<uint64_t> flush_max_ns;
+
+        static uint64_t to_ns(StatsClock::duration time) {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+        }
+
+        static void update_max(std::atomic<uint64_t>& m, uint64_t v) {
+            uint64_t cur = m.load(std::memory_order_relaxed);
+            while (cur < v && !m.compare_exchange_weak(cur, v, std::memory_order_relaxed)) {}
+        }
+    };
+
+}
@@ -15,15 +15,18 @@ namespace Stream {
     
     template <class Reader, class Writer>
     void copy_io(Reader& rd, Writer &wr, size_t bufsize = 4096) {
-        std::unique_ptr<char[]> buf(bufsize);
+        std::unique_ptr<char[]> buf(new char[bufsize]);
 
         for ( ; ; ) {
-            size_t sr = Stream::read<Reader>(rd, buf, bufsize);
+            size_t sr = Stream::read<Reader>(rd, buf.get(), bufsize);
             if (sr == 0) { break; }
             
             char* ptr = buf.get();
             while (sr > 0) {
-                size_t sw = Stream::write<Writer>(wr, ptr, size);
+                size_t sw = Stream::write<Writer>(wr, ptr, sr);
+                if (sw == 0) {
+                    throw StreamException("error occured writing stream");
+                }
                 sr -= sw; ptr += sw;
             }
         }
@@ -0,0 +1,426 @@
+#pragma once
+
+/*****************************************************************
+ *
+ * One stream written to many sinks.
+ *
+ *   TeeWriter tee(1 << 20, TeeWriter::DROP);
+ *   tee.add(PosixFile(log_fd));
+ *   tee.add(SocketWriter(std::move(mirror)));
+ *   tee.add(child.input());
+ *
+ *   print(tee, record);               // copied once
+ *   tee.flush();                      // every sink has it
+ *
+ * The data is copied once into a ring shared by all the sinks.  Each
+ * sink has a thread of its own, which writes the ring out from its
+ * own cursor, so a slow sink does not hold up the others until the
+ * ring is full.  Space is reclaimed as the slowest sink advances.
+ *
+ * When the ring is full, what happens to the slowest sinks is up to
+ * the laggard policy, applied after waiting `patience` for them:
+ *
+ *   BLOCK        writes wait, as for a single BufferedWriter;
+ *   DROP         the laggard finishes the write it is in the middle
+ *                of, skips the rest of its backlog and goes on with
+ *                the writes after, counting what it has missed;
+ *   DISCONNECT   the laggard is closed and left out from then on.
+ *
+ * Either way, a write already handed to a sink holds its part of the
+ * ring until it returns; a sink disconnected while waiting for its
+ * file to become writable (see WriteWait) is woken up.
+ *
+ * Sinks may be added at any time, and get the data written after.
+ * A write waits for room for all of it and goes into the ring at
+ * once, so writes from several threads are serialized, and a sink
+ * gets each whole or not at all.  A write larger than the ring is
+ * copied in pieces, and a laggard is not dropped in the middle of it.
+ *
+ *****************************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "StreamDefs.h"
+#include "RingMemory.h"
+#include "Cancellation.h"
+
+namespace Stream {
+
+    struct _TeeSink {
+        uint64_t cursor;        // the next byte to write out
+        uint64_t flushed;       // written and flushed up to here
+        uint64_t dropped;
+        bool connected;
+        bool writing;           // a write is in flight from `cursor`
+        bool skip;              // drop the backlog, from a write boundary on
+        uint64_t skip_to;       // up to here
+        CancellationToken cancel;
+        std::thread thread;
+
+        virtual ~_TeeSink() {}
+        virtual size_t write(const char* data, size_t size) = 0;
+        virtual void flush() = 0;
+        virtual void close() = 0;
+    };
+
+    template <class Writer, class WriteFunc>
+    struct _TeeSinkOf : _TeeSink {
+        Writer file;
+        WriteFunc writefunc;
+
+        explicit _TeeSinkOf(Writer&& file) : file(std::move(file)) {}
+
+        size_t write(const char* data, size_t size) {
+            if (cancel.is_watched() &&
+                !Stream::write_wait<Writer>(file, cancel.fd())) { return 0; }
+            return writefunc(file, data, size);
+        }
+
+        void flush() {
+            Stream::flush<Writer>(file);
+        }
+
+        void close() {
+            Stream::close<Writer>(file);
+        }
+    };
+
+    class TeeWriter {
+    public:
+        enum Laggard { BLOCK, DROP, DISCONNECT };
+
+        typedef std::chrono::milliseconds duration;
+
+        TeeWriter() {}
+
+        explicit
+        TeeWriter(size_t buffer_size, Laggard laggard = BLOCK, duration patience = duration(0))
+            : body(new Body())
+        {
+            body->buffer = RingMemory::allocate(buffer_size);
+            body->buffer_size = buffer_size;
+            body->resident = 0;
+            body->tail = 0;
+            body->whole = 0;
+            body->flush_req = 0;
+            body->laggard = laggard;
+            body->patience = patience;
+            body->is_running = true;
+        }
+
+        TeeWriter(TeeWriter&& that) {
+            body = std::move(that.body);
+        }
+
+        TeeWriter& operator= (TeeWriter&& that) {
+            body = std::move(that.body);
+            return *this;
+        }
+
+        // Waits for the sinks to write out the ring, unless they have
+        // been disconnected.
+        ~TeeWriter() {
+            if (body == nullptr) { return; }
+
+            close();
+            for (auto& s : body->sinks) { s->thread.join(); }
+
+            RingMemory::deallocate(body->buffer, body->buffer_size, body->resident);
+        }
+
+        TeeWriter(const TeeWriter&) = delete;
+        TeeWriter& operator= (const TeeWriter&) = delete;
+
+        // Adds a sink, which gets everything written from now on.
+        // Returns its index.
+        template <class Writer, class WriteFunc = Write<Writer> >
+        size_t add(Writer file) {
+            _TeeSink* s = new _TeeSinkOf<Writer, WriteFunc>(std::move(file));
+
+            std::lock_guard<std::mutex> lock(body->mtx);
+            s->cursor = s->flushed = body->tail;
+            s->dropped = 0;
+            s->connected = true;
+            s->writing = false;
+            s->skip = false;
+            s->skip_to = 0;
+            // Only a sink that may be disconnected waits on its token.
+            if (body->laggard == DISCONNECT) { s->cancel.fd(); }
+            body->sinks.emplace_back(s);
+
+            Body* pbody = body.get();
+            s->thread = std::thread(
+                [ pbody, s ] { pbody->keep_sending(s); }
+            );
+            return body->sinks.size() - 1;
+        }
+
+        // Returns 0 once no sink is connected.
+        size_t write(const void* data, size_t size) {
+            return body->write((const char*)data, size);
+        }
+
+        // Waits until every connected sink has written and flushed what
+        // was written before.  Returns false if none is connected.
+        bool flush() {
+            return body->flush();
+        }
+
+        // Lets the sinks finish what is in the ring; writes fail from
+        // now on.
+        void close() {
+            std::lock_guard<std::mutex> lock(body->mtx);
+            body->is_running = false;
+            body->cnd_data.notify_all();
+            body->cnd_space.notify_all();
+        }
+
+        size_t sinks() const {
+            std::lock_guard<std::mutex> lock(body->mtx);
+            return body->sinks.size();
+        }
+
+        bool connected(size_t sink) const {
+            std::lock_guard<std::mutex> lock(body->mtx);
+            return body->sinks[sink]->connected;
+        }
+
+        // Bytes the sink has missed under the DROP policy.
+        uint64_t dropped(size_t sink) const {
+            std::lock_guard<std::mutex> lock(body->mtx);
+            return body->sinks[sink]->dropped;
+        }
+
+    private:
+        struct Body {
+            typedef std::chrono::steady_clock Clock;
+
+            char* buffer;
+            size_t buffer_size;
+            size_t resident;
+
+            uint64_t tail;              // bytes written so far
+            uint64_t whole;             // the writes up to here are complete
+            std::deque<uint64_t> bounds;    // where the writes in the ring begin
+            uint64_t flush_req;
+            Laggard laggard;
+            duration patience;
+            bool is_running;
+
+            std::vector<std::unique_ptr<_TeeSink> > sinks;
+
+            std::mutex mtx;
+            std::condition_variable cnd_data;       // sinks wait
+            std::condition_variable cnd_space;      // writers and flushers wait
+
+            // Everything before is written out, or dropped, and may
+            // be reused.
+            uint64_t reclaimed() const {
+                uint64_t low = tail;
+                for (auto& s : sinks) {
+                    if (s->connected || s->writing) { low = std::min(low, s->cursor); }
+                }
+                return low;
+            }
+
+            bool any_connected() const {
+                for (auto& s : sinks) {
+                    if (s->connected) { return true; }
+                }
+                return false;
+            }
+
+            bool wants_flush(const _TeeSink* s) const {
+                return s->flushed < flush_req && s->cursor >= flush_req;
+            }
+
+            size_t write(const char* data, size_t size) {
+                std::unique_lock<std::mutex> lock(mtx);
+                Clock::time_point full_since;
+                bool full = false;
+
+                // Room for the whole write, unless it is larger than the
+                // ring.
+                size_t want = size <= buffer_size ? size : 1;
+                for ( ; ; ) {
+                    if (!is_running || !any_connected()) { return 0; }
+                    if (buffer_size - (size_t)(tail - reclaimed()) >= want) { break; }
+                    if (!full) {
+                        full = true;
+                        full_since = Clock::now();
+                    }
+                    make_room(lock, full_since);
+                }
+
+                uint64_t low = reclaimed();
+                while (!bounds.empty() && bounds.front() < low) { bounds.pop_front(); }
+                bounds.push_back(tail);
+
+                size_t left = size;
+                while (left > 0) {
+                    if (!is_running || !any_connected()) { return 0; }
+
+                    size_t room = buffer_size - (size_t)(tail - reclaimed());
+                    if (room == 0) {
+                        if (!full) {
+                            full = true;
+                            full_since = Clock::now();
+                        }
+                        make_room(lock, full_since);
+                        continue;
+                    }
+                    full = false;
+
+                    size_t off = tail % buffer_size;
+                    size_t n = std::min(std::min(left, room), buffer_size - off);
+                    std::memcpy(buffer + off, data, n);
+                    RingMemory::touch(resident, off + n);
+                    tail += n;
+                    data += n;
+                    left -= n;
+                    cnd_data.notify_all();
+                }
+                whole = tail;
+                return size;
+            }
+
+            // The ring is full: waits for the slowest sinks, and applies
+            // the laggard policy once they have had their patience.
+            void make_room(std::unique_lock<std::mutex>& lock, Clock::time_point since) {
+                if (laggard == BLOCK) {
+                    cnd_space.wait(lock);
+                    return;
+                }
+                Clock::time_point deadline = since + patience;
+                if (Clock::now() < deadline) {
+                    cnd_space.wait_until(lock, deadline);
+                    return;
+                }
+
+                uint64_t low = reclaimed();
+                for (auto& s : sinks) {
+                    if (!s->connected || s->cursor != low) { continue; }
+                    if (laggard == DISCONNECT) {
+                        s->connected = false;
+                        s->cancel.cancel();
+                    } else {
+                        s->skip = true;
+                        s->skip_to = whole;
+                        if (!s->writing) { skip_ahead(s.get()); }
+                    }
+                }
+                cnd_data.notify_all();
+                cnd_space.notify_all();
+                if (reclaimed() == low) { cnd_space.wait(lock); }
+            }
+
+            // Drops the backlog of a laggard, if its cursor is at the
+            // start of a write, or past the backlog.  Returns false if
+            // it is in the middle of a write.
+            bool skip_ahead(_TeeSink* s) {
+                if (s->cursor < s->skip_to) {
+                    if (!std::binary_search(bounds.begin(), bounds.end(), s->cursor)) { return false; }
+                    s->dropped += s->skip_to - s->cursor;
+                    s->cursor = s->skip_to;
+                }
+                s->skip = false;
+                cnd_space.notify_all();
+                return true;
+            }
+
+            // Where the write that `cursor` is in the middle of ends.
+            uint64_t end_of_write(uint64_t cursor) const {
+                auto it = std::upper_bound(bounds.begin(), bounds.end(), cursor);
+                return it != bounds.end() ? *it : whole;
+            }
+
+            bool flush() {
+                std::unique_lock<std::mutex> lock(mtx);
+                uint64_t req = tail;
+                if (req > flush_req) { flush_req = req; }
+                cnd_data.notify_all();
+
+                cnd_space.wait(lock, [this, req] {
+                    for (auto& s : sinks) {
+                        if (s->connected && s->flushed < req) { return false; }
+                    }
+                    return true;
+                });
+                return any_connected();
+            }
+
+            void keep_sending(_TeeSink* s) {
+                // A segment at a time, so a laggard dropped while writing
+                // holds up little of the ring.
+                const size_t max_segment = std::max<size_t>(buffer_size / 4, 1);
+
+                std::unique_lock<std::mutex> lock(mtx);
+                for ( ; ; ) {
+                    cnd_data.wait(lock, [this, s] {
+                        return !s->connected || s->cursor != tail || !is_running || wants_flush(s);
+                    });
+                    if (!s->connected) { break; }
+                    if (s->skip && skip_ahead(s)) { continue; }
+
+                    if (wants_flush(s)) {
+                        uint64_t upto = s->cursor;
+                        lock.unlock();
+                        s->flush();
+                        lock.lock();
+                        s->flushed = upto;
+                        cnd_space.notify_all();
+                        continue;
+                    }
+                    if (s->cursor == tail) { break; }   // closed and written out
+
+                    size_t off = s->cursor % buffer_size;
+                    size_t n = std::min(std::min((size_t)(tail - s->cursor), buffer_size - off),
+                                        max_segment);
+                    // To be dropped: only the rest of the write it is in.
+                    if (s->skip) { n = std::min(n, (size_t)(end_of_write(s->cursor) - s->cursor)); }
+                    s->writing = true;
+                    lock.unlock();
+                    size_t n_write = s->write(buffer + off, n);
+                    lock.lock();
+                    s->writing = false;
+
+                    if (n_write == 0) {
+                        s->connected = false;
+                        cnd_space.notify_all();
+                        break;
+                    }
+                    s->cursor += n_write;
+                    cnd_space.notify_all();
+                }
+
+                bool lost = !s->connected;
+                s->connected = false;
+                cnd_space.notify_all();
+                lock.unlock();
+
+                // A sink that kept up to the close gets what it holds
+                // back pushed out; a lost one is only closed.
+                if (!lost) { s->flush(); }
+                s->close();
+            }
+        };
+
+        std::unique_ptr<Body> body;
+    };
+
+    template <>
+    struct Flush<TeeWriter> {
+        void operator() (TeeWriter& wr) const {
+            wr.flush();
+        }
+    };
+
+}
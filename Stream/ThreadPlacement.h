@@ -0,0 +1,183 @@
+#pragma once
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "RingMemory.h"
+
+namespace Stream {
+
+    /*****************************************************************
+     *
+     * Where the thread of a BufferedReader / BufferedWriter runs.
+     *
+     *   BufferedReader<PosixFile> rd(PosixFile(fd), 0,
+     *                                ThreadPlacement::near_caller().with_first_touch());
+     *
+     * By default the scheduler decides, and on a machine with several
+     * NUMA nodes the thread may end up on another node than the one
+     * that reads (or writes) the ring, so the ring's cache lines cross
+     * the interconnect.  near_caller() keeps the thread on the CPUs of
+     * the node the creating thread runs on; on_cpus() on a given set.
+     *
+     * Pages land on the node of the thread that first stores to them.
+     * with_first_touch() has the placed thread fault the whole ring in
+     * before the stream is handed out.  A ring given back while idle
+     * (see RingMemory) is faulted in again by whoever stores to it
+     * first: the thread of a reader, the user of a writer.
+     *
+     * Placement is a hint: where CPU affinity is not supported, or the
+     * CPUs cannot be found out, the thread runs anywhere.
+     *
+     *****************************************************************/
+    class ThreadPlacement {
+    public:
+        ThreadPlacement() : touch(false) {}
+
+        // The CPUs of the NUMA node the calling thread runs on.
+        static ThreadPlacement near_caller() {
+            ThreadPlacement p;
+#if defined(__linux__)
+            int cpu = ::sched_getcpu();
+            int node = cpu < 0 ? -1 : node_of(cpu);
+            if (node >= 0) {
+                char path[64];
+                std::snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+                p.cpu_list = read_cpulist(path);
+            }
+#endif
+            return p;
+        }
+
+        static ThreadPlacement on_cpus(std::vector<int> cpus) {
+            ThreadPlacement p;
+            p.cpu_list = std::move(cpus);
+            return p;
+        }
+
+        ThreadPlacement with_first_touch(bool on = true) const {
+            ThreadPlacement p = *this;
+            p.touch = on;
+            return p;
+        }
+
+        // Empty if the thread may run anywhere.
+        const std::vector<int>& cpus() const {
+            return cpu_list;
+        }
+
+        bool first_touch() const {
+            return touch;
+        }
+
+        // Binds the calling thread to the CPUs.  Returns false if it
+        // could not.
+        bool apply() const {
+            if (cpu_list.empty()) { return true; }
+#if defined(__linux__)
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int cpu : cpu_list) {
+                if (cpu >= 0 && cpu < CPU_SETSIZE) { CPU_SET(cpu, &set); }
+            }
+            return ::pthread_setaffinity_np(::pthread_self(), sizeof set, &set) == 0;
+#else
+            return false;
+#endif
+        }
+
+    private:
+        std::vector<int> cpu_list;
+        bool touch;
+
+#if defined(__linux__)
+        // The node whose directory is linked from the CPU's, or -1.
+        static int node_of(int cpu) {
+            char path[64];
+            std::snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d", cpu);
+            DIR* dir = ::opendir(path);
+            if (dir == nullptr) { return -1; }
+
+            int node = -1;
+            while (dirent* e = ::readdir(dir)) {
+                if (std::strncmp(e->d_name, "node", 4) == 0 &&
+                    e->d_name[4] >= '0' && e->d_name[4] <= '9')
+                {
+                    node = std::atoi(e->d_name + 4);
+                    break;
+                }
+            }
+            ::closedir(dir);
+            return node;
+        }
+
+        // Parses a list like "0-7,16-23".
+        static std::vector<int> read_cpulist(const char* path) {
+            std::vector<int> cpus;
+            FILE* f = std::fopen(path, "r");
+            if (f == nullptr) { return cpus; }
+
+            int lo, hi;
+            while (std::fscanf(f, "%d", &lo) == 1) {
+                hi = lo;
+                int c = std::fgetc(f);
+                if (c == '-') {
+                    if (std::fscanf(f, "%d", &hi) != 1) { break; }
+                    c = std::fgetc(f);
+                }
+                for (int cpu = lo; cpu <= hi; ++cpu) { cpus.push_back(cpu); }
+                if (c != ',') { break; }
+            }
+            std::fclose(f);
+            return cpus;
+        }
+#endif
+    };
+
+    // Starts `run` on a thread placed as `placement` says.  With first
+    // touch, the thread faults in the `size` bytes of `ring` before
+    // `run`, and the call returns only once it has.
+    template <class Run>
+    std::thread _placed_thread(const ThreadPlacement& placement,
+                               char* ring, size_t size, size_t& resident, Run run)
+    {
+        if (!placement.first_touch()) {
+            return std::thread([placement, run] {
+                placement.apply();
+                run();
+            });
+        }
+
+        std::mutex mtx;
+        std::condition_variable cnd;
+        bool ready = false;
+
+        std::thread thread([&, placement, run, ring, size] {
+            placement.apply();
+            RingMemory::populate(ring, size, resident);
+            {
+                // Notified under the lock: the waiter owns mtx and cnd.
+                std::lock_guard<std::mutex> lock(mtx);
+                ready = true;
+                cnd.notify_one();
+            }
+            run();
+        });
+
+        std::unique_lock<std::mutex> lock(mtx);
+        cnd.wait(lock, [&] { return ready; });
+        return thread;
+    }
+
+}
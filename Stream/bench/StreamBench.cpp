@@ -0,0 +1,430 @@
+/*****************************************************************
+ *
+ * Throughput / latency benchmarks of the Stream headers.
+ *
+ *   make                    (see Makefile)
+ *   ./StreamBench [megabytes]
+ *
+ * Every result is one JSON object per line on stdout:
+ *
+ *   {"bench":"reader.read","endpoint":"pipe","param":4096,
+ *    "ops":..., "bytes":..., "ns":..., "mb_s":..., "ns_op":...}
+ *
+ * Runs whose "bench" starts with "raw." or "stdio." are the
+ * baselines of the Stream runs of the same name.
+ *
+ *****************************************************************/
+
+#include "Stream/Stream.h"
+#include "Stream/StreamUtility.h"
+
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace Stream;
+
+static size_t total_bytes = 64 << 20;
+
+static const size_t LINE_LEN = 80;
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void emit(const char* bench, const char* endpoint, size_t param,
+                 uint64_t ops, uint64_t bytes, uint64_t ns)
+{
+    if (ns == 0) { ns = 1; }
+    std::printf("{\"bench\":\"%s\",\"endpoint\":\"%s\",\"param\":%zu,"
+                "\"ops\":%llu,\"bytes\":%llu,\"ns\":%llu,"
+                "\"mb_s\":%.1f,\"ns_op\":%.1f}\n",
+                bench, endpoint, param,
+                (unsigned long long)ops, (unsigned long long)bytes,
+                (unsigned long long)ns,
+                bytes * 1e3 / ns, ops ? (double)ns / ops : 0.0);
+    std::fflush(stdout);
+}
+
+/*****************************************************************
+ * Endpoints
+ *****************************************************************/
+
+static std::string temp_path() {
+    char path[] = "/tmp/StreamBench.XXXXXX";
+    int fd = ::mkstemp(path);
+    if (fd < 0) { std::perror("mkstemp"); std::exit(1); }
+    ::close(fd);
+    return path;
+}
+
+// Text of `size` bytes made of LINE_LEN-byte lines.
+static const std::vector<char>& line_data() {
+    static std::vector<char> data;
+    if (data.empty()) {
+        data.resize(1 << 20);
+        for (size_t i = 0; i < data.size(); ++i) {
+            data[i] = (i % LINE_LEN == LINE_LEN-1) ? '\n' : 'a' + i % 26;
+        }
+    }
+    return data;
+}
+
+static void write_all(int fd, size_t size) {
+    const std::vector<char>& data = line_data();
+    while (size > 0) {
+        size_t n = std::min(size, data.size());
+        ssize_t w = ::write(fd, data.data(), n);
+        if (w <= 0) { break; }
+        size -= w;
+    }
+}
+
+static void drain_all(int fd) {
+    char buf[65536];
+    while (::read(fd, buf, sizeof buf) > 0) {}
+}
+
+// A source of `total_bytes` of text: returns the fd to read from and
+// the thread that feeds it (if any).
+struct Source {
+    int fd;
+    std::thread feeder;
+
+    Source(const char* endpoint) {
+        int p[2];
+        if (std::string(endpoint) == "file") {
+            std::string path = temp_path();
+            int w = ::open(path.c_str(), O_WRONLY);
+            write_all(w, total_bytes);
+            ::close(w);
+            fd = ::open(path.c_str(), O_RDONLY);
+            ::unlink(path.c_str());
+            return;
+        }
+        if (std::string(endpoint) == "pipe") {
+            if (::pipe(p) != 0) { std::perror("pipe"); std::exit(1); }
+        } else {
+            if (::socketpair(AF_UNIX, SOCK_STREAM, 0, p) != 0) {
+                std::perror("socketpair"); std::exit(1);
+            }
+        }
+        fd = p[0];
+        int w = p[1];
+        feeder = std::thread([w] { write_all(w, total_bytes); ::close(w); });
+    }
+
+    void join() {
+        if (feeder.joinable()) { feeder.join(); }
+    }
+};
+
+// A sink that swallows everything: returns the fd to write to and the
+// thread that drains it (if any).
+struct Sink {
+    int fd;
+    std::thread drainer;
+
+    Sink(const char* endpoint) {
+        int p[2];
+        if (std::string(endpoint) == "file") {
+            std::string path = temp_path();
+            fd = ::open(path.c_str(), O_WRONLY | O_TRUNC);
+            ::unlink(path.c_str());
+            return;
+        }
+        if (std::string(endpoint) == "pipe") {
+            if (::pipe(p) != 0) { std::perror("pipe"); std::exit(1); }
+        } else {
+            if (::socketpair(AF_UNIX, SOCK_STREAM, 0, p) != 0) {
+                std::perror("socketpair"); std::exit(1);
+            }
+        }
+        fd = p[1];
+        int r = p[0];
+        drainer = std::thread([r] { drain_all(r); ::close(r); });
+    }
+
+    void join() {
+        if (drainer.joinable()) { drainer.join(); }
+    }
+};
+
+static const char* const ENDPOINTS[] = { "pipe", "socketpair", "file" };
+
+/*****************************************************************
+ * BufferedReader
+ *****************************************************************/
+
+static void bench_reader(const char* ep, size_t buffer_size) {
+    const size_t CHUNK = 4096;
+    char buf[CHUNK];
+
+    {
+        Source src(ep);
+        uint64_t ops = 0, bytes = 0, t0 = now_ns();
+        {
+            BufferedReader<PosixFile> rd(PosixFile(src.fd), buffer_size);
+            size_t n;
+            while ((n = rd.read(buf, CHUNK)) != 0) { bytes += n; ++ops; }
+        }
+        emit("reader.read", ep, buffer_size, ops, bytes, now_ns() - t0);
+        src.join();
+    }
+    {
+        Source src(ep);
+        uint64_t bytes = 0, t0 = now_ns();
+        {
+            BufferedReader<PosixFile> rd(PosixFile(src.fd), buffer_size);
+            while (rd.peek() >= 0) { ++bytes; }
+        }
+        emit("reader.peek", ep, buffer_size, bytes, bytes, now_ns() - t0);
+        src.join();
+    }
+    {
+        Source src(ep);
+        uint64_t ops = 0, bytes = 0, t0 = now_ns();
+        {
+            BufferedReader<PosixFile> rd(PosixFile(src.fd), buffer_size);
+            size_t n;
+            while ((n = rd.readline(buf, CHUNK, "\n")) != 0) { bytes += n; ++ops; }
+        }
+        emit("reader.readline", ep, buffer_size, ops, bytes, now_ns() - t0);
+        src.join();
+    }
+}
+
+static void bench_reader_baselines(const char* ep) {
+    const size_t CHUNK = 4096;
+    char buf[CHUNK];
+
+    {
+        Source src(ep);
+        uint64_t ops = 0, bytes = 0, t0 = now_ns();
+        ssize_t n;
+        while ((n = ::read(src.fd, buf, CHUNK)) > 0) { bytes += n; ++ops; }
+        ::close(src.fd);
+        emit("raw.read", ep, CHUNK, ops, bytes, now_ns() - t0);
+        src.join();
+    }
+    {
+        Source src(ep);
+        uint64_t ops = 0, bytes = 0, t0 = now_ns();
+        FILE* f = ::fdopen(src.fd, "r");
+        size_t n;
+        while ((n = std::fread(buf, 1, CHUNK, f)) != 0) { bytes += n; ++ops; }
+        std::fclose(f);
+        emit("stdio.read", ep, CHUNK, ops, bytes, now_ns() - t0);
+        src.join();
+    }
+    {
+        Source src(ep);
+        uint64_t bytes = 0, t0 = now_ns();
+        FILE* f = ::fdopen(src.fd, "r");
+        while (std::getc(f) != EOF) { ++bytes; }
+        std::fclose(f);
+        emit("stdio.peek", ep, 0, bytes, bytes, now_ns() - t0);
+        src.join();
+    }
+    {
+        Source src(ep);
+        uint64_t ops = 0, bytes = 0, t0 = now_ns();
+        FILE* f = ::fdopen(src.fd, "r");
+        while (std::fgets(buf, CHUNK, f) != nullptr) { bytes += std::strlen(buf); ++ops; }
+        std::fclose(f);
+        emit("stdio.readline", ep, 0, ops, bytes, now_ns() - t0);
+        src.join();
+    }
+}
+
+/*****************************************************************
+ * BufferedWriter
+ *****************************************************************/
+
+static void bench_writer(const char* ep, size_t write_size) {
+    const std::vector<char>& data = line_data();
+    uint64_t ops = total_bytes / write_size;
+
+    {
+        Sink sink(ep);
+        uint64_t t0 = now_ns();
+        {
+            BufferedWriter<PosixFile> wr(PosixFile(sink.fd), 65536, 16384);
+            for (uint64_t i = 0; i < ops; ++i) { wr.write(data.data(), write_size); }
+            wr.flush();
+        }
+        emit("writer.write", ep, write_size, ops, ops * write_size, now_ns() - t0);
+        sink.join();
+    }
+    {
+        Sink sink(ep);
+        uint64_t t0 = now_ns();
+        FILE* f = ::fdopen(sink.fd, "w");
+        std::setvbuf(f, nullptr, _IOFBF, 65536);
+        for (uint64_t i = 0; i < ops; ++i) { std::fwrite(data.data(), 1, write_size, f); }
+        std::fclose(f);
+        emit("stdio.write", ep, write_size, ops, ops * write_size, now_ns() - t0);
+        sink.join();
+    }
+}
+
+static void bench_flush(const char* ep) {
+    const std::vector<char>& data = line_data();
+    const size_t SIZE = 64;
+    const uint64_t ops = 20000;
+
+    {
+        Sink sink(ep);
+        uint64_t t0 = now_ns();
+        {
+            BufferedWriter<PosixFile> wr(PosixFile(sink.fd));
+            for (uint64_t i = 0; i < ops; ++i) {
+                wr.write(data.data(), SIZE);
+                wr.flush();
+            }
+        }
+        emit("writer.flush", ep, SIZE, ops, ops * SIZE, now_ns() - t0);
+        sink.join();
+    }
+    {
+        Sink sink(ep);
+        uint64_t t0 = now_ns();
+        for (uint64_t i = 0; i < ops; ++i) {
+            if (::write(sink.fd, data.data(), SIZE) <= 0) { break; }
+        }
+        ::close(sink.fd);
+        emit("raw.flush", ep, SIZE, ops, ops * SIZE, now_ns() - t0);
+        sink.join();
+    }
+    {
+        Sink sink(ep);
+        uint64_t t0 = now_ns();
+        FILE* f = ::fdopen(sink.fd, "w");
+        for (uint64_t i = 0; i < ops; ++i) {
+            std::fwrite(data.data(), 1, SIZE, f);
+            std::fflush(f);
+        }
+        std::fclose(f);
+        emit("stdio.flush", ep, SIZE, ops, ops * SIZE, now_ns() - t0);
+        sink.join();
+    }
+}
+
+/*****************************************************************
+ * print
+ *****************************************************************/
+
+// Counts bytes without a syscall, so only formatting is measured.
+struct NullWriter {
+    uint64_t bytes;
+    NullWriter() : bytes(0) {}
+    size_t write(const void*, size_t size) { bytes += size; return size; }
+};
+
+template <class Type>
+static void bench_print(const char* name, Type value) {
+    const uint64_t ops = 4000000;
+    NullWriter wr;
+    uint64_t t0 = now_ns();
+    for (uint64_t i = 0; i < ops; ++i) {
+        print(wr, value);
+        asm volatile("" : : "g"(&wr) : "memory");
+    }
+    emit(name, "memory", 0, ops, wr.bytes, now_ns() - t0);
+}
+
+static void bench_print_baselines() {
+    const uint64_t ops = 4000000;
+    char buf[64];
+    uint64_t bytes = 0, t0 = now_ns();
+    for (uint64_t i = 0; i < ops; ++i) {
+        bytes += std::snprintf(buf, sizeof buf, "%d", -1234567);
+        asm volatile("" : : "g"(buf) : "memory");
+    }
+    emit("stdio.print.int", "memory", 0, ops, bytes, now_ns() - t0);
+
+    bytes = 0; t0 = now_ns();
+    for (uint64_t i = 0; i < ops; ++i) {
+        bytes += std::snprintf(buf, sizeof buf, "%llu", 18446744073709551615ULL);
+        asm volatile("" : : "g"(buf) : "memory");
+    }
+    emit("stdio.print.ulonglong", "memory", 0, ops, bytes, now_ns() - t0);
+}
+
+/*****************************************************************
+ * copy_io
+ *****************************************************************/
+
+static void bench_copy(const char* ep, size_t bufsize) {
+    Source src(ep);
+    Sink sink("pipe");
+    uint64_t t0 = now_ns();
+    {
+        PosixFile rd(src.fd), wr(sink.fd);
+        copy_io(rd, wr, bufsize);
+    }
+    emit("copy_io", ep, bufsize, 0, total_bytes, now_ns() - t0);
+    src.join();
+    sink.join();
+}
+
+static void bench_copy_baseline(const char* ep, size_t bufsize) {
+    Source src(ep);
+    Sink sink("pipe");
+    std::vector<char> buf(bufsize);
+    uint64_t bytes = 0, t0 = now_ns();
+    ssize_t n;
+    while ((n = ::read(src.fd, buf.data(), bufsize)) > 0) {
+        if (::write(sink.fd, buf.data(), n) != n) { break; }
+        bytes += n;
+    }
+    ::close(src.fd);
+    ::close(sink.fd);
+    emit("raw.copy_io", ep, bufsize, 0, bytes, now_ns() - t0);
+    src.join();
+    sink.join();
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        total_bytes = (size_t)std::atol(argv[1]) << 20;
+    }
+
+    for (const char* ep : ENDPOINTS) {
+        for (size_t size : { 4096, 65536, 1 << 20 }) {
+            bench_reader(ep, size);
+        }
+        bench_reader_baselines(ep);
+    }
+
+    for (const char* ep : ENDPOINTS) {
+        for (size_t size : { 16, 256 }) {
+            bench_writer(ep, size);
+        }
+        bench_flush(ep);
+    }
+
+    bench_print("print.int", -1234567);
+    bench_print("print.ulonglong", 18446744073709551615ULL);
+    bench_print("print.cstr", "hello, world");
+    bench_print("print.string", std::string("hello, world"));
+    bench_print("print.char", 'x');
+    bench_print_baselines();
+
+    for (const char* ep : ENDPOINTS) {
+        for (size_t size : { 4096, 65536 }) {
+            bench_copy(ep, size);
+            bench_copy_baseline(ep, size);
+        }
+    }
+
+    return 0;
+}
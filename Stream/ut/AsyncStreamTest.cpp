@@ -0,0 +1,102 @@
+// g++ -std=c++20 -fsanitize=address -I../.. AsyncStreamTest.cpp -o AsyncStreamTest
+
+#include "Stream/AsyncStream.h"
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <thread>
+
+using namespace Stream;
+
+// The session ends, and frees its reader and writer, when its read
+// returns; the writer's event is in the same epoll batch, behind it.
+Task<> session(EventLoop& loop, int in, int out, size_t& got) {
+    AsyncReader rd(loop, PosixFile(in));
+    AsyncWriter wr(loop, PosixFile(out));
+    char c;
+    got = co_await rd.async_read(&c, 1);
+}
+
+static void test_destroy_in_batch() {
+    int a[2], b[2];
+    int res = ::pipe(a);
+    assert(res == 0);
+    res = ::pipe(b);
+    assert(res == 0);
+
+    // b is full, so its writer is not ready when registered.
+    ::fcntl(b[1], F_SETFL, O_NONBLOCK);
+    char fill[4096] = {};
+    while (::write(b[1], fill, sizeof fill) > 0) {}
+
+    EventLoop loop;
+    size_t got = 0;
+    loop.spawn(session(loop, a[0], b[1], got));
+
+    ssize_t n = ::write(a[1], "x", 1);                  // reader first
+    assert(n == 1);
+    n = ::read(b[0], fill, sizeof fill);                // then writer
+    assert(n == sizeof fill);
+
+    loop.run();
+    assert(got == 1);
+    ::close(a[1]);
+    ::close(b[0]);
+}
+
+// A producer faster than the file is suspended at the high-water mark
+// instead of buffering all it writes.
+Task<> produce(EventLoop& loop, int out, size_t& most) {
+    AsyncWriter wr(loop, PosixFile(out), 4096);
+    char chunk[1000] = {};
+    for (int i = 0; i < 200; ++i) {
+        if (i % 2 == 0) {
+            size_t n = co_await wr.async_write(chunk, sizeof chunk);
+            assert(n == sizeof chunk);
+        } else {
+            // As print() does.
+            wr.write(chunk, sizeof chunk);
+            bool ok = co_await wr.async_room();
+            assert(ok);
+        }
+        if (wr.pending() > most) { most = wr.pending(); }
+    }
+    bool ok = co_await wr.async_flush();
+    assert(ok);
+}
+
+static void test_high_water() {
+    int p[2];
+    int res = ::pipe(p);
+    assert(res == 0);
+
+    size_t total = 0;
+    std::thread reader([&] {
+        char buf[4096];
+        for ( ; ; ) {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+            ssize_t n = ::read(p[0], buf, sizeof buf);
+            if (n <= 0) { break; }
+            total += n;
+        }
+    });
+
+    EventLoop loop;
+    size_t most = 0;
+    loop.spawn(produce(loop, p[1], most));
+    loop.run();
+    reader.join();
+    ::close(p[0]);
+
+    assert(total == 200 * 1000);
+    assert(most <= 4096);
+}
+
+int main() {
+    test_destroy_in_batch();
+    test_high_water();
+    std::puts("ok");
+    return 0;
+}
@@ -0,0 +1,103 @@
+// g++ -std=c++11 -I../.. BufferedReaderTest.cpp -o BufferedReaderTest -pthread
+
+#include "Stream/Stream.h"
+#include "Stream/RingMemory.h"
+#include "Stream/SocketReader.h"
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace Stream;
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// The destructor stops a thread blocked on a file that stays open,
+// without the token having been taken.
+template <class Reader>
+static void test_destroy_blocked(Reader&& file, int peer) {
+    Clock::time_point start;
+    {
+        BufferedReader<Reader> rd(std::move(file), 4096);
+        ssize_t n = ::write(peer, "abc", 3);
+        assert(n == 3);
+        char buf[3];
+        size_t got = rd.read(buf, 3);
+        assert(got == 3);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        start = Clock::now();
+    }
+    assert(seconds_since(start) < 1.0);
+}
+
+// The ring is given back while the thread is still blocked waiting
+// for more, not once the next read returns.
+static void test_idle_release() {
+    int p[2];
+    int res = ::pipe(p);
+    assert(res == 0);
+
+    BufferedReader<PosixFile> rd(PosixFile(p[0]), 65536);
+    rd.set_idle_release(std::chrono::milliseconds(50));
+    char buf[100] = {};
+    ssize_t n = ::write(p[1], buf, sizeof buf);
+    assert(n == sizeof buf);
+    size_t got = rd.read(buf, sizeof buf);
+    assert(got == sizeof buf);
+    assert(RingMemory::in_use() != 0);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    assert(RingMemory::in_use() == 0);
+
+    n = ::write(p[1], buf, 10);
+    assert(n == 10);
+    got = rd.read(buf, 10);
+    assert(got == 10);
+    assert(RingMemory::in_use() != 0);
+    ::close(p[1]);
+}
+
+static void test_cancel_blocked() {
+    int p[2];
+    int res = ::pipe(p);
+    assert(res == 0);
+
+    BufferedReader<PosixFile> rd(PosixFile(p[0]), 4096);
+    std::thread t([&rd] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        rd.cancel();
+    });
+    char c;
+    size_t got = rd.read(&c, 1);
+    assert(got == 0);
+    assert(rd.at_end());
+    t.join();
+    ::close(p[1]);
+}
+
+int main() {
+    int p[2];
+    int res = ::pipe(p);
+    assert(res == 0);
+    test_destroy_blocked(PosixFile(p[0]), p[1]);
+    ::close(p[1]);
+
+    int sv[2];
+    res = ::socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    assert(res == 0);
+    test_destroy_blocked(SocketReader(PosixFile(sv[0])), sv[1]);
+    ::close(sv[1]);
+
+    test_idle_release();
+    test_cancel_blocked();
+    std::puts("ok");
+    return 0;
+}
@@ -0,0 +1,82 @@
+// g++ -std=c++11 -I../.. BufferedWriterTest.cpp -o BufferedWriterTest -pthread
+
+#include "Stream/Stream.h"
+#include "Stream/SocketWriter.h"
+
+#include <arpa/inet.h>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace Stream;
+
+typedef std::chrono::steady_clock Clock;
+
+// A connected pair of TCP sockets on the loopback.
+static void tcp_pair(int& client, int& server) {
+    int lsn = ::socket(AF_INET, SOCK_STREAM, 0);
+    assert(lsn >= 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof addr;
+    int res = ::bind(lsn, (sockaddr*)&addr, len);
+    assert(res == 0);
+    res = ::listen(lsn, 1);
+    assert(res == 0);
+    res = ::getsockname(lsn, (sockaddr*)&addr, &len);
+    assert(res == 0);
+
+    client = ::socket(AF_INET, SOCK_STREAM, 0);
+    assert(client >= 0);
+    res = ::connect(client, (sockaddr*)&addr, len);
+    assert(res == 0);
+    server = ::accept(lsn, nullptr, nullptr);
+    assert(server >= 0);
+    ::close(lsn);
+}
+
+// The latency deadline has the thread write the ring out on its own;
+// the cork then holds the partial segment back until flush(), which
+// finds the ring empty but must still push it out.
+static void test_corked_flush() {
+    int client, server;
+    tcp_pair(client, server);
+
+    SocketWriter sw{ PosixFile(client) };
+    sw.set_cork(true);
+    BufferedWriter<SocketWriter> wr(std::move(sw), 4096);
+    wr.set_max_latency(std::chrono::milliseconds(1));
+
+    char buf[100] = {};
+    size_t n = wr.write(buf, sizeof buf);
+    assert(n == sizeof buf);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    pollfd pf = { server, POLLIN, 0 };
+    int ready = ::poll(&pf, 1, 0);
+    assert(ready == 0);
+
+    Clock::time_point start = Clock::now();
+    bool done = wr.flush();
+    assert(done);
+    ready = ::poll(&pf, 1, 1000);
+    assert(ready == 1);
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    assert(elapsed < 0.1);
+
+    ssize_t got = ::recv(server, buf, sizeof buf, MSG_WAITALL);
+    assert(got == sizeof buf);
+    wr.close();
+    ::close(server);
+}
+
+int main() {
+    test_corked_flush();
+    std::puts("ok");
+    return 0;
+}
@@ -0,0 +1,105 @@
+// g++ -std=c++11 -I../.. ChecksumTest.cpp -o ChecksumTest -pthread
+
+#include "Stream/Stream.h"
+#include "Stream/Checksum.h"
+#include "Stream/MemoryStream.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+using namespace Stream;
+
+static uint32_t crc32c(const std::string& s) {
+    Crc32c crc;
+    crc.update(s.data(), s.size());
+    return crc.value();
+}
+
+// Bit by bit, to check the table and instruction paths against.
+static uint32_t crc32c_bitwise(const unsigned char* p, size_t size) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; ++i) {
+        crc ^= p[i];
+        for (int k = 0; k < 8; ++k) { crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1))); }
+    }
+    return ~crc;
+}
+
+static uint64_t xxh64(const std::string& s, uint64_t seed = 0) {
+    XxHash64 h(seed);
+    h.update(s.data(), s.size());
+    return h.value();
+}
+
+int main() {
+    // RFC 3720, B.4.
+    std::string zeros(32, '\0'), ones(32, '\xff'), up, down;
+    for (int i = 0; i < 32; ++i) { up += (char)i; down += (char)(31 - i); }
+    assert(crc32c("") == 0);
+    assert(crc32c("123456789") == 0xE3069283);
+    assert(crc32c(zeros) == 0x8A9136AA);
+    assert(crc32c(ones) == 0x62A8AB43);
+    assert(crc32c(up) == 0x46DD794E);
+    assert(crc32c(down) == 0x113FDB5C);
+
+    // Every length and alignment around the block sizes of the
+    // interleaved path, whole and in pieces.
+    std::string data(30000, '\0');
+    for (auto& c : data) { c = (char)std::rand(); }
+    const unsigned char* p = (const unsigned char*)data.data();
+    for (size_t size : { 1, 7, 8, 255, 256, 257, 767, 768, 769, 8191, 24576, 24577, 29990 }) {
+        for (size_t off = 0; off < 8; ++off) {
+            uint32_t want = crc32c_bitwise(p + off, size);
+            assert(Crc32c::compute(0, p + off, size) == want);
+
+            Crc32c crc;
+            crc.update(p + off, size / 3);
+            crc.update(p + off + size / 3, size - size / 3);
+            assert(crc.value() == want);
+        }
+    }
+
+    // xxHash reference values.
+    assert(xxh64("") == 0xEF46DB3751D8E999ull);
+    assert(xxh64("a") == 0xD24EC4F1A98C6E5Bull);
+    assert(xxh64("abc") == 0x44BC2CF5AD770999ull);
+    assert(xxh64("Nobody inspects the spammish repetition") == 0xFBCEA83C8A378BF1ull);
+
+    // Streaming in any pieces gives the one-shot digest.
+    for (size_t size : { 0, 5, 31, 32, 33, 64, 100, 1000, 29999 }) {
+        std::string s = data.substr(0, size);
+        uint64_t want = xxh64(s, 42);
+        for (size_t step : { 1, 3, 31, 32, 33, 1000 }) {
+            XxHash64 h(42);
+            for (size_t i = 0; i < size; i += step) {
+                h.update(s.data() + i, std::min(step, size - i));
+            }
+            assert(h.value() == want);
+        }
+    }
+
+    // The trailer written by ChecksumWriter is verified by ChecksumReader.
+    ChecksumWriter<MemoryWriter> wr{ MemoryWriter() };
+    wr.write(data.data(), 10000);
+    wr.write_trailer();
+    std::string framed = wr.stream().str();
+    assert(framed.size() == 10004);
+
+    ChecksumReader<MemoryReader> rd(MemoryReader(framed.data(), framed.size()), true);
+    char buf[10004];
+    size_t n = 0, k;
+    while ((k = rd.read(buf + n, 777)) != 0) { n += k; }
+    assert(n == 10000 && std::memcmp(buf, data.data(), n) == 0);
+    assert(rd.verified());
+
+    framed[5] ^= 1;
+    ChecksumReader<MemoryReader> bad(MemoryReader(framed.data(), framed.size()), true);
+    while (bad.read(buf, sizeof buf) != 0) {}
+    assert(!bad.verified());
+
+    std::puts("ok");
+    return 0;
+}
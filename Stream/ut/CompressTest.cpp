@@ -0,0 +1,98 @@
+// g++ -std=c++11 -I../.. CompressTest.cpp -o CompressTest -pthread
+
+#include "Stream/Stream.h"
+#include "Stream/Compress.h"
+#include "Stream/MemoryStream.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <string>
+
+using namespace Stream;
+
+static std::string compress(const std::string& text, size_t block_size) {
+    CompressWriter<MemoryWriter> wr(MemoryWriter(), block_size);
+    size_t n = wr.write(text.data(), text.size());
+    assert(n == text.size());
+    bool ok = wr.flush();
+    assert(ok);
+    return wr.stream().str();
+}
+
+static std::string decompress(const std::string& packed) {
+    DecompressReader<MemoryReader> rd(MemoryReader(packed.data(), packed.size()));
+    std::string text;
+    char buf[1000];
+    while (size_t n = rd.read(buf, sizeof buf)) { text.append(buf, n); }
+    return text;
+}
+
+static bool rejected(const std::string& packed) {
+    try {
+        decompress(packed);
+    } catch (StreamException&) {
+        return true;
+    }
+    return false;
+}
+
+int main() {
+    std::string words, noise;
+    for (int i = 0; i < 200000; ++i) {
+        words += "lorem ipsum dolor sit amet "[i % 27];
+        if (i % 1000 == 0) { words += std::to_string(i); }
+        noise += (char)std::rand();
+    }
+
+    // Round trip, in blocks smaller and larger than the reads.
+    for (size_t block : { 100, 4096, 65536 }) {
+        std::string packed = compress(words, block);
+        assert(block < 65536 || packed.size() < words.size() / 4);
+        assert(decompress(packed) == words);
+        assert(decompress(compress(words.substr(0, 1), block)) == words.substr(0, 1));
+    }
+    assert(compress("", 4096).empty());
+
+    // Data that does not shrink is stored as is.
+    std::string stored = compress(noise.substr(0, 4096), 4096);
+    assert(stored.size() == 8 + 4096);
+    assert((unsigned char)stored[3] & 0x80);
+    assert(decompress(compress(noise, 65536)) == noise);
+
+    // Corrupt headers, and truncated blocks.
+    std::string packed = compress(words.substr(0, 10000), 65536);
+    std::string bad = packed;
+    bad[4] = 0x7f;                                  // original size
+    assert(rejected(bad));
+    bad = packed;
+    bad[2] = 0x7f;                                  // stored size
+    assert(rejected(bad));
+    assert(rejected(packed.substr(0, packed.size() - 10)));
+    assert(rejected(packed.substr(0, 5)));
+
+    // Under a BufferedReader, the error surfaces in read().
+    char path[] = "/tmp/CompressTestXXXXXX";
+    int fd = ::mkstemp(path);
+    assert(fd >= 0);
+    ssize_t n = ::write(fd, packed.data(), packed.size() - 10);
+    assert(n == (ssize_t)(packed.size() - 10));
+    ::lseek(fd, 0, SEEK_SET);
+    ::unlink(path);
+    {
+        BufferedReader<DecompressReader<PosixFile> > rd{
+            DecompressReader<PosixFile>(PosixFile(fd)) };
+        bool thrown = false;
+        try {
+            char buf[4096];
+            while (rd.read(buf, sizeof buf) != 0) {}
+        } catch (StreamException&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    std::puts("ok");
+    return 0;
+}
@@ -0,0 +1,156 @@
+// g++ -std=c++11 -I../.. DelimitedReaderTest.cpp -o DelimitedReaderTest -pthread
+
+#include "Stream/Stream.h"
+#include "Stream/DelimitedReader.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace Stream;
+
+typedef std::vector<std::vector<std::string> > Rows;
+
+// Hands out the text at most `step` bytes per read, so that the reads
+// end at any offset of a row.
+struct TextReader {
+    std::string text;
+    size_t pos;
+    size_t step;
+
+    size_t read(void* data, size_t size) {
+        size_t n = std::min(std::min(size, step), text.size() - pos);
+        text.copy((char*)data, n, pos);
+        pos += n;
+        return n;
+    }
+
+    void close() {}
+};
+
+// A byte at a time, to check the bitmask scan against.  Every quote
+// toggles quoting; a field both starting and ending with a quote is
+// unquoted, with doubled quotes made single.
+static Rows reference(const std::string& s, char delimiter, char quote) {
+    Rows rows;
+    size_t i = 0;
+    while (i < s.size()) {
+        std::vector<size_t> ends;
+        bool in_quote = false;
+        size_t j = i;
+        for ( ; j < s.size(); ++j) {
+            char c = s[j];
+            if (quote != '\0' && c == quote) {
+                in_quote = !in_quote;
+            } else if (!in_quote && c == delimiter) {
+                ends.push_back(j);
+            } else if (!in_quote && c == '\n') {
+                break;
+            }
+        }
+        size_t row_end = j;
+        if (row_end > i && s[row_end - 1] == '\r') { row_end -= 1; }
+        ends.push_back(row_end);
+
+        std::vector<std::string> row;
+        size_t start = i;
+        for (size_t end : ends) {
+            if (end > row_end) { end = row_end; }
+            std::string f = s.substr(start, end - start);
+            if (quote != '\0' && f.size() >= 2 && f[0] == quote && f[f.size() - 1] == quote) {
+                std::string raw = f.substr(1, f.size() - 2);
+                f.clear();
+                for (size_t k = 0; k < raw.size(); ++k) {
+                    f += raw[k];
+                    if (raw[k] == quote && k + 1 < raw.size() && raw[k + 1] == quote) { ++k; }
+                }
+            }
+            row.push_back(f);
+            start = end + 1;
+        }
+        rows.push_back(row);
+        i = j + 1;
+    }
+    return rows;
+}
+
+static Rows split(const std::string& s, char delimiter, char quote,
+                  size_t buffer_size, size_t step)
+{
+    TextReader file = { s, 0, step };
+    DelimitedReader<TextReader> rd(std::move(file), delimiter, quote, buffer_size);
+    DelimitedReader<TextReader>::Row row;
+    Rows rows;
+    while (rd.read_row(row)) {
+        std::vector<std::string> r;
+        for (auto& f : row) { r.push_back(std::string(f.data, f.size)); }
+        rows.push_back(r);
+    }
+    return rows;
+}
+
+static void check(const std::string& s, char delimiter = ',', char quote = '"') {
+    Rows expected = reference(s, delimiter, quote);
+    // A ring larger than the text, and rings that rows wrap around or
+    // outgrow, read whole or a few bytes at a time.
+    const size_t sizes[] = { 1 << 16, 256, 100 };
+    const size_t steps[] = { 1 << 16, 7 };
+    for (size_t size : sizes) {
+        for (size_t step : steps) {
+            Rows got = split(s, delimiter, quote, size, step);
+            assert(got == expected);
+        }
+    }
+}
+
+static void test_cases() {
+    check("");
+    check("a,b,c\n");
+    check("a,b,c");                             // no newline at the end
+    check("a,b\n\nc\n");                        // an empty row
+    check("a,b\r\nc,d\r\n");                    // CRLF
+    check("a,b\r\nc,d\r");
+    check("\"a,b\",c\n\"x\ny\",z\n");           // delimiter and newline quoted
+    check("\"say \"\"hi\"\"\",b\n");            // doubled quotes
+    check("\"\"\"\"\n\"\",\"\"\n");             // a lone quote, and empty
+    check("a\tb\"c\n", '\t', '\0');             // TSV, no quoting
+
+    // A quoted field across the 64-byte blocks, opening in one and
+    // closing in the next.
+    for (size_t at = 50; at < 140; ++at) {
+        std::string s = std::string(at, 'x') + ",\"" + std::string(30, 'q') +
+                        ",\n\"\"" + std::string(20, 'r') + "\",end\r\nlast,row";
+        Rows rows = reference(s, ',', '"');
+        assert(rows.size() == 2);
+        assert(rows[0].size() == 3);
+        check(s);
+    }
+
+    // Rows wrapping the end of the ring at every offset.
+    std::string s;
+    for (int i = 0; i < 200; ++i) {
+        s += std::string(i % 37, 'a') + ",\"b\"\"" + std::string(i % 11, ',') + "\"\r\n";
+    }
+    check(s);
+}
+
+static void test_random() {
+    const char alphabet[] = "ab,,\"\"\n\r";
+    for (int n = 0; n < 300; ++n) {
+        std::string s;
+        size_t size = std::rand() % 600;
+        for (size_t i = 0; i < size; ++i) {
+            s += alphabet[std::rand() % (sizeof alphabet - 1)];
+        }
+        check(s);
+    }
+}
+
+int main() {
+    test_cases();
+    test_random();
+    std::puts("ok");
+    return 0;
+}
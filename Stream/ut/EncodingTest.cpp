@@ -0,0 +1,212 @@
+// g++ -std=c++11 -I../.. EncodingTest.cpp -o EncodingTest -pthread
+
+#include "Stream/Stream.h"
+#include "Stream/Encoding.h"
+#include "Stream/MemoryStream.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+
+using namespace Stream;
+
+// A writer without reserve() / commit(), for the path through the
+// buffer on the stack.
+struct StringWriter {
+    std::string text;
+
+    size_t write(const void* data, size_t size) {
+        text.append((const char*)data, size);
+        return size;
+    }
+
+    void close() {}
+};
+
+// A byte at a time, to check the vector paths against.
+static std::string hex_reference(const std::string& s, bool upper) {
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    std::string out;
+    for (unsigned char c : s) {
+        out += digits[c >> 4];
+        out += digits[c & 15];
+    }
+    return out;
+}
+
+static std::string base64_reference(const std::string& s, bool url) {
+    const char* alphabet = url
+        ? "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"
+        : "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < s.size(); i += 3) {
+        uint32_t v = (unsigned char)s[i] << 16;
+        if (i + 1 < s.size()) { v |= (unsigned char)s[i + 1] << 8; }
+        if (i + 2 < s.size()) { v |= (unsigned char)s[i + 2]; }
+        out += alphabet[v >> 18];
+        out += alphabet[(v >> 12) & 63];
+        out += i + 1 < s.size() ? alphabet[(v >> 6) & 63] : '=';
+        out += i + 2 < s.size() ? alphabet[v & 63] : '=';
+    }
+    return out;
+}
+
+static std::string to_hex(const std::string& s, bool upper = false) {
+    MemoryWriter wr;
+    print(wr, hex(s, upper));
+    return wr.str();
+}
+
+static std::string to_base64(const std::string& s, bool url = false) {
+    MemoryWriter wr;
+    print(wr, base64(s, url));
+    return wr.str();
+}
+
+static std::string random_bytes(size_t size) {
+    std::string s(size, '\0');
+    for (auto& c : s) { c = (char)(std::rand() & 0xff); }
+    return s;
+}
+
+static void test_vectors() {
+    // RFC 4648, section 10.
+    assert(to_base64("") == "");
+    assert(to_base64("f") == "Zg==");
+    assert(to_base64("fo") == "Zm8=");
+    assert(to_base64("foo") == "Zm9v");
+    assert(to_base64("foob") == "Zm9vYg==");
+    assert(to_base64("fooba") == "Zm9vYmE=");
+    assert(to_base64("foobar") == "Zm9vYmFy");
+
+    assert(to_hex("") == "");
+    assert(to_hex("foobar") == "666f6f626172");
+    assert(to_hex("foobar", true) == "666F6F626172");
+    assert(to_hex(std::string("\x00\x7f\x80\xff", 4)) == "007f80ff");
+
+    // The two characters the url alphabet differs in.
+    std::string s("\xfb\xff\xbf", 3);
+    assert(to_base64(s) == "+/+/");
+    assert(to_base64(s, true) == "-_-_");
+}
+
+static void test_long() {
+    // Across the 16-byte hex and 12-byte base64 blocks, and the end of
+    // the inline room of the MemoryWriter.
+    for (size_t size = 0; size < 600; ++size) {
+        std::string s = random_bytes(size);
+        for (int flag = 0; flag < 2; ++flag) {
+            assert(to_hex(s, flag) == hex_reference(s, flag));
+            assert(to_base64(s, flag) == base64_reference(s, flag));
+
+            StringWriter sw;
+            print(sw, hex(s, flag), base64(s, flag));
+            assert(sw.text == hex_reference(s, flag) + base64_reference(s, flag));
+        }
+
+        std::string h = hex_reference(s, size & 1);
+        std::string back(size, '\0');
+        bool ok = hex_decode(h.data(), size, &back[0]);
+        assert(ok);
+        assert(back == s);
+
+        std::string b = base64_reference(s, size & 1);
+        std::string out(b.size() / 4 * 3 + 3, '\0');
+        size_t n = base64_decode(b.data(), b.size(), &out[0], size & 1);
+        assert(n == size);
+        assert(out.substr(0, size) == s);
+
+        // Unpadded.
+        size_t pad = b.size() - b.find_last_not_of('=') - 1;
+        if (b.empty()) { pad = 0; }
+        n = base64_decode(b.data(), b.size() - pad, &out[0], size & 1);
+        assert(n == size);
+        assert(out.substr(0, size) == s);
+    }
+}
+
+static void test_invalid() {
+    unsigned char out[64];
+    assert(!hex_decode("0g", 1, out));
+    assert(!hex_decode("G0", 1, out));
+    bool ok = hex_decode("aB", 1, out);
+    assert(ok && out[0] == 0xab);
+
+    // A bad digit in each position of a vector block.
+    std::string h = hex_reference(random_bytes(32), false);
+    for (size_t i = 0; i < h.size(); ++i) {
+        std::string bad = h;
+        bad[i] = 'x';
+        assert(!hex_decode(bad.data(), 32, out));
+    }
+
+    const size_t fail = (size_t)-1;
+    assert(base64_decode("Zm9v!", 5, out) == fail);
+    assert(base64_decode("Zm9", 3, out) == 2);
+    assert(base64_decode("Z", 1, out) == fail);
+    assert(base64_decode("Zm=v", 4, out) == fail);
+    assert(base64_decode("-_-_", 4, out) == fail);
+    assert(base64_decode("+/+/", 4, out, true) == fail);
+
+    std::string b = base64_reference(random_bytes(48), false);
+    for (size_t i = 0; i < b.size(); ++i) {
+        std::string bad = b;
+        bad[i] = '*';
+        assert(base64_decode(bad.data(), bad.size(), out) == fail);
+    }
+}
+
+static void test_read() {
+    std::string s = random_bytes(10000);
+    std::string text = hex_reference(s, false) + base64_reference(s, true);
+
+    MemoryReader rd(text.data(), text.size());
+    std::string a(s.size(), '\0'), b(s.size(), '\0');
+    bool ok = read_hex(rd, &a[0], a.size());
+    assert(ok);
+    ok = read_base64(rd, &b[0], b.size(), true);
+    assert(ok);
+    assert(a == s && b == s);
+    assert(rd.at_end());
+
+    // Short, and not hex.
+    MemoryReader shorter(text.data(), 9);
+    assert(!read_hex(shorter, &a[0], 5));
+    MemoryReader bad("12zz", 4);
+    assert(!read_hex(bad, &a[0], 2));
+}
+
+static void test_buffered() {
+    // In place in the ring, which wraps around more than once.
+    char path[] = "/tmp/EncodingTestXXXXXX";
+    int fd = ::mkstemp(path);
+    assert(fd >= 0);
+    ::unlink(path);
+
+    std::string s = random_bytes(100000);
+    {
+        BufferedWriter<PosixFile> wr(PosixFile(::dup(fd)), 4096);
+        print(wr, hex(s), base64(s));
+        wr.close();
+    }
+
+    std::string expected = hex_reference(s, false) + base64_reference(s, false);
+    std::string got(expected.size(), '\0');
+    ssize_t n = ::pread(fd, &got[0], got.size(), 0);
+    assert(n == (ssize_t)got.size());
+    assert(got == expected);
+    ::close(fd);
+}
+
+int main() {
+    test_vectors();
+    test_long();
+    test_invalid();
+    test_read();
+    test_buffered();
+    std::puts("ok");
+    return 0;
+}
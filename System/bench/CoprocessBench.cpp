@@ -0,0 +1,84 @@
+/*****************************************************************
+ *
+ * Spawn latency of Coprocess.
+ *
+ *   make                    (see Makefile)
+ *   ./CoprocessBench [count]
+ *
+ * Output is in the format of Stream/bench/StreamBench.cpp, one JSON
+ * object per line; "raw.*" runs are the fork/posix_spawn baselines.
+ *
+ *****************************************************************/
+
+#include "../Coprocess.h"
+
+#include <spawn.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void emit(const char* bench, uint64_t ops, uint64_t ns) {
+    if (ns == 0) { ns = 1; }
+    std::printf("{\"bench\":\"%s\",\"endpoint\":\"process\",\"param\":0,"
+                "\"ops\":%llu,\"bytes\":0,\"ns\":%llu,"
+                "\"mb_s\":0.0,\"ns_op\":%.1f}\n",
+                bench, (unsigned long long)ops, (unsigned long long)ns,
+                ops ? (double)ns / ops : 0.0);
+    std::fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    using namespace System;
+    using namespace Stream;
+
+    uint64_t count = argc > 1 ? std::atol(argv[1]) : 500;
+    char* const args[] = { (char*)"true", nullptr };
+
+    uint64_t t0 = now_ns();
+    for (uint64_t i = 0; i < count; ++i) {
+        Coprocess proc("/bin/true", { "true" }, { }, { });
+        proc.wait();
+    }
+    emit("coprocess.spawn", count, now_ns() - t0);
+
+    t0 = now_ns();
+    for (uint64_t i = 0; i < count; ++i) {
+        PosixFile out;
+        Coprocess proc("/bin/true", { "true" }, { FileNo(1) >>out }, { });
+        BufferedReader<PosixFile> rd(std::move(out));
+        char buf[16];
+        rd.read(buf, sizeof buf);
+        proc.wait();
+    }
+    emit("coprocess.spawn_pipe", count, now_ns() - t0);
+
+    t0 = now_ns();
+    for (uint64_t i = 0; i < count; ++i) {
+        pid_t pid = ::fork();
+        if (pid == 0) {
+            ::execve("/bin/true", args, environ);
+            ::_exit(-1);
+        }
+        int status;
+        ::waitpid(pid, &status, 0);
+    }
+    emit("raw.fork", count, now_ns() - t0);
+
+    t0 = now_ns();
+    for (uint64_t i = 0; i < count; ++i) {
+        pid_t pid;
+        if (::posix_spawn(&pid, "/bin/true", nullptr, nullptr, args, environ) == 0) {
+            int status;
+            ::waitpid(pid, &status, 0);
+        }
+    }
+    emit("raw.posix_spawn", count, now_ns() - t0);
+
+    return 0;
+}